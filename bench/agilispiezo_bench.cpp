@@ -0,0 +1,358 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Throughput and round-trip latency of libagilispiezo against emulated
+// controllers, so pacing and I/O changes can be measured without hardware.
+//
+//   agilispiezo_bench [--count N] [--controllers K] [--delay-us D]
+//                     [--baud B] [--fixed] [--prometheus] [--trace out.agtr]
+//
+// --trace captures the traffic of the single-controller scenarios, e.g.
+// as input for agilispiezo_replay.
+
+#include <agilispiezo/agilispiezo.h>
+#include <agilispiezo/controller_pool.h>
+#include <agilispiezo/trace.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "emulator.h"
+
+using namespace agilispiezo;
+
+namespace {
+
+struct BenchOptions {
+  int count = 200;
+  int controllers = 4;
+  bench::Emulator::Options emulator;
+  AgilisPiezo::PacingMode pacing = AgilisPiezo::PACING_ADAPTIVE;
+  bool prometheus = false;
+  const char* trace_path = nullptr;
+};
+
+double ElapsedUs(const sclock::time_point& begin, const sclock::time_point& end) {
+  return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+/// latencies_us: one entry per timed call, commands: commands those calls issued.
+void Report(const char* name, std::vector<double> latencies_us,
+  const size_t commands, const double total_us) {
+  if (latencies_us.empty()) return;
+  std::sort(latencies_us.begin(), latencies_us.end());
+  const size_t n = latencies_us.size();
+  const double p50 = latencies_us[n / 2];
+  const double p99 = latencies_us[std::min(n - 1, n * 99 / 100)];
+  std::printf("%-24s %8zu %10.1f %10.0f %10.0f\n", name, commands,
+    commands / (total_us / 1e6), p50, p99);
+}
+
+void Configure(AgilisPiezo& piezo, const BenchOptions& options) {
+  piezo.SetLogLevel(AgilisPiezo::LOG_ERROR);
+  piezo.SetPacingMode(options.pacing);
+}
+
+void BenchSync(AgilisPiezo& piezo, const BenchOptions& options) {
+  std::vector<double> latencies;
+  const sclock::time_point begin = sclock::now();
+  for (int i = 0; i < options.count; ++i) {
+    int steps = 0;
+    const sclock::time_point t = sclock::now();
+    piezo.TellNumberOfSteps(1, &steps);
+    latencies.push_back(ElapsedUs(t, sclock::now()));
+  }
+  Report("sync TP", latencies, latencies.size(), ElapsedUs(begin, sclock::now()));
+
+  latencies.clear();
+  const sclock::time_point begin_pr = sclock::now();
+  for (int i = 0; i < options.count; ++i) {
+    const sclock::time_point t = sclock::now();
+    piezo.RelativeMove(1, (i & 1) == 0, 1);
+    latencies.push_back(ElapsedUs(t, sclock::now()));
+  }
+  Report("sync PR", latencies, latencies.size(), ElapsedUs(begin_pr, sclock::now()));
+}
+
+void BenchQueued(AgilisPiezo& piezo, const BenchOptions& options) {
+  // Every TP on the wire here, the duplicates are measured by BenchCoalesced
+  const int64_t window = piezo.GetCoalescingWindow();
+  piezo.SetCoalescingWindow(-1);
+  std::vector<sclock::time_point> submitted;
+  std::vector<std::future<AgilisPiezo::CommandResult>> results;
+  const sclock::time_point begin = sclock::now();
+  for (int i = 0; i < options.count; ++i) {
+    submitted.push_back(sclock::now());
+    results.push_back(piezo.SubmitCommand(Command(1 + (i & 1), opcode::TP), true));
+  }
+  // Results complete in submission order, so waiting in order is accurate
+  std::vector<double> latencies;
+  for (size_t i = 0; i < results.size(); ++i) {
+    results[i].wait();
+    latencies.push_back(ElapsedUs(submitted[i], sclock::now()));
+  }
+  Report("queued TP", latencies, latencies.size(), ElapsedUs(begin, sclock::now()));
+  piezo.SetCoalescingWindow(window);
+}
+
+void BenchCoalesced(AgilisPiezo& piezo, const BenchOptions& options) {
+  // Threads polling the same axis, as several monitors of one stage would
+  constexpr int kThreads = 4;
+  const auto sent = [&piezo]() {
+    for (const auto& op : piezo.GetMetrics().opcodes) {
+      if (op.opcode == opcode::TP) return op.counters[COUNTER_SENT];
+    }
+    return uint64_t(0);
+  };
+  const uint64_t sent_before = sent();
+  std::vector<std::vector<double>> per_thread(kThreads);
+  std::vector<std::thread> threads;
+  const sclock::time_point begin = sclock::now();
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&piezo, &options, &per_thread, t]() {
+      for (int i = 0; i < options.count / kThreads; ++i) {
+        int steps = 0;
+        const sclock::time_point c = sclock::now();
+        piezo.TellNumberOfSteps(1, &steps);
+        per_thread[t].push_back(ElapsedUs(c, sclock::now()));
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  const double total_us = ElapsedUs(begin, sclock::now());
+  std::vector<double> latencies;
+  for (const auto& l : per_thread) latencies.insert(latencies.end(), l.begin(), l.end());
+  char name[32];
+  std::snprintf(name, sizeof(name), "TP x%d threads", kThreads);
+  Report(name, latencies, latencies.size(), total_us);
+  std::printf("%-24s %8llu TP on the wire\n", "",
+    static_cast<unsigned long long>(sent() - sent_before));
+}
+
+void BenchBatch(AgilisPiezo& piezo, const BenchOptions& options) {
+  // Configure both axes and start a move: 6 set-only commands per setup
+  const int setups = std::max(1, options.count / 10);
+  std::vector<double> latencies;
+  const sclock::time_point begin = sclock::now();
+  for (int i = 0; i < setups; ++i) {
+    const sclock::time_point t = sclock::now();
+    for (int axis = 1; axis <= 2; ++axis) {
+      piezo.SetStepAmplitude(axis, true, 30);
+      piezo.SetStepDelay(axis, 0);
+    }
+    piezo.RelativeMove(1, true, 1);
+    piezo.RelativeMove(2, true, 1);
+    latencies.push_back(ElapsedUs(t, sclock::now()));
+  }
+  Report("setup x6 sequential", latencies, latencies.size() * 6, ElapsedUs(begin, sclock::now()));
+
+  latencies.clear();
+  const sclock::time_point begin_batch = sclock::now();
+  for (int i = 0; i < setups; ++i) {
+    const sclock::time_point t = sclock::now();
+    piezo.Batch()
+      .SetStepAmplitude(1, true, 30).SetStepDelay(1, 0)
+      .SetStepAmplitude(2, true, 30).SetStepDelay(2, 0)
+      .RelativeMove(1, true, 1).RelativeMove(2, true, 1)
+      .Submit();
+    latencies.push_back(ElapsedUs(t, sclock::now()));
+  }
+  Report("setup x6 batch", latencies, latencies.size() * 6, ElapsedUs(begin_batch, sclock::now()));
+}
+
+void BenchStop(AgilisPiezo& piezo, const BenchOptions& options) {
+  // StopMotion() while the queue holds a burst of TP polls and a move
+  const int rounds = std::max(1, options.count / 10);
+  constexpr int kPolls = 50;
+  std::vector<double> latencies;
+  size_t cancelled = 0;
+  const sclock::time_point begin = sclock::now();
+  for (int i = 0; i < rounds; ++i) {
+    std::vector<std::future<AgilisPiezo::CommandResult>> polls;
+    for (int k = 0; k < kPolls; ++k) polls.push_back(piezo.SubmitCommand(Command(1 + (k & 1), opcode::TP), true));
+    std::future<AgilisPiezo::CommandResult> move = piezo.SubmitCommand(Command(1, opcode::PR).Append(1), false);
+    const sclock::time_point t = sclock::now();
+    piezo.StopMotion(1);
+    latencies.push_back(ElapsedUs(t, sclock::now()));
+    if (move.get().cancelled) ++cancelled;
+    for (auto& poll : polls) poll.wait();
+  }
+  Report("ST behind 50 TP", latencies, latencies.size(), ElapsedUs(begin, sclock::now()));
+  if (cancelled != static_cast<size_t>(rounds)) {
+    std::fprintf(stderr, "Stop cancelled %zu of %d queued moves\n", cancelled, rounds);
+  }
+}
+
+void BenchScan(AgilisPiezo& piezo) {
+  // Jog at 1700 steps/s for about half a second and time the samples
+  AgilisPiezo::JogScanOptions options;
+  options.stop_at_steps = true;
+  piezo.TellNumberOfSteps(1, &options.stop_steps);
+  options.stop_steps += 850;
+  const sclock::time_point begin = sclock::now();
+  std::shared_ptr<AgilisPiezo::ScanRing> ring = piezo.StartJogScan(options);
+  if (!ring) return;
+  std::vector<double> intervals;
+  AgilisPiezo::ScanSample sample;
+  sclock::time_point last = begin;
+  size_t samples = 0;
+  while (piezo.IsScanning() || ring->Size() > 0) {
+    if (!ring->Pop(&sample)) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      continue;
+    }
+    intervals.push_back(ElapsedUs(last, sample.time));
+    last = sample.time;
+    ++samples;
+  }
+  Report("jog scan TP samples", intervals, samples, ElapsedUs(begin, last));
+}
+
+void BenchFanOut(ControllerPool& pool, const BenchOptions& options) {
+  std::vector<double> latencies;
+  const sclock::time_point begin = sclock::now();
+  for (int i = 0; i < options.count; ++i) {
+    std::vector<int> steps;
+    const sclock::time_point t = sclock::now();
+    pool.TellNumberOfStepsAll(1, &steps);
+    latencies.push_back(ElapsedUs(t, sclock::now()));
+  }
+  char name[32];
+  std::snprintf(name, sizeof(name), "fan-out TP x%zu", pool.GetControllerCount());
+  Report(name, latencies, latencies.size() * pool.GetControllerCount(),
+    ElapsedUs(begin, sclock::now()));
+}
+
+/// Where the time of the single-controller scenarios went, per opcode.
+void PrintStages(const MetricsSnapshot& metrics) {
+  static const char* kStages[STAGE_COUNT] = { "queue", "pacing", "write", "first byte", "reply" };
+  std::printf("\n%-6s %-12s %8s %10s %10s\n", "opcode", "stage", "count", "p50 us", "p99 us");
+  for (const auto& op : metrics.opcodes) {
+    for (size_t s = 0; s < STAGE_COUNT; ++s) {
+      const LatencyHistogram::Snapshot& h = op.stages[s];
+      if (h.count == 0) continue;
+      std::printf("%-6s %-12s %8llu %10llu %10llu\n", op.opcode.c_str(), kStages[s],
+        static_cast<unsigned long long>(h.count),
+        static_cast<unsigned long long>(h.Percentile(0.5)),
+        static_cast<unsigned long long>(h.Percentile(0.99)));
+    }
+  }
+}
+
+bool ParseArgs(int argc, char* argv[], BenchOptions* options) {
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--count") == 0 && has_value) {
+      options->count = std::atoi(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--controllers") == 0 && has_value) {
+      options->controllers = std::atoi(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--delay-us") == 0 && has_value) {
+      options->emulator.response_delay_us = std::atoi(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--baud") == 0 && has_value) {
+      options->emulator.baud_rate = static_cast<unsigned int>(std::atoi(argv[++i]));
+    }
+    else if (std::strcmp(argv[i], "--fixed") == 0) {
+      options->pacing = AgilisPiezo::PACING_FIXED;
+    }
+    else if (std::strcmp(argv[i], "--prometheus") == 0) {
+      options->prometheus = true;
+    }
+    else if (std::strcmp(argv[i], "--trace") == 0 && has_value) {
+      options->trace_path = argv[++i];
+    }
+    else {
+      return false;
+    }
+  }
+  return options->count > 0 && options->controllers > 0;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  BenchOptions options;
+  if (!ParseArgs(argc, argv, &options)) {
+    std::fprintf(stderr, "Usage: %s [--count N] [--controllers K] [--delay-us D] [--baud B] [--fixed] [--prometheus] [--trace out.agtr]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<std::unique_ptr<bench::Emulator>> emulators;
+  for (int i = 0; i < options.controllers; ++i) {
+    emulators.emplace_back(new bench::Emulator(options.emulator));
+    if (!emulators.back()->Start()) {
+      std::fprintf(stderr, "Failed to open a pseudo terminal for the emulator\n");
+      return 1;
+    }
+  }
+
+  std::printf("pacing=%s count=%d delay=%dus baud=%u\n",
+    options.pacing == AgilisPiezo::PACING_FIXED ? "fixed" : "adaptive",
+    options.count, options.emulator.response_delay_us, options.emulator.baud_rate);
+  std::printf("%-24s %8s %10s %10s %10s\n", "scenario", "commands", "cmd/s", "p50 us", "p99 us");
+
+  {
+    AgilisPiezo piezo;
+    Configure(piezo, options);
+    if (!piezo.ConnectDeviceUSB(emulators[0]->GetPortName())) {
+      std::fprintf(stderr, "Failed to connect to the emulator\n");
+      return 1;
+    }
+    auto recorder = std::make_shared<TraceRecorder>();
+    if (options.trace_path != nullptr) {
+      if (!recorder->StartFileFlush(options.trace_path)) {
+        std::fprintf(stderr, "Cannot create %s\n", options.trace_path);
+        return 1;
+      }
+      piezo.SetTraceRecorder(recorder);
+    }
+    BenchSync(piezo, options);
+    BenchQueued(piezo, options);
+    BenchCoalesced(piezo, options);
+    BenchBatch(piezo, options);
+    BenchStop(piezo, options);
+    BenchScan(piezo);
+    piezo.SetTraceRecorder(nullptr);
+    recorder->StopFileFlush();
+    if (recorder->GetDroppedCount() > 0) {
+      std::fprintf(stderr, "Trace dropped %llu entries\n",
+        static_cast<unsigned long long>(recorder->GetDroppedCount()));
+    }
+    PrintStages(piezo.GetMetrics());
+    if (options.prometheus) std::printf("\n%s", piezo.GetMetricsPrometheus().c_str());
+  }
+
+  {
+    ControllerPool pool;
+    for (auto& emulator : emulators) {
+      auto piezo = pool.CreateController();
+      Configure(*piezo, options);
+      if (!piezo->ConnectDeviceUSB(emulator->GetPortName())) {
+        std::fprintf(stderr, "Failed to connect to the emulator\n");
+        return 1;
+      }
+    }
+    BenchFanOut(pool, options);
+  }
+  return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+// Replays a trace captured with TraceRecorder against the emulated
+// controller, so timing problems seen in the field can be reproduced
+// off-line. The commands of the trace are sent in order through the
+// library; each reply is compared with the one recorded. TX entries that
+// went out in one gathered write, e.g. a command batch, go out as one
+// write again.
+//
+//   agilispiezo_replay <trace.agtr> [--speed F] [--pty] [--delay-us D]
+//                      [--baud B] [--record out.agtr]
+//
+// --speed 0 (default) sends as fast as the engine allows, F > 0 keeps the
+// recorded gaps between commands divided by F. --pty talks to the emulator
+// through a pseudo terminal with its response delay and baud rate instead
+// of in memory.
+
+#include <agilispiezo/agilispiezo.h>
+#include <agilispiezo/memory_transport.h>
+#include <agilispiezo/metrics.h>
+#include <agilispiezo/trace.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "emulator.h"
+
+using namespace agilispiezo;
+
+namespace {
+
+struct ReplayOptions {
+  const char* trace_path = nullptr;
+  const char* record_path = nullptr;
+  double speed = 0;
+  bool pty = false;
+  bench::Emulator::Options emulator;
+};
+
+/// A command sent during the replay and the reply it got in the field.
+struct Replayed {
+  Command command; // Last command of the write, the one answered
+  size_t commands = 1;
+  std::future<AgilisPiezo::CommandResult> result;
+  bool expect_reply = false;
+  std::string recorded_reply;
+  int64_t recorded_latency_ns = 0;
+};
+
+struct ReplayStats {
+  size_t commands = 0;
+  size_t replies = 0;
+  size_t missing = 0;   // Recorded reply, none in the replay
+  size_t differing = 0; // Both replied, different text
+  Metrics recorded;     // Reply latencies of the trace, per opcode
+};
+
+bool ParseArgs(int argc, char* argv[], ReplayOptions* options) {
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (std::strcmp(argv[i], "--speed") == 0 && has_value) {
+      options->speed = std::atof(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--pty") == 0) {
+      options->pty = true;
+    }
+    else if (std::strcmp(argv[i], "--delay-us") == 0 && has_value) {
+      options->emulator.response_delay_us = std::atoi(argv[++i]);
+    }
+    else if (std::strcmp(argv[i], "--baud") == 0 && has_value) {
+      options->emulator.baud_rate = static_cast<unsigned int>(std::atoi(argv[++i]));
+    }
+    else if (std::strcmp(argv[i], "--record") == 0 && has_value) {
+      options->record_path = argv[++i];
+    }
+    else if (argv[i][0] != '-' && options->trace_path == nullptr) {
+      options->trace_path = argv[i];
+    }
+    else {
+      return false;
+    }
+  }
+  return options->trace_path != nullptr && options->speed >= 0;
+}
+
+/// Command line of a TX entry without "\r\n".
+std::string Line(const TraceEntry& entry) {
+  std::string line = entry.str();
+  while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.pop_back();
+  return line;
+}
+
+void Finish(Replayed& r, ReplayStats* stats) {
+  const AgilisPiezo::CommandResult result = r.result.get();
+  stats->commands += r.commands;
+  if (!r.expect_reply) return;
+  ++stats->replies;
+  stats->recorded.Count(r.command, COUNTER_SUBMITTED);
+  stats->recorded.Record(r.command, STAGE_REPLY, std::chrono::nanoseconds(r.recorded_latency_ns));
+  if (!result.replied) {
+    ++stats->missing;
+    std::printf("no reply to %-12s recorded %s", r.command.str().c_str(), r.recorded_reply.c_str());
+    return;
+  }
+  if (result.reply != r.recorded_reply) {
+    // The emulator starts from its own state, so values drift from the field
+    if (++stats->differing <= 10) {
+      std::printf("reply to %-12s recorded %-14.*s replayed %s", r.command.str().c_str(),
+        static_cast<int>(r.recorded_reply.size() - 2), r.recorded_reply.c_str(), result.reply.c_str());
+    }
+  }
+}
+
+/// Write-to-reply latency per opcode, in the field and in the replay.
+void PrintLatency(const MetricsSnapshot& recorded, const MetricsSnapshot& replayed) {
+  std::printf("%-6s %8s %12s %12s %12s %12s\n", "opcode", "replies",
+    "field p50", "field p99", "replay p50", "replay p99");
+  for (const auto& op : recorded.opcodes) {
+    const LatencyHistogram::Snapshot& field = op.stages[STAGE_REPLY];
+    if (field.count == 0) continue;
+    LatencyHistogram::Snapshot replay;
+    for (const auto& other : replayed.opcodes) {
+      if (other.opcode == op.opcode) replay = other.stages[STAGE_REPLY];
+    }
+    std::printf("%-6s %8llu %12llu %12llu %12llu %12llu\n", op.opcode.c_str(),
+      static_cast<unsigned long long>(field.count),
+      static_cast<unsigned long long>(field.Percentile(0.5)),
+      static_cast<unsigned long long>(field.Percentile(0.99)),
+      static_cast<unsigned long long>(replay.Percentile(0.5)),
+      static_cast<unsigned long long>(replay.Percentile(0.99)));
+  }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  ReplayOptions options;
+  if (!ParseArgs(argc, argv, &options)) {
+    std::fprintf(stderr, "Usage: %s <trace.agtr> [--speed F] [--pty] [--delay-us D] [--baud B] [--record out.agtr]\n", argv[0]);
+    return 2;
+  }
+  TraceReader reader;
+  std::string error;
+  if (!reader.Open(options.trace_path, &error)) {
+    std::fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  bench::Emulator emulator(options.emulator);
+  AgilisPiezo piezo;
+  piezo.SetLogLevel(AgilisPiezo::LOG_ERROR);
+  piezo.SetPacingMode(AgilisPiezo::PACING_ADAPTIVE);
+  // The trace holds what went on the wire, duplicates were already coalesced
+  piezo.SetCoalescingWindow(-1);
+  bool connected = false;
+  if (options.pty) {
+    connected = emulator.Start() && piezo.ConnectDeviceUSB(emulator.GetPortName());
+  }
+  else {
+    auto memory = std::unique_ptr<MemoryTransport>(new MemoryTransport(piezo.GetIOContext(),
+      [&emulator](const std::string& line) { return emulator.Handle(line); }));
+    connected = memory->Connect() && piezo.ConnectDevice(std::move(memory), "emulator");
+  }
+  if (!connected) {
+    std::fprintf(stderr, "Failed to connect to the emulator\n");
+    return 1;
+  }
+  std::shared_ptr<TraceRecorder> recorder;
+  if (options.record_path != nullptr) {
+    recorder = std::make_shared<TraceRecorder>();
+    if (!recorder->StartFileFlush(options.record_path)) {
+      std::fprintf(stderr, "Cannot create %s\n", options.record_path);
+      return 1;
+    }
+    piezo.SetTraceRecorder(recorder);
+  }
+
+  // TX entries of one gathered write, e.g. a batch and its TE, are replayed
+  // as one write again. One entry of lookahead decides whether the write got
+  // a reply. At most kWindow writes are in flight, so memory stays constant.
+  constexpr size_t kWindow = 64;
+  constexpr size_t kMaxWrite = 64;
+  std::deque<Replayed> window;
+  ReplayStats stats;
+  TraceEntry entry;
+  std::vector<Command> write; // Commands of the write being collected
+  int64_t write_ns = 0;
+  int64_t first_ns = -1;
+  int64_t last_ns = 0;
+  const sclock::time_point begin = sclock::now();
+  auto submit = [&](const TraceEntry* rx) {
+    if (write.empty()) return;
+    if (options.speed > 0) {
+      const auto due = begin + std::chrono::nanoseconds(
+        static_cast<int64_t>((write_ns - first_ns) / options.speed));
+      std::this_thread::sleep_until(due);
+    }
+    // A stop overtakes queued commands and cancels queued moves, which the
+    // trace already shows in wire order, so it waits for the window
+    const bool stop = std::any_of(write.begin(), write.end(),
+      [](const Command& c) { return c.Priority() == PRIORITY_STOP; });
+    for (; stop && !window.empty(); window.pop_front()) Finish(window.front(), &stats);
+    Replayed r;
+    r.command = write.back();
+    r.commands = write.size();
+    r.expect_reply = rx != nullptr;
+    if (rx != nullptr) {
+      r.recorded_reply = rx->str();
+      r.recorded_latency_ns = rx->time_ns - write_ns;
+    }
+    if (write.size() > 1 && r.command == opcode::TE) {
+      AgilisPiezo::CommandBatch batch = piezo.Batch();
+      for (size_t i = 0; i + 1 < write.size(); ++i) batch.Add(write[i]);
+      r.result = batch.SubmitAsync();
+    }
+    else {
+      for (size_t i = 0; i + 1 < write.size(); ++i) piezo.SubmitCommand(write[i], false);
+      r.result = piezo.SubmitCommand(r.command, r.expect_reply);
+    }
+    write.clear();
+    window.push_back(std::move(r));
+    if (window.size() > kWindow) {
+      Finish(window.front(), &stats);
+      window.pop_front();
+    }
+  };
+  while (reader.Next(&entry)) {
+    if (first_ns < 0) first_ns = entry.time_ns;
+    last_ns = entry.time_ns;
+    if (entry.direction == TRACE_TX) {
+      const bool same_write = (entry.flags & TRACE_FLAG_SAME_WRITE) != 0 && write.size() < kMaxWrite;
+      if (!same_write) {
+        submit(nullptr);
+        write_ns = entry.time_ns;
+      }
+      write.push_back(Command::FromString(Line(entry)));
+    }
+    else {
+      submit(&entry);
+    }
+  }
+  submit(nullptr);
+  for (auto& r : window) Finish(r, &stats);
+  const double replay_ms = std::chrono::duration<double, std::milli>(sclock::now() - begin).count();
+  if (recorder) {
+    piezo.SetTraceRecorder(nullptr);
+    recorder->StopFileFlush();
+  }
+
+  std::printf("\ncommands %zu, replies %zu, missing %zu, differing %zu\n",
+    stats.commands, stats.replies, stats.missing, stats.differing);
+  std::printf("recorded %.1f ms, replayed %.1f ms\n",
+    first_ns < 0 ? 0.0 : (last_ns - first_ns) / 1e6, replay_ms);
+  std::printf("\nreply latency in us\n");
+  PrintLatency(stats.recorded.Snapshot(), piezo.GetMetrics());
+  return stats.missing == 0 ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace agilispiezo {
+namespace bench {
+
+typedef std::chrono::steady_clock sclock;
+
+Emulator::Emulator() : Emulator(Options()) { }
+
+Emulator::Emulator(const Options& options) : options_(options) { }
+
+Emulator::~Emulator() {
+  Stop();
+}
+
+bool Emulator::Start() {
+  master_fd_ = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master_fd_ < 0) return false;
+  if (grantpt(master_fd_) != 0 || unlockpt(master_fd_) != 0) {
+    Stop();
+    return false;
+  }
+  port_name_ = ptsname(master_fd_);
+
+  // Keep the slave open so the master never sees a hang-up between connects
+  slave_fd_ = open(port_name_.c_str(), O_RDWR | O_NOCTTY);
+  if (slave_fd_ < 0) {
+    Stop();
+    return false;
+  }
+  termios tio;
+  tcgetattr(master_fd_, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(master_fd_, TCSANOW, &tio);
+  tcgetattr(slave_fd_, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave_fd_, TCSANOW, &tio);
+
+  stop_ = false;
+  thread_ = std::thread([this]() { __Run(); });
+  return true;
+}
+
+void Emulator::Stop() {
+  stop_ = true;
+  if (thread_.joinable()) thread_.join();
+  if (slave_fd_ >= 0) close(slave_fd_);
+  if (master_fd_ >= 0) close(master_fd_);
+  slave_fd_ = master_fd_ = -1;
+}
+
+std::string Emulator::GetPortName() const {
+  return port_name_;
+}
+
+void Emulator::__Run() {
+  std::string pending;
+  char buf[256];
+  while (!stop_) {
+    pollfd pfd = { master_fd_, POLLIN, 0 };
+    if (poll(&pfd, 1, 50) <= 0) continue;
+    const ssize_t n = read(master_fd_, buf, sizeof(buf));
+    if (n <= 0) continue;
+    pending.append(buf, static_cast<size_t>(n));
+
+    size_t end;
+    while ((end = pending.find("\r\n")) != std::string::npos) {
+      const std::string line = pending.substr(0, end);
+      pending.erase(0, end + 2);
+      std::string reply = Handle(line);
+      if (reply.empty()) continue;
+      reply += "\r\n";
+
+      int64_t delay_us = options_.response_delay_us;
+      if (options_.baud_rate > 0) {
+        // 8N1: ten bits on the wire per byte
+        delay_us += static_cast<int64_t>(reply.size()) * 10 * 1000000 / options_.baud_rate;
+      }
+      if (delay_us > 0) std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+      size_t written = 0;
+      while (written < reply.size()) {
+        const ssize_t w = write(master_fd_, reply.data() + written, reply.size() - written);
+        if (w <= 0) break;
+        written += static_cast<size_t>(w);
+      }
+    }
+  }
+}
+
+std::string Emulator::Handle(const std::string& line) {
+  // MA blocks the controller like the real one, outside of the state lock
+  if (line.size() >= 3 && line.compare(1, 2, "MA") == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(options_.measure_delay_ms));
+  }
+  std::lock_guard<std::mutex> l(m_);
+  return __Execute(line);
+}
+
+int Emulator::__Status(const int axis) {
+  if (jog_[axis - 1] != 0) return 2;
+  return sclock::now() < moving_until_[axis - 1] ? 1 : 0;
+}
+
+void Emulator::__AdvanceJog() {
+  // JA speed codes 1-4 in steps/s, see AgilisPiezo::JogSpeed
+  static const double kJogSpeed[] = { 0, 5, 100, 1700, 666 };
+  const sclock::time_point now = sclock::now();
+  for (int a = 0; a < 2; ++a) {
+    const int code = std::min(std::abs(jog_[a]), 4);
+    if (code != 0) {
+      const double dt = std::chrono::duration<double>(now - jog_updated_[a]).count();
+      jog_steps_[a] += (jog_[a] > 0 ? 1 : -1) * kJogSpeed[code] * dt;
+      const int whole = static_cast<int>(jog_steps_[a]);
+      jog_steps_[a] -= whole;
+      position_[a] = std::max(-options_.travel_steps,
+        std::min(options_.travel_steps, position_[a] + whole));
+    }
+    jog_updated_[a] = now;
+  }
+}
+
+std::string Emulator::__Execute(const std::string& command) {
+  __AdvanceJog();
+  size_t i = 0;
+  int axis = 0;
+  while (i < command.size() && command[i] >= '0' && command[i] <= '9') {
+    axis = axis * 10 + (command[i] - '0');
+    ++i;
+  }
+  if (command.size() < i + 2) {
+    error_ = -1;
+    return "";
+  }
+  const std::string op = command.substr(i, 2);
+  const std::string arg = command.substr(i + 2);
+  const bool query = !arg.empty() && arg.back() == '?';
+  const int value = std::atoi(arg.c_str());
+  const std::string prefix = command.substr(0, i + 2);
+
+  if (op == "TE") {
+    const int e = error_;
+    error_ = 0;
+    return "TE" + std::to_string(e);
+  }
+
+  const bool axis_command = op == "DL" || op == "JA" || op == "MA" || op == "MV"
+    || op == "PA" || op == "PR" || op == "ST" || op == "SU" || op == "TP"
+    || op == "TS" || op == "ZP";
+  if (axis_command && axis != 1 && axis != 2) {
+    error_ = -2;
+    return "";
+  }
+
+  error_ = 0;
+  if (op == "VE") return "AG-UC2 v2.2.1";
+  if (op == "TP") return prefix + std::to_string(position_[axis - 1]);
+  if (op == "TS") return prefix + std::to_string(__Status(axis));
+  if (op == "PH") {
+    int limits = 0;
+    for (int a = 0; a < 2; ++a) {
+      if (std::abs(position_[a]) >= options_.travel_steps) limits |= 1 << a;
+    }
+    return "PH" + std::to_string(limits);
+  }
+  if (op == "CC") {
+    if (query) return "CC" + std::to_string(channel_);
+    channel_ = value;
+    return "";
+  }
+  if (op == "DL") {
+    if (query) return prefix + std::to_string(step_delay_[axis - 1]);
+    step_delay_[axis - 1] = value;
+    return "";
+  }
+  if (op == "SU") {
+    const bool forward = arg.empty() || arg[0] != '-';
+    if (query) return prefix + (forward ? "" : "-") + std::to_string(amplitude_[axis - 1][forward]);
+    amplitude_[axis - 1][forward] = std::abs(value);
+    return "";
+  }
+  if (op == "JA") {
+    if (query) return prefix + std::to_string(jog_[axis - 1]);
+    jog_[axis - 1] = value;
+    jog_steps_[axis - 1] = 0;
+    return "";
+  }
+  if (op == "PR") {
+    position_[axis - 1] += value;
+    const int64_t us = options_.steps_per_second > 0
+      ? static_cast<int64_t>(std::abs(value)) * 1000000 / options_.steps_per_second : 0;
+    moving_until_[axis - 1] = sclock::now() + std::chrono::microseconds(us);
+    return "";
+  }
+  if (op == "ST") {
+    jog_[axis - 1] = 0;
+    moving_until_[axis - 1] = sclock::now();
+    return "";
+  }
+  if (op == "ZP") {
+    position_[axis - 1] = 0;
+    return "";
+  }
+  if (op == "MA") return prefix + "500";
+  if (op == "PA" || op == "MV" || op == "MR" || op == "ML") return "";
+  if (op == "RS") {
+    position_[0] = position_[1] = 0;
+    step_delay_[0] = step_delay_[1] = 0;
+    jog_[0] = jog_[1] = 0;
+    for (auto& a : amplitude_) a[0] = a[1] = 16;
+    return "";
+  }
+  error_ = -1;
+  return "";
+}
+
+}
+}
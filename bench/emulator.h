@@ -0,0 +1,95 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_BENCH_EMULATOR_H
+#define LIBAGILISPIEZO_BENCH_EMULATOR_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace agilispiezo {
+namespace bench {
+
+/**
+ * @brief Simulated AG-UC2 controller behind a pseudo terminal.
+ * Connect an AgilisPiezo to GetPortName() as if it were a USB port.
+ * Replies are delayed by the configured response time plus the wire time
+ * of the reply at the configured baud rate.
+*/
+class Emulator {
+public:
+  struct Options {
+    int response_delay_us = 300;     ///< Device think time before each reply
+    unsigned int baud_rate = 921600; ///< Wire time per reply byte, 0 disables
+    int measure_delay_ms = 500;      ///< Duration of MA
+    int steps_per_second = 2000;     ///< Stepping speed reported through TS
+    int travel_steps = 100000;       ///< PH reports a limit at +/- this step count
+  };
+
+  Emulator();
+  explicit Emulator(const Options& options);
+  ~Emulator();
+
+  Emulator(const Emulator&) = delete;
+  Emulator& operator=(const Emulator&) = delete;
+
+  /// Open the pty and start answering. False if no pty is available.
+  bool Start();
+  void Stop();
+  std::string GetPortName() const;
+
+  /**
+   * @brief Execute one command line without its "\r\n".
+   * @return Reply without terminator, empty if the command has none.
+  */
+  std::string Handle(const std::string& line);
+
+private:
+  void __Run();
+  std::string __Execute(const std::string& command);
+  int __Status(const int axis);
+  /// Advance jogging axes to the current time, stopping at the limits.
+  void __AdvanceJog();
+
+  Options options_;
+  int master_fd_ = -1;
+  int slave_fd_ = -1;
+  std::string port_name_;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+
+  // Controller state
+  std::mutex m_;
+  int position_[2] = {0, 0};
+  int step_delay_[2] = {0, 0};
+  int amplitude_[2][2] = {{16, 16}, {16, 16}}; // [axis - 1][forward]
+  int jog_[2] = {0, 0};
+  double jog_steps_[2] = {0, 0}; // Fractional steps not yet in position_
+  std::chrono::steady_clock::time_point jog_updated_[2];
+  std::chrono::steady_clock::time_point moving_until_[2];
+  int channel_ = 1;
+  int error_ = 0;
+};
+
+}
+}
+
+#endif // LIBAGILISPIEZO_BENCH_EMULATOR_H
@@ -18,31 +18,43 @@
 
 #include <agilispiezo/agilispiezo.h>
 #include <iostream>
-#include <thread>
-#include <chrono>
 
 using namespace agilispiezo;
 
 int main(int argc, char* argv[]) {
+  std::string port_name;
+  std::string kind = "USB";
   if (argc < 2) {
-    std::cout << "Usage: " << argv[0] << " <device-port>" << std::endl;
-    std::cout << "Example: " << argv[0] << " /dev/ttyUSB0" << std::endl;
-    return 1;
+    // Probe every serial port at once and take the first controller found
+    const auto found = AgilisPiezo::EnumerateControllers();
+    for (const auto& entry : found) {
+      std::cout << "Found " << entry.second.firmware_version << " on " << entry.first
+        << " (" << entry.second.kind << ")" << std::endl;
+    }
+    if (found.empty()) {
+      std::cout << "Usage: " << argv[0] << " [device-port]" << std::endl;
+      std::cout << "Example: " << argv[0] << " /dev/ttyUSB0" << std::endl;
+      std::cout << "No controller found on any serial port." << std::endl;
+      return 1;
+    }
+    port_name = found.begin()->first;
+    kind = found.begin()->second.kind;
+  } else {
+    port_name = argv[1];
   }
-  std::string port_name = argv[1];
   AgilisPiezo piezo;
   piezo.SetLogLevel(AgilisPiezo::LOG_DEBUG);
   std::cout << "Connecting to device on " << port_name << "..." << std::endl;
-  bool connected = piezo.ConnectDeviceUSB(port_name);
+  bool connected = kind == "USB"
+    ? piezo.ConnectDeviceUSB(port_name) : piezo.ConnectDeviceRS232(port_name);
   
-  if (!connected) {
+  if (!connected && kind == "USB") {
     std::cout << "Failed to connect to device. Trying RS232 connection..." << std::endl;
     connected = piezo.ConnectDeviceRS232(port_name);
-    
-    if (!connected) {
-      std::cout << "Failed to connect to device." << std::endl;
-      return 1;
-    }
+  }
+  if (!connected) {
+    std::cout << "Failed to connect to device." << std::endl;
+    return 1;
   }
   
   std::cout << "Successfully connected to device." << std::endl;
@@ -71,10 +83,9 @@ int main(int argc, char* argv[]) {
   std::cout << "Moving axis 1 by 10 steps..." << std::endl;
   piezo.RelativeMove(1, true, 10);
   
-  do {
-    piezo.GetAxisStatus(1, &axis1_status);
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-  } while (axis1_status != AgilisPiezo::AXISSTATUS_READY);
+  if (!piezo.WaitForAxisReady(1, 10000)) {
+    std::cout << "Timed out waiting for axis 1." << std::endl;
+  }
   
   piezo.TellNumberOfSteps(1, &axis1_pos);
   std::cout << "Axis 1 new position: " << axis1_pos << " steps" << std::endl;
@@ -82,10 +93,9 @@ int main(int argc, char* argv[]) {
   std::cout << "Moving back to original position..." << std::endl;
   piezo.RelativeMove(1, false, 10);
   
-  do {
-    piezo.GetAxisStatus(1, &axis1_status);
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-  } while (axis1_status != AgilisPiezo::AXISSTATUS_READY);
+  if (!piezo.WaitForAxisReady(1, 10000)) {
+    std::cout << "Timed out waiting for axis 1." << std::endl;
+  }
   
   piezo.TellNumberOfSteps(1, &axis1_pos);
   std::cout << "Axis 1 final position: " << axis1_pos << " steps" << std::endl;
@@ -0,0 +1,44 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <agilispiezo/trajectory.h>
+#include <iostream>
+
+using namespace agilispiezo;
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::cout << "Usage: " << argv[0] << " <recipe.txt> <recipe.agtj>" << std::endl;
+    std::cout << "Each line is a command with an optional dwell in ms, e.g. \"1PR-500 20\";" << std::endl;
+    std::cout << "\"CC2\" selects the channel of the lines that follow, \"#\" starts a comment." << std::endl;
+    return 1;
+  }
+  std::string error;
+  if (!TrajectoryFile::Compile(argv[1], argv[2], &error)) {
+    std::cerr << argv[1] << ": " << error << std::endl;
+    return 1;
+  }
+  TrajectoryFile trajectory;
+  if (!trajectory.Open(argv[2], &error)) {
+    std::cerr << error << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote " << trajectory.GetRecordCount() << " records to " << argv[2] << std::endl;
+  return 0;
+}
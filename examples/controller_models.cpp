@@ -0,0 +1,85 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+// Compile-time controller models, run against two emulated controllers.
+
+#include <agilispiezo/controller_model.h>
+#include <agilispiezo/memory_transport.h>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using namespace agilispiezo;
+
+namespace {
+
+// Replies like a controller that stands still: every axis is ready at 0 steps
+template <typename Piezo>
+bool ConnectEmulator(Piezo& piezo, const std::string& version) {
+  auto channel = std::make_shared<int>(1);
+  auto emulator = std::unique_ptr<MemoryTransport>(new MemoryTransport(piezo.GetIOContext(),
+    [version, channel](const std::string& line) -> std::string {
+      if (line == "VE") return version;
+      if (line == "TE") return "TE0";
+      if (line == "CC?") return "CC" + std::to_string(*channel);
+      if (line.compare(0, 2, "CC") == 0) *channel = std::stoi(line.substr(2));
+      if (line.size() == 3 && (line.compare(1, 2, "TP") == 0 || line.compare(1, 2, "TS") == 0))
+        return line + "0";
+      return "";
+    }));
+  emulator->Connect();
+  return piezo.ConnectDevice(std::move(emulator), "emulator");
+}
+
+}
+
+int main() {
+  AgilisPiezoUC2 uc2;
+  AgilisPiezoUC8 uc8;
+  if (!ConnectEmulator(uc2, "AG-UC2 v2.2.1") || !ConnectEmulator(uc8, "AG-UC8 v2.2.1")) {
+    std::cout << "Failed to connect the emulators" << std::endl;
+    return 1;
+  }
+  std::cout << "UC2 model matches: " << uc2.IsExpectedModel() << std::endl;
+  std::cout << "UC8 model matches: " << uc8.IsExpectedModel() << std::endl;
+
+  // Axis and channel checked by the compiler
+  uc2.RelativeMove<1>(true, 100);
+  uc2.WaitForAxisReady<1>(1000);
+  uc8.ChangeChannel<3>();
+  uc8.RelativeMove<2>(false, 50);
+  uc8.WaitForAxisReady<2>(1000);
+  int channel = 0;
+  uc8.GetChannel(&channel);
+  std::cout << "UC8 channel: " << channel << std::endl;
+
+  // Runtime channels are checked against the model: the AG-UC8 has no channel 0
+  std::cout << "UC8 ChangeChannel(0): " << uc8.ChangeChannel(0) << std::endl;
+
+  // These do not compile:
+  //   uc2.ChangeChannel(1);        // AG-UC2 has no channels
+  //   uc2.async_get_channel(token); // Same for the async calls
+  //   uc8.ChangeChannel<5>();      // AG-UC8 has channels 1-4
+  //   uc8.RelativeMove<3>(true, 100); // Axis must be 1 or 2
+
+  int steps = -1;
+  uc8.TellNumberOfSteps<2>(&steps);
+  std::cout << "UC8 axis 2 steps: " << steps << std::endl;
+  return 0;
+}
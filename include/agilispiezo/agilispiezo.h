@@ -21,11 +21,28 @@
 
 #include <thread>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <functional>
 #include <mutex>
+#include <condition_variable>
 #include <future>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include "transport.h"
 #include "serial.h"
+#include "call_options.h"
+#include "command.h"
+#include "error.h"
+#include "metrics.h"
+#include "position_estimator.h"
+#include "spsc_ring.h"
 
 namespace agilispiezo {
 
@@ -50,6 +67,7 @@ private:
   mutable sclock::time_point start_time_;
 };
   
+template <typename Model> class BasicAgilisPiezo;
 
 class AgilisPiezo {
 public:
@@ -86,13 +104,99 @@ public:
     LOG_NONE = 4
   };
 
+  enum PacingMode {
+    PACING_FIXED = 0, // Wait the command term after every command
+    PACING_ADAPTIVE = 1 // Send right after a reply, learn the delay for set-only commands
+  };
+
+  enum BusyPolicy {
+    BUSY_QUEUE = 0, // Hold commands back until MA or PA has finished
+    BUSY_REJECT = 1 // Fail commands right away while MA or PA is running
+  };
+
+  /**
+   * @brief max_age_ms for state the library tracks on every write, e.g. the
+   * channel, SU and DL. They only change through commands sent by this
+   * object, which update or drop the cache, so MoveToStepCount(),
+   * MotionScheduler, AxisGroup and TrajectoryPlayer trust them this long.
+  */
+  static constexpr int64_t kTrackedStateMaxAgeMs = 24LL * 3600 * 1000;
+
+  /// Outcome of a command executed by the I/O thread.
+  struct CommandResult {
+    bool sent = false;     ///< Command was written to the port completely.
+    bool replied = false;  ///< A "\r\n" terminated reply was received.
+    bool rejected = false; ///< Not sent because the controller was busy, see BusyPolicy.
+    bool cancelled = false; ///< Motion stopped by a later StopMotion(), dropped by EmergencyStop(), or its CancellationToken fired.
+    bool expired = false;   ///< Its CallOptions deadline passed first.
+    std::string reply;     ///< Raw reply including the terminator.
+  };
+
+  /// A controller found by EnumerateControllers().
+  struct ControllerInfo {
+    std::string kind;             ///< "USB" (921600 baud) or "RS232" (115200 baud).
+    unsigned int baud_rate = 0;
+    std::string firmware_version; ///< VE reply without the terminator, e.g. "AG-UC2 v2.2.1".
+  };
+
 public:
+  /// Standalone controller with its own I/O thread.
   AgilisPiezo();
+  /// Controller driven by an io_context run elsewhere, see ControllerPool.
+  explicit AgilisPiezo(asio::io_context& io);
   ~AgilisPiezo();
   bool ConnectDeviceUSB(const std::string& port_name);
   bool ConnectDeviceRS232(const std::string& port_name);
+  /// Connect through a serial device server in raw TCP mode, e.g. host:4001.
+  bool ConnectDeviceTCP(const std::string& host, const unsigned short port);
+  /**
+   * @brief Connect through a transport created by the caller.
+   * The transport must already be open and built on GetIOContext(), e.g.
+   * a connected MemoryTransport. The VE handshake is run on it.
+  */
+  bool ConnectDevice(std::unique_ptr<Transport> transport, const std::string& name);
   void DisconnectDevice();
-  bool IsConnected() const;
+
+  /// Serial ports that may have a controller attached: /dev/ttyUSB*, /dev/ttyACM*, COM*.
+  static std::vector<std::string> ListSerialPorts();
+  /**
+   * @brief Find controllers on many serial ports at once.
+   * Every port is probed on its own thread with VE, first at 921600 (USB)
+   * and then at 115200 (RS232), without the settle delay of a normal
+   * connect. The 921600 probe of every port waits handshake_timeout_ms; once
+   * a controller answered, the 115200 fallback waits a few times the slowest
+   * round trip seen, but at least 100 ms. The ports are
+   * closed again, connect to the ones found as usual.
+   * @param port_names Ports to probe, ListSerialPorts() if empty.
+   * @return Port name to controller, ports without an answer are left out.
+  */
+  static std::map<std::string, ControllerInfo> EnumerateControllers(
+    const std::vector<std::string>& port_names = std::vector<std::string>(),
+    const int handshake_timeout_ms = 100);
+  /// io_context running this controller's engine and transports.
+  asio::io_context& GetIOContext();
+
+  /**
+   * @brief Supervised connection.
+   * Once the link fails, queued and new commands fail at once instead of
+   * running into their timeouts. With auto reconnect enabled a supervisor
+   * thread reopens the last USB, RS232 or TCP connection, waiting
+   * initial_delay_ms and doubling up to max_delay_ms between attempts. It
+   * restores remote mode, step amplitudes, step delays and channel before
+   * commands are accepted again.
+  */
+  void SetAutoReconnect(const bool enabled,
+    const int initial_delay_ms = 100, const int max_delay_ms = 5000);
+
+  /// True from a link failure until reconnected or DisconnectDevice().
+  bool IsLinkDown() const;
+
+  /**
+   * @brief Check that the controller answers.
+   * Any reply received within max_age_ms counts, so only an idle controller
+   * is probed with VE. Pass 0 to always probe.
+  */
+  bool IsConnected(const int64_t max_age_ms = 1000) const;
   std::string GetErrorText(const int e) const;
   std::string GetPortName() const;
 
@@ -108,7 +212,8 @@ public:
    * @param axis
    * @param delay
   */
-  bool SetStepDelay(const int axis, const int delay) const;
+  bool SetStepDelay(const int axis, const int delay,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"DL"
@@ -116,8 +221,10 @@ public:
    *
    * @param axis
    * @param out_delay
+   * @param max_age_ms Accept a cached value up to this old, 0 always reads.
   */
-  bool GetStepDelay(const int axis, int* out_delay) const;
+  bool GetStepDelay(const int axis, int* out_delay,
+    const int64_t max_age_ms = 0, const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"JA"
@@ -131,7 +238,8 @@ public:
    * @param jog_speed
   */
   bool StartJogMotion(
-    const int axis, const bool sign, const int jog_speed) const;
+    const int axis, const bool sign, const int jog_speed,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"JA"
@@ -140,8 +248,12 @@ public:
    * @param axis
    * @param out_sign
    * @param out_jog_speed
+   * @param max_age_ms Accept a cached value up to this old, 0 always reads.
+   * The cache is dropped by motion commands on the axis, but a jog that
+   * ended at a limit is only seen by reading again.
   */
-  bool GetJogMode(const int axis, bool* out_sign, int* out_jog_speed) const;
+  bool GetJogMode(const int axis, bool* out_sign, int* out_jog_speed,
+    const int64_t max_age_ms = 0, const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"MA"
@@ -149,6 +261,9 @@ public:
    * During the execution of the command, the USB communication is interrupted.
    * After completion, the communication is opened again.
    * The execution of the command can last up to 2 minutes.
+   * The controller is busy meanwhile, see SetBusyPolicy(). No thread is
+   * blocked; out_position becomes ready when the reply arrives, or holds 0
+   * if the measurement failed.
    *
    * @param axis
    *
@@ -156,7 +271,8 @@ public:
    * The distance of the current position to the limit in 1/1000th of the total travel.
   */
   bool MeasureCurrentPosition(
-    const int axis, std::future<int>* out_position) const;
+    const int axis, std::future<int>* out_position,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"ML"
@@ -166,7 +282,7 @@ public:
    * To go to remote mode, use the MR command.
    * At power-up the controller is always in local mode.
   */
-  bool SetToLocalMode() const;
+  bool SetToLocalMode(const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"MR"
@@ -174,7 +290,7 @@ public:
    * In remote mode all commands are enabled and the
    * pushbuttons on the controller are disabled.
   */
-  bool SetToRemoteMode() const;
+  bool SetToRemoteMode(const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"MV"
@@ -182,40 +298,88 @@ public:
    * and stops automatically when the limit is activated.
   */
   bool MoveToLimit(
-    const int axis, const bool sign, const int jog_speed = JOGSPEED_1700) const;
+    const int axis, const bool sign, const int jog_speed = JOGSPEED_1700,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"PA"
    * Starts a process to move to an absolute position.
    * The execution of the command can last up to 2 minutes.
+   * The controller is busy until TS reports the axis ready, see
+   * SetBusyPolicy(). Use WaitForAxisReady() or OnMotionComplete() to
+   * learn when the move has finished.
   */
-  bool AbsoluteMove(const int axis, const int position) const;
+  bool AbsoluteMove(const int axis, const int position,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"PH"
    * Returns the limits axis status of the controller.
   */
-  bool TellLimitStatus(bool* out_axis1, bool* out_axis2) const;
+  bool TellLimitStatus(bool* out_axis1, bool* out_axis2,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"PR"
    * Starts a relative move of nn steps with step amplitude
    * defined by the SU command (default 16).
   */
-  bool RelativeMove(const int axis, const bool sign, const int steps) const;
+  bool RelativeMove(const int axis, const bool sign, const int steps,
+    const CallOptions& options = CallOptions()) const;
+
+  /// Step amplitude and delay used by MoveToStepCount().
+  struct StepMoveProfile {
+    int coarse_amplitude = 50; ///< SU while farther than fine_window from the target
+    int coarse_delay = 0;      ///< DL while farther than fine_window
+    int fine_amplitude = 10;   ///< SU near the target
+    int fine_delay = 10;       ///< DL near the target, in 10 us units
+    int fine_window = 100;     ///< Distance in steps that counts as near
+  };
+
+  /**
+   * @brief Closed-loop move until TP is within tolerance of target.
+   * Runs TP, then SU/DL (when they change) and PR in one batch, waits for
+   * the axis to stop and repeats, all on the I/O engine without blocking
+   * a thread. Far from the target it moves with the coarse profile, near
+   * it with the fine one.
+   *
+   * @param out_done Becomes true when TP is within tolerance, false if
+   * a command failed or max_iterations corrections did not converge.
+  */
+  bool MoveToStepCount(const int axis, const int target, const int tolerance,
+    std::future<bool>* out_done, const int max_iterations = 10) const;
+
+  /// Same as above with a custom step profile.
+  bool MoveToStepCount(const int axis, const int target, const int tolerance,
+    std::future<bool>* out_done, const int max_iterations,
+    const StepMoveProfile& profile) const;
 
   /**
    * @brief Command-"RS"
    * Resets the controller. All temporary settings are reset
    * to default and the controller is in local mode.
   */
-  bool ResetController() const;
+  bool ResetController(const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"ST"
    * Stops the motion on the defined axis. Sets the state to ready.
+   * Goes out ahead of queued commands, right after the command on the wire,
+   * and cancels queued motion of the axis, see CommandPriority.
   */
-  bool StopMotion(const int axis) const;
+  bool StopMotion(const int axis, const CallOptions& options = CallOptions()) const;
+
+  /**
+   * @brief Command-"ST"
+   * Stops both axes ahead of everything else. Queued commands and a command
+   * still waiting for its pacing gap are dropped (their results report
+   * cancelled == true), then 1ST and 2ST are the next commands on the wire.
+   * @return true if both stop commands were written.
+  */
+  bool EmergencyStop() const;
+
+  /// Non-blocking EmergencyStop(), e.g. to reach many controllers at once.
+  std::future<bool> SubmitEmergencyStop() const;
 
   /**
    * @brief Command-"SU"
@@ -232,15 +396,18 @@ public:
    * Integer between -50 and 50 included, except zero.
   */
   bool SetStepAmplitude(
-    const int axis, const bool sign, const int amplitude) const;
+    const int axis, const bool sign, const int amplitude,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"SU"
    * If sign is positive, this returns the step amplitude in forward direction.
    * Otherwise, this returns the step amplitude setting in backward direction.
+   * max_age_ms accepts a cached value up to this old, 0 always reads.
   */
-  bool GetStepAmplitudeSetting(
-    const int axis, const bool sign, int* out_amplitude) const;
+  bool GetStepAmplitudeSetting(const int axis, const bool sign,
+    int* out_amplitude, const int64_t max_age_ms = 0,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"TE"
@@ -259,7 +426,8 @@ public:
    * -6 Not allowed in current state
    *
   */
-  bool GetErrorOfPreviousCommand(int* out_error_code) const;
+  bool GetErrorOfPreviousCommand(int* out_error_code,
+    const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"TP"
@@ -268,7 +436,17 @@ public:
    * the controller or since the last ZP (zero position) command,
    * whatever was last.
   */
-  bool TellNumberOfSteps(const int axis, int* out_steps) const;
+  bool TellNumberOfSteps(const int axis, int* out_steps,
+    const CallOptions& options = CallOptions()) const;
+
+  /**
+   * @brief Step count predicted from the last TP sample, without any I/O.
+   * Follows the JA, PR, ST and DL commands sent since and the elapsed time,
+   * and is corrected by every TP and TS reply, see PositionEstimator. Cheap
+   * enough for GUI refresh or soft-limit checks at kHz rates.
+   * @return An invalid estimate until TP was read, or for an invalid axis.
+  */
+  PositionEstimate EstimatedSteps(const int axis) const;
 
   /**
    * @brief Command-"TS"
@@ -279,20 +457,84 @@ public:
    *            parameter different than 0).
    * 3 Moving to limit (currently executing MV, MA, PA commands)
   */
-  bool GetAxisStatus(const int axis, int* out_axis_status) const;
+  bool GetAxisStatus(const int axis, int* out_axis_status,
+    const CallOptions& options = CallOptions()) const;
+
+  /**
+   * @brief Command-"TS"
+   * Blocks until the axis reports AXISSTATUS_READY.
+   * While anyone is waiting, the I/O thread polls TS in the gaps between
+   * queued commands, as fast as pacing allows, and shares each result with
+   * every waiter of the axis. Polling stops when the last waiter is gone.
+   *
+   * @param axis
+   * @param timeout_ms
+   * @return false on timeout or when the controller could not be polled.
+  */
+  bool WaitForAxisReady(const int axis, const int timeout_ms) const;
+
+  /**
+   * @brief Command-"TS"
+   * Registers a one-shot callback for the next time the axis reports
+   * AXISSTATUS_READY. The callback receives (axis, true) on completion or
+   * (axis, false) if the controller cannot be polled anymore.
+   * Callbacks run on the I/O thread; use SubmitCommand() from inside them,
+   * never the blocking methods.
+  */
+  using MotionCallback = std::function<void(int, bool)>;
+  bool OnMotionComplete(const int axis, MotionCallback callback) const;
+
+  /// One position sample of a jog scan.
+  struct ScanSample {
+    sclock::time_point time;      ///< Arrival of the TP reply
+    int steps = 0;                ///< TP result
+    int status = AXISSTATUS_JOGGING; ///< Last TS result
+    bool at_limit = false;        ///< Last PH result for the axis
+  };
+  using ScanRing = SpscRing<ScanSample>;
+
+  struct JogScanOptions {
+    int axis = 1;
+    bool sign = true;
+    int jog_speed = JOGSPEED_1700;
+    bool stop_at_steps = false; ///< Stop once TP passes stop_steps in the jog direction
+    int stop_steps = 0;
+    bool stop_at_limit = true;  ///< Stop when PH reports a limit on the axis
+    size_t capacity = 4096;     ///< Ring size in samples
+  };
+
+  /**
+   * @brief Start a jog and stream position samples from the I/O thread.
+   * The engine fills every idle slot with TP, alternating with TS and PH,
+   * and pushes one ScanSample per TP reply into the returned ring. Drain it
+   * from one thread with Pop(); samples are dropped while it is full.
+   * Use PACING_ADAPTIVE, so queries follow each other without a gap.
+   * The scan ends with ST at stop_steps or a limit, or by itself when TS
+   * reports the axis ready.
+   *
+   * @return The sample ring, or nullptr if the jog was not started.
+  */
+  std::shared_ptr<ScanRing> StartJogScan(const JogScanOptions& options) const;
+
+  /// Stop the running jog scan with ST. Returns false if none was running.
+  bool StopJogScan() const;
+
+  bool IsScanning() const;
 
   /**
    * @brief Command-"VE"
    * Returns the firmware version of the controller.
+   * max_age_ms accepts a cached value up to this old, 0 always reads.
   */
-  bool GetControllerFirmwareVersion(std::string* out_version) const;
+  bool GetControllerFirmwareVersion(std::string* out_version,
+    const int64_t max_age_ms = 0, const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"ZP"
    * Resets the step counter to zero.
    * @param axis 
   */
-  bool ZeroPosition(const int axis) const;
+  bool ZeroPosition(const int axis, const CallOptions& options = CallOptions()) const;
 
   /**
    * @brief Command-"CC"
@@ -301,16 +543,75 @@ public:
    * are grouped in four channels. This command changes the selected channel.
 
     * @param value
+    * @param max_age_ms Skip CC if the channel cached within max_age_ms
+    * already matches. 0 always sends.
   */
-  bool ChangeChannel(const int channel);
-
+  bool ChangeChannel(const int channel, const int64_t max_age_ms = 0,
+    const CallOptions& options = CallOptions());
 
-  bool GetChannel(int* out_channel);
+  /**
+   * @brief Command-"CC"
+   * Returns the selected channel.
+   * max_age_ms accepts a cached value up to this old, 0 always reads.
+  */
+  bool GetChannel(int* out_channel, const int64_t max_age_ms = 0,
+    const CallOptions& options = CallOptions());
 
+  /**
+   * @brief Minimum time between two commands in ms, 50 by default.
+   * Like the other Set/Get configuration calls and the log settings this
+   * never waits for I/O, not even for a connect in progress; the next
+   * command on the wire uses the new term.
+  */
   void SetCommandTerm(const int64_t ms);
 
   int64_t GetCommandTerm();
 
+  /**
+   * @brief Select how commands are paced.
+   * PACING_FIXED waits the command term after every command.
+   * PACING_ADAPTIVE starts the next command as soon as the reply of a query
+   * (TP, TS, PH, TE, VE, ...?) has arrived and waits only a learned delay
+   * after set-only commands (PR, JA, SU, ...). The learned delay is doubled,
+   * up to the command term, whenever TE reports a garbled command
+   * (-1 or -3) or a reply times out, and shrinks again on clean TE replies.
+   * RS always waits the full command term.
+  */
+  void SetPacingMode(PacingMode mode);
+
+  PacingMode GetPacingMode();
+
+  /// Current delay in ms applied after set-only commands in PACING_ADAPTIVE.
+  int64_t GetAdaptiveDelay();
+
+  /**
+   * @brief Select what happens to commands while MA or PA is running.
+   * BUSY_QUEUE (default) keeps them in order until the operation is done.
+   * BUSY_REJECT completes them at once with CommandResult::rejected set,
+   * including those queued before the operation started.
+   * ST always goes through, so a PA can still be stopped.
+  */
+  void SetBusyPolicy(BusyPolicy policy);
+
+  BusyPolicy GetBusyPolicy();
+
+  /// True while MA or PA is running on the controller.
+  bool IsBusy() const;
+
+  /**
+   * @brief Share replies between identical concurrent queries.
+   * A read-only query (TP, TS, PH, VE or a "?" read, not TE) that finds an
+   * identical one queued is answered together with it, and one that was
+   * queued while an identical query was on the wire gets that reply if the
+   * query was written at most window_ms before it was submitted. Default 0:
+   * only replies to queries written after the caller asked are shared.
+   * A command that may change the answer, e.g. PR on the same axis, is not
+   * crossed. Pass a negative window to send every query.
+  */
+  void SetCoalescingWindow(const int64_t window_ms);
+
+  int64_t GetCoalescingWindow();
+
   /**
    * @brief Set the log level for the library
    * @param level Log level (LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR, LOG_NONE)
@@ -321,44 +622,925 @@ public:
    * @brief Set a custom log callback
    * When set, log messages are passed to the callback instead of std::cout.
    * @param callback Function called with (level, formatted_message). Pass nullptr to reset.
+   * Safe to call from any thread; a message being logged meanwhile still
+   * goes to the previous callback.
    */
   using LogCallback = std::function<void(LogLevel, const std::string&)>;
   void SetLogCallback(LogCallback callback);
 
+  /**
+   * @brief Capture the raw wire traffic of this controller.
+   * Every write and every received frame is copied with a timestamp into
+   * the recorder's lock-free ring, nothing is formatted. Unlike LOG_DEBUG
+   * this does not change the timing. Kept across reconnects, nullptr stops.
+  */
+  void SetTraceRecorder(std::shared_ptr<TraceRecorder> recorder);
+
+  /**
+   * @brief Set-only commands sent with one write and checked with one TE.
+   * The commands go out back to back as separate lines followed by TE, so
+   * the batch costs one pacing gap and one round trip instead of one per
+   * command. An invalid argument fails the whole batch before anything is
+   * sent. Cached settings are updated once TE reports no error.
+   *
+   * @code
+   * piezo.Batch().SetStepAmplitude(1, true, 30).SetStepDelay(1, 0)
+   *   .RelativeMove(1, true, 500).Submit();
+   * @endcode
+  */
+  class CommandBatch {
+  public:
+    explicit CommandBatch(const AgilisPiezo* owner) : owner_(owner) { }
+
+    CommandBatch& SetStepDelay(const int axis, const int delay);
+    CommandBatch& SetStepAmplitude(const int axis, const bool sign, const int amplitude);
+    CommandBatch& StartJogMotion(const int axis, const bool sign, const int jog_speed);
+    CommandBatch& MoveToLimit(
+      const int axis, const bool sign, const int jog_speed = JOGSPEED_1700);
+    CommandBatch& RelativeMove(const int axis, const bool sign, const int steps);
+    CommandBatch& StopMotion(const int axis);
+    CommandBatch& ZeroPosition(const int axis);
+    /// Command-"CC", the commands after it go to the new channel.
+    CommandBatch& ChangeChannel(const int channel);
+    /// Raw set-only command. Queries, MA, PA, RS and TE fail the batch.
+    CommandBatch& Add(const Command& command);
+    size_t size() const { return commands_.size(); }
+
+    /**
+     * @brief Send the batch and wait for the TE reply.
+     * @param out_error_code Error code reported by TE, see ErrorCode.
+     * @return true if the batch was written and TE reported no error.
+    */
+    bool Submit(int* out_error_code = nullptr, const CallOptions& options = CallOptions());
+    /// Queue the batch. The future holds the result of the trailing TE.
+    std::future<CommandResult> SubmitAsync(const CallOptions& options = CallOptions());
+
+  private:
+    CommandBatch& __Add(const Command& command, std::function<void()> on_success = nullptr);
+    CommandBatch& __Fail(const std::string& message);
+
+    const AgilisPiezo* owner_;
+    std::vector<Command> commands_;
+    std::vector<std::function<void()>> on_success_; // Cache updates
+    bool valid_ = true;
+  };
+
+  /// Start an empty batch, see CommandBatch.
+  CommandBatch Batch() const;
+
+  /**
+   * @brief Queue a raw command for the I/O engine.
+   * Commands are executed in submission order with the configured
+   * command term between them. The calling thread never touches the port.
+   *
+   * @param command Command without the "\r\n" terminator, e.g. "1TP".
+   * @param expect_reply Wait for a "\r\n" terminated reply after sending.
+   * @param timeout_ms Reply timeout.
+  */
+  std::future<CommandResult> SubmitCommand(const std::string& command,
+    const bool expect_reply, const int timeout_ms = 3000,
+    const CallOptions& options = CallOptions()) const;
+
+  /// Same as above, without building a std::string.
+  std::future<CommandResult> SubmitCommand(const Command& command,
+    const bool expect_reply, const int timeout_ms = 3000,
+    const CallOptions& options = CallOptions()) const;
+
+  /**
+   * @brief Asynchronous commands.
+   * Every command as an Asio initiating function taking a completion token:
+   * a callback, asio::use_future or, with C++20, asio::use_awaitable. No
+   * thread blocks; the command is queued like SubmitCommand() and the
+   * handler is posted to its associated executor, by default GetIOContext(),
+   * when the reply arrived. It is never invoked from inside the call.
+   *
+   * Errors: asio::error::invalid_argument before anything is queued,
+   * not_connected when the command was not sent, in_progress when it was
+   * rejected while MA or PA runs (BUSY_REJECT), timed_out without a reply
+   * or past the deadline, operation_aborted when cancelled, and a
+   * ReplyStatus in GetReplyCategory() for a reply that did not decode.
+   * CallOptions are passed by wrapping the token with BindCallOptions();
+   * async_wait_for_axis_ready() ignores them.
+   * Getters always read from the controller and refresh the cache.
+   * Handlers running on GetIOContext() must not call the blocking methods.
+   *
+   * @code
+   * piezo.async_tell_number_of_steps(1, [](asio::error_code ec, int steps) { ... });
+   * int steps = co_await piezo.async_tell_number_of_steps(1, asio::use_awaitable);
+   * @endcode
+  */
+  template <typename CompletionToken, typename Signature>
+  using AsyncResult = typename asio::async_result<typename std::decay<
+    typename CallOptionsOf<CompletionToken>::Token>::type, Signature>::return_type;
+
+  using SetSignature = void(asio::error_code);
+  using ValueSignature = void(asio::error_code, int);
+
+  /// DL
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_set_step_delay(
+    const int axis, const int delay, CompletionToken&& token) const;
+  /// DL?, completes with the delay
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_step_delay(
+    const int axis, CompletionToken&& token) const;
+  /// JA
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_start_jog_motion(
+    const int axis, const bool sign, const int jog_speed, CompletionToken&& token) const;
+  /// JA?, completes with the signed jog speed
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_jog_mode(
+    const int axis, CompletionToken&& token) const;
+  /// MA, completes with the position when the measurement is done
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_measure_current_position(
+    const int axis, CompletionToken&& token) const;
+  /// ML
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_set_to_local_mode(
+    CompletionToken&& token) const;
+  /// MR
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_set_to_remote_mode(
+    CompletionToken&& token) const;
+  /// MV
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_move_to_limit(
+    const int axis, const bool sign, const int jog_speed, CompletionToken&& token) const;
+  /// PA
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_absolute_move(
+    const int axis, const int position, CompletionToken&& token) const;
+  /// PH, completes with bit 0 set for a limit on axis 1 and bit 1 for axis 2
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_tell_limit_status(
+    CompletionToken&& token) const;
+  /// PR
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_relative_move(
+    const int axis, const bool sign, const int steps, CompletionToken&& token) const;
+  /// RS
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_reset_controller(
+    CompletionToken&& token) const;
+  /// ST
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_stop_motion(
+    const int axis, CompletionToken&& token) const;
+  /// SU
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_set_step_amplitude(
+    const int axis, const bool sign, const int amplitude, CompletionToken&& token) const;
+  /// SU?, completes with the amplitude in the sign direction
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_step_amplitude_setting(
+    const int axis, const bool sign, CompletionToken&& token) const;
+  /// TE, completes with the ErrorCode of the previous command
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_error_of_previous_command(
+    CompletionToken&& token) const;
+  /// TP, completes with the step count
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_tell_number_of_steps(
+    const int axis, CompletionToken&& token) const;
+  /// TS, completes with the AxisStatus
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_axis_status(
+    const int axis, CompletionToken&& token) const;
+  /// TS polled by the engine until the axis is ready, see OnMotionComplete()
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_wait_for_axis_ready(
+    const int axis, CompletionToken&& token) const;
+  /// VE, completes with the version without the terminator
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, void(asio::error_code, std::string)>
+  async_get_controller_firmware_version(CompletionToken&& token) const;
+  /// ZP
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_zero_position(
+    const int axis, CompletionToken&& token) const;
+  /// CC
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_change_channel(
+    const int channel, CompletionToken&& token) const;
+  /// CC?, completes with the channel
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_channel(
+    CompletionToken&& token) const;
+  /// Raw command like SubmitCommand(). A missing reply is not an error, r.replied tells.
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, void(asio::error_code, CommandResult)> async_submit_command(
+    const Command& command, const bool expect_reply, const int timeout_ms,
+    CompletionToken&& token) const;
+
+  /**
+   * @brief Per-opcode counters and stage latencies since the last reset.
+   * Covers queue wait, pacing wait, write, first reply byte and complete
+   * reply, plus timeouts and TE error codes. Engine TS polls are included.
+  */
+  MetricsSnapshot GetMetrics() const;
+
+  /// GetMetrics() in Prometheus text format, labelled with GetPortName().
+  std::string GetMetricsPrometheus() const;
+
+  void ResetMetrics();
+
 private:
-  /// Send command. If error_code is specified, read return values from serial.
-  bool __SendCommand(const std::string& command, int* error_code = nullptr) const;
-  bool __GetReturnValue(std::string& buf, const int timeout_ms = 3000) const;
+  template <typename Model> friend class BasicAgilisPiezo; // Shares the async_* plumbing
+
+  static constexpr int kLongOperationTimeoutMs = 130000;
+  static constexpr int kReplyTimeoutMs = 3000;
+
+  struct PendingCommand {
+    Command command;
+    bool expect_reply = false;
+    bool poll = false; ///< Issued by the engine itself, nobody waits on it
+    int timeout_ms = 3000;
+    std::promise<CommandResult> promise;
+    std::function<void(const CommandResult&)> on_complete; ///< Runs before the promise is set
+    std::vector<Command> batch; ///< Written ahead of command in the same write
+    bool recovery = false; ///< Session restore, accepted while the link is down
+    CommandPriority priority = PRIORITY_TELEMETRY; ///< Most urgent of command and batch
+    unsigned axes = 3;     ///< Bit per axis touched, axis-less commands touch both
+    /// Identical queries answered with this command's result, see SetCoalescingWindow()
+    std::shared_ptr<std::vector<PendingCommand>> followers;
+    uint64_t call_id = 0; ///< Set if CallOptions may finish it early, see __Abandon()
+    sclock::time_point deadline = sclock::time_point::max();
+    std::shared_ptr<void> cancel_watch; ///< CancellationToken::OnCancel() handle
+    Metrics* metrics = nullptr; ///< Outcome counters, set when submitted
+    sclock::time_point submitted;
+    sclock::time_point taken;   ///< Taken from the queue by the engine
+    sclock::time_point written; ///< Written to the port
+
+    /// Set priority and axes from the commands.
+    void Classify() {
+      priority = command.Priority();
+      axes = AxisMask(command);
+      for (const auto& c : batch) {
+        priority = std::min(priority, c.Priority());
+        axes |= AxisMask(c);
+      }
+    }
+
+    /// True if this is or contains a motion command of axis.
+    bool MovesAxis(const int axis) const {
+      if (command.Axis() == axis && command.Priority() == PRIORITY_MOTION) return true;
+      for (const auto& c : batch) {
+        if (c.Axis() == axis && c.Priority() == PRIORITY_MOTION) return true;
+      }
+      return false;
+    }
+
+    static unsigned AxisMask(const Command& c) {
+      const int axis = c.Axis();
+      return axis == 1 || axis == 2 ? 1u << (axis - 1) : 3u;
+    }
+
+    /// Deliver the result to the submitter.
+    void Finish(CommandResult result) {
+      if (metrics != nullptr) {
+        for (const auto& c : batch) metrics->Count(c, result.sent ? COUNTER_SENT : COUNTER_REJECTED);
+        if (!result.sent) metrics->Count(command, COUNTER_REJECTED);
+        else metrics->Count(command, COUNTER_SENT);
+        if (result.replied) metrics->Count(command, COUNTER_REPLIED);
+        else if (result.sent && expect_reply) metrics->Count(command, COUNTER_TIMEOUT);
+      }
+      if (followers) {
+        for (auto& f : *followers) f.Finish(result);
+      }
+      if (on_complete) on_complete(result);
+      promise.set_value(std::move(result));
+    }
+
+    /// Read-only query that may share the reply of an identical one.
+    bool Coalescable() const {
+      return expect_reply && batch.empty() && !recovery
+        && command.Priority() == PRIORITY_TELEMETRY && !command.HasOpcode(opcode::TE);
+    }
+  };
+
+  struct MotionWaiter {
+    uint64_t id = 0;
+    int axis = 0;
+    MotionCallback callback;
+  };
+
+  /// State of one MoveToStepCount(), carried from step to step.
+  struct StepMove {
+    int axis = 0;
+    int target = 0;
+    int tolerance = 0;
+    int iterations_left = 0;
+    StepMoveProfile profile;
+    std::promise<bool> done;
+  };
+
+  /// Running jog scan, strand only.
+  struct JogScan {
+    uint64_t id = 0;
+    JogScanOptions options;
+    std::shared_ptr<ScanRing> ring;
+    int status = AXISSTATUS_JOGGING;
+    bool at_limit = false;
+    int next_poll = 0;    // Cycles TP, TS, TP, PH
+    uint64_t dropped = 0; // Samples lost to a full ring
+  };
+
+  /// One cached controller setting, see the max_age_ms getter arguments.
+  struct CachedValue {
+    bool valid = false;
+    int value = 0;
+    sclock::time_point at;
+  };
+
+  /// Settings restored after a reconnect, taken from the cache at link loss.
+  struct Session {
+    bool remote = false;
+    CachedValue step_delay[2];
+    CachedValue step_amplitude[2][2];
+    CachedValue channel;
+  };
+
+  enum EnginePhase {
+    PHASE_IDLE = 0,   // Nothing in flight
+    PHASE_PACING = 1, // in_flight_ waits for the pacing gap
+    PHASE_REPLY = 2   // in_flight_ is sent and waits for its reply
+  };
+
+  void __Init();
+  void __PrepareTransport(Transport* transport);
+  using Reopen = std::function<bool(uint64_t)>;
+  bool __ConnectSerial(const std::string& port_name,
+    const unsigned int baud_rate, const std::string& kind,
+    const uint64_t reconnect_session = 0);
+  bool __ConnectTCP(const std::string& host, const unsigned short port,
+    const uint64_t reconnect_session = 0);
+  /**
+   * Replace the transport with one opened by open(), with the engine paused.
+   * User connects pass reconnect_session 0 and the reopen function for the
+   * supervisor; reconnects pass the session they restore and give up if
+   * the user connected or disconnected since.
+  */
+  bool __ConnectDevice(std::unique_ptr<Transport> transport,
+    const std::string& port_name, const std::string& kind,
+    const std::function<bool()>& open, Reopen reopen,
+    const uint64_t reconnect_session);
+  /// Fail queued commands and wake the supervisor. Strand only.
+  void __OnLinkLost() const;
+  void __SuperviseConnection();
+  bool __RestoreSession(const Session& session) const;
+  void __StopEngine();
+  /// Run fn on the engine strand and wait for it. Runs inline on the strand.
+  void __RunOnEngine(const std::function<void()>& fn) const;
+  /// Hold back queued commands while the port is being replaced.
+  void __PauseEngine() const;
+  void __ResumeEngine() const;
+  void __PostPump() const;
+
+  // Engine steps, strand only
+  void __Pump() const;
+  void __SendInFlight() const;
+  void __OnFrames() const;
+  void __ArmTimer(const int64_t ms) const;
+  void __Complete(CommandResult result) const;
+  /// Stops wait only the learned set-only delay instead of the fixed term, except after RS.
+  int64_t __PacingRemaining(const bool stop) const;
+  /// Mark the controller busy with MA or PA on axis for at most timeout_ms.
+  void __BeginBusy(const int axis, const int timeout_ms) const;
+  void __EndBusy() const;
+  /// Fail queued commands that may not run while busy under BUSY_REJECT.
+  void __RejectQueued() const;
+  std::future<CommandResult> __Submit(PendingCommand cmd,
+    const CallOptions& options = CallOptions()) const;
+  /**
+   * Finish the call call_id as expired or cancelled, wherever it is. A
+   * queued or pacing command is dropped; one awaiting its reply completes
+   * as timed out, unless followers or MA still need the reply, then only
+   * its submitter is answered. Strand only.
+  */
+  void __Abandon(const uint64_t call_id, const bool expired) const;
+  /// Watch deadline with the shared deadline timer. Strand only.
+  void __AddDeadline(const uint64_t call_id, const sclock::time_point deadline) const;
+  /// Stop watching the deadline of cmd once it completed. Strand only.
+  void __RemoveDeadline(const PendingCommand& cmd) const;
+  void __ArmDeadlineTimer() const;
+  void __OnDeadlines() const;
+  /// Queue a stop ahead of everything but earlier stops and cancel queued
+  /// motion of its axis. queue_m_ held; cancelled gets what was removed.
+  void __QueueStop(PendingCommand cmd, std::vector<PendingCommand>* cancelled) const;
+  /// Put a command waiting for its pacing gap back behind the queued stops. Strand only.
+  void __PreemptPacing() const;
+  /// Queued command to send next, see CommandPriority. queue_m_ held.
+  std::deque<PendingCommand>::iterator __NextQueued() const;
+  /**
+   * Remove queued duplicates of leader submitted no later than submitted_by,
+   * up to the first command that may change leader's answer. queue_m_ held.
+  */
+  std::vector<PendingCommand> __TakeDuplicates(const PendingCommand& leader,
+    const sclock::time_point submitted_by) const;
+
+  // async_* plumbing. The engine side takes std::function completions; the
+  // token's handler is kept in an AsyncOperation and posted to its executor.
+  using AsyncSetDone = std::function<SetSignature>;
+  using AsyncValueDone = std::function<ValueSignature>;
+  using AsyncResultDone = std::function<void(asio::error_code, CommandResult)>;
+
+  /// Handler of one async_* call, holding work on its executor until posted.
+  template <typename Handler>
+  class AsyncOperation {
+  public:
+    using Executor = typename asio::associated_executor<
+      Handler, asio::io_context::executor_type>::type;
+
+    AsyncOperation(Handler handler, const asio::io_context::executor_type& io)
+      : handler_(std::move(handler)), work_(asio::get_associated_executor(handler_, io)) { }
+
+    template <typename... Args>
+    void Complete(Args... args) {
+      Executor executor = work_.get_executor();
+      asio::post(executor, [handler = std::move(handler_), args...]() mutable {
+        handler(std::move(args)...);
+      });
+      work_.reset();
+    }
+
+  private:
+    Handler handler_;
+    asio::executor_work_guard<Executor> work_;
+  };
+
+  template <typename Handler, typename Signature>
+  struct AsyncCompletion;
+
+  template <typename Handler, typename... Args>
+  struct AsyncCompletion<Handler, void(Args...)> {
+    std::shared_ptr<AsyncOperation<Handler>> operation;
+    void operator()(Args... args) const { operation->Complete(std::move(args)...); }
+  };
+
+  /// Run start with the token's handler wrapped into a std::function<Signature>
+  /// and the CallOptions bound to the token.
+  template <typename Signature, typename CompletionToken, typename Start>
+  AsyncResult<CompletionToken, Signature> __AsyncInitiate(
+    CompletionToken&& token, Start start) const;
+  /// Logs and returns false for an axis other than 1 or 2.
+  bool __CheckAxis(const char* caller, const int axis) const;
+  /// Logs message as an error and returns false unless valid.
+  bool __CheckArgument(const bool valid, const char* message) const;
+  /// Queue command; done gets the result and its error code on the strand.
+  void __AsyncSubmit(const CallOptions& options, const Command& command,
+    const bool expect_reply, const int timeout_ms, AsyncResultDone done) const;
+  /// Set-only command, on_sent updates the cache once it is written.
+  void __AsyncSet(const CallOptions& options, const Command& command,
+    std::function<void()> on_sent, AsyncSetDone done) const;
+  /// Query, on_value gets the decoded value before done.
+  void __AsyncGet(const CallOptions& options, const Command& command,
+    const int timeout_ms, std::function<void(int)> on_value, AsyncValueDone done) const;
+  /// MoveToStepCount() steps, chained through on_complete and motion waiters.
+  void __StepMoveMeasure(std::shared_ptr<StepMove> move) const;
+  void __StepMoveCorrect(std::shared_ptr<StepMove> move, const int position) const;
+  /// Next TP/TS/PH poll of the jog scan for an idle engine slot.
+  PendingCommand __NextScanPoll() const;
+  void __OnScanReply(const uint64_t id, const Command& command, const CommandResult& result) const;
+  /// End the jog scan, sending ST if stop is set.
+  void __EndScan(const bool stop) const;
+
+  uint64_t __AddMotionWaiter(const int axis, MotionCallback callback) const;
+  bool __RemoveMotionWaiter(const uint64_t id) const;
+  /// Complete the waiters of a TS command's axis from its result.
+  void __NotifyMotionWaiters(const PendingCommand& cmd, const CommandResult& result) const;
+  void __UpdatePacing(const PendingCommand& cmd, const CommandResult& result) const;
+  /// Feed a completed command to estimator_.
+  void __UpdateEstimator(const PendingCommand& cmd, const CommandResult& result) const;
+
+  bool __GetCached(const CachedValue& entry, const int64_t max_age_ms, int* out) const;
+  void __SetCached(CachedValue* entry, const int value) const;
+  void __ClearCached(CachedValue* entry) const;
+  /// Drop the cached values a written set or motion command may have changed.
+  void __InvalidateCached(const Command& command) const;
+  void __ClearCache() const;
+
+  /// Write command, true if the whole line went out.
+  bool __SendCommand(const Command& command) const;
+  /// Send a batch and its trailing command with one write.
+  bool __SendBatch(const PendingCommand& cmd) const;
   bool __GetIntegerFromReturnValue(
-    const std::string& buf, const std::string& command, int* out) const;
+    const std::string& buf, const Command& command, int* out) const;
+  bool __IsLogEnabled(LogLevel level) const;
+  /// Log sink. Use AGILISPIEZO_LOG so messages are only built when enabled.
   void __Log(LogLevel level, const std::string& message) const;
 
   // Communications
 private:
-  std::string last_port_name_;
-  std::unique_ptr<Serial> serial_;
-  int64_t cmd_term_ = 50;
+  std::unique_ptr<asio::io_context> own_io_; // Standalone controllers only
+  asio::io_context& io_;
+  std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> work_;
+  std::thread io_thread_;
+  std::mutex connect_m_; // Serializes connects and disconnects, held while a port opens
+  std::shared_ptr<const std::string> port_name_; // Replaced whole, see std::atomic_load
+  std::unique_ptr<Transport> transport_; // Replaced on connect
+  mutable std::mutex transport_m_;       // Guards transport_ off the strand
+  std::shared_ptr<TraceRecorder> trace_; // Guarded by transport_m_, set on every transport
+
+  // Supervised connection. session_id_ changes on every user connect or
+  // disconnect, so a reconnect attempt knows when it has been superseded.
+  mutable std::atomic<bool> link_down_{false};
+  mutable std::atomic<bool> session_active_{false}; // Transport should be up
+  mutable std::atomic<bool> remote_mode_{false};
+  mutable std::atomic<uint64_t> session_id_{0};
+  mutable std::mutex reconnect_m_;
+  mutable std::condition_variable reconnect_cv_;
+  std::thread reconnect_thread_;
+  bool auto_reconnect_ = false;
+  bool reconnect_stop_ = false;
+  mutable bool reconnect_pending_ = false;
+  mutable uint64_t reconnect_session_ = 0;
+  int reconnect_initial_ms_ = 100;
+  int reconnect_max_ms_ = 5000;
+  Reopen reopen_;
+  mutable Session lost_session_;
+
+  // Configuration. Control-plane calls only touch atomics and never wait
+  // for the engine or the wire; the engine picks up changes on its next step.
+  std::atomic<int64_t> cmd_term_{50};
+  std::atomic<PacingMode> pacing_mode_{PACING_FIXED};
+  mutable std::atomic<bool> pacing_changed_{false}; // Engine restarts from the full term
+  mutable std::atomic<int64_t> adaptive_delay_{10}; // Learned delay after set-only commands, engine writes
+  std::atomic<int64_t> coalescing_window_{0}; // Negative disables coalescing
+  std::atomic<LogLevel> log_level_{LOG_WARNING};
+  std::shared_ptr<const LogCallback> log_callback_; // Replaced whole, see std::atomic_load
   Timer cmd_term_timer_;
-  mutable std::mutex m_;
-  LogLevel log_level_ = LOG_WARNING;
-  LogCallback log_callback_ = nullptr;
-
-  std::string axis_table_[3] = { "0", "1", "2" };
-  std::string channel_table_[5] = { "0", "1", "2", "3", "4" };
-  std::string DL[3] = { "0DL", "1DL", "2DL" };
-  std::string JA[3] = { "0JA", "1JA", "2JA" };
-  std::string MA[3] = { "0MA", "1MA", "2MA" };
-  std::string MV[3] = { "0MV", "1MV", "2MV" };
-  std::string PA[3] = { "0PA", "1PA", "2PA" };
-  std::string PH = "PH";
-  std::string PR[3] = { "0PR", "1PR", "2PR" };
-  std::string ST[3] = { "0ST", "1ST", "2ST" };
-  std::string SU[3] = { "0SU", "1SU", "2SU" };
-  std::string TP[3] = { "0TP", "1TP", "2TP" };
-  std::string TS[3] = { "0TS", "1TS", "2TS" };
-  std::string ZP[3] = { "0ZP", "1ZP", "2ZP" };
+  mutable int64_t pacing_gap_ = 50; // Required gap before the next send, strand only
+  mutable bool pacing_after_reset_ = false; // pacing_gap_ is the RS term, stops wait it too
+
+  // State cache. Setters write through, other written commands clear what they touch.
+  mutable std::mutex cache_m_;
+  mutable CachedValue step_delay_[2];
+  mutable CachedValue step_amplitude_[2][2]; // [axis - 1][forward]
+  mutable CachedValue jog_speed_[2];         // Signed speed
+  mutable CachedValue channel_;
+  mutable CachedValue version_;              // Only valid and at are used
+  mutable std::string version_text_;
+  mutable std::atomic<int64_t> last_reply_ms_{0}; // sclock ms of the last reply
+  mutable PositionEstimator estimator_; // Fed by the engine, read from any thread
+  mutable Metrics metrics_;
+
+  // I/O engine. Every step runs on strand_, so one controller never has two
+  // commands on the wire, while many controllers can share one io_context.
+  using Strand = asio::strand<asio::io_context::executor_type>;
+  std::unique_ptr<Strand> strand_;
+  std::unique_ptr<asio::steady_timer> timer_; // Pacing gap, then reply timeout
+  std::unique_ptr<asio::steady_timer> deadline_timer_; // Earliest of deadlines_
+
+  // Shared with submitting threads
+  mutable std::mutex queue_m_;
+  mutable std::deque<PendingCommand> queue_;
+  bool engine_stop_ = false;
+  BusyPolicy busy_policy_ = BUSY_QUEUE;
+  mutable std::atomic<int> busy_axis_{0}; // Axis running MA or PA, 0 if none
+  mutable std::atomic<bool> scanning_{false}; // scan_ is set
+  mutable std::vector<MotionWaiter> motion_waiters_;
+  mutable uint64_t next_waiter_id_ = 1;
+
+  // Strand only
+  mutable PendingCommand in_flight_;
+  mutable CommandFifo awaiting_; // Written commands whose reply has not arrived
+  mutable EnginePhase phase_ = PHASE_IDLE;
+  mutable uint64_t timer_seq_ = 0;
+  mutable int paused_ = 0;
+  mutable int poll_axis_ = 1;
+  mutable sclock::time_point busy_deadline_;
+  mutable uint64_t busy_waiter_ = 0; // Motion waiter that ends a PA
+  mutable std::unique_ptr<JogScan> scan_;
+  mutable uint64_t scan_id_ = 0;
+  mutable bool poll_waiters_next_ = false; // Idle slot turn while a scan runs
+  mutable std::atomic<uint64_t> call_ids_{0};
+  // CallOptions deadlines of queued and in-flight calls, one timer for all.
+  // Calls finished elsewhere are dropped lazily when their deadline passes.
+  mutable std::multimap<sclock::time_point, uint64_t> deadlines_;
+  mutable sclock::time_point deadline_armed_ = sclock::time_point::max();
 };
 
+// async_* initiating functions. Each validates its arguments, queues the
+// command and updates the cache on the strand before the handler is posted.
+
+template <typename Signature, typename CompletionToken, typename Start>
+AgilisPiezo::AsyncResult<CompletionToken, Signature> AgilisPiezo::__AsyncInitiate(
+  CompletionToken&& token, Start start) const {
+  using Bound = CallOptionsOf<CompletionToken>;
+  const asio::io_context::executor_type io = io_.get_executor();
+  return asio::async_initiate<typename Bound::Token, Signature>(
+    [io](auto&& handler, Start start, const CallOptions& options) {
+      using Handler = typename std::decay<decltype(handler)>::type;
+      auto operation = std::make_shared<AsyncOperation<Handler>>(
+        std::forward<decltype(handler)>(handler), io);
+      start(std::function<Signature>(AsyncCompletion<Handler, Signature>{ operation }), options);
+    }, Bound::Unbind(token), std::move(start), Bound::Get(token));
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_set_step_delay(const int axis, const int delay, CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis, delay](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_set_step_delay", axis)) return done(asio::error::invalid_argument);
+      __AsyncSet(options, Command(axis, opcode::DL).Append(delay), [this, axis, delay]() {
+        __SetCached(&step_delay_[axis - 1], delay);
+      }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_get_step_delay(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncValueDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_get_step_delay", axis)) return done(asio::error::invalid_argument, 0);
+      __AsyncGet(options, Command(axis, opcode::DL).Append('?'), kReplyTimeoutMs,
+        [this, axis](int delay) {
+          __SetCached(&step_delay_[axis - 1], delay);
+        }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_start_jog_motion(const int axis, const bool sign, const int jog_speed,
+  CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis, sign, jog_speed](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_start_jog_motion", axis)) return done(asio::error::invalid_argument);
+      const int speed = sign ? jog_speed : -jog_speed;
+      __ClearCached(&jog_speed_[axis - 1]);
+      __AsyncSet(options, Command(axis, opcode::JA).Append(speed), [this, axis, speed]() {
+        __SetCached(&jog_speed_[axis - 1], speed);
+      }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_get_jog_mode(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncValueDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_get_jog_mode", axis)) return done(asio::error::invalid_argument, 0);
+      __AsyncGet(options, Command(axis, opcode::JA).Append('?'), kReplyTimeoutMs,
+        [this, axis](int speed) {
+          __SetCached(&jog_speed_[axis - 1], speed);
+        }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_measure_current_position(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncValueDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_measure_current_position", axis)) return done(asio::error::invalid_argument, 0);
+      __ClearCached(&jog_speed_[axis - 1]);
+      __AsyncGet(options, Command(axis, opcode::MA), kLongOperationTimeoutMs, nullptr,
+        std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_set_to_local_mode(CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this](AsyncSetDone done, const CallOptions& options) {
+      // The pushbuttons can change settings behind our back
+      __ClearCache();
+      remote_mode_ = false;
+      __AsyncSet(options, Command(opcode::ML), nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_set_to_remote_mode(CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this](AsyncSetDone done, const CallOptions& options) {
+      __AsyncSet(options, Command(opcode::MR), [this]() { remote_mode_ = true; }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_move_to_limit(const int axis, const bool sign, const int jog_speed,
+  CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis, sign, jog_speed](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_move_to_limit", axis)) return done(asio::error::invalid_argument);
+      __ClearCached(&jog_speed_[axis - 1]);
+      __AsyncSet(options, Command(axis, opcode::MV).AppendSigned(sign, jog_speed), nullptr,
+        std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_absolute_move(const int axis, const int position, CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis, position](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_absolute_move", axis)) return done(asio::error::invalid_argument);
+      __ClearCached(&jog_speed_[axis - 1]);
+      __AsyncSet(options, Command(axis, opcode::PA).Append(position), nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_tell_limit_status(CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this](AsyncValueDone done, const CallOptions& options) {
+      __AsyncGet(options, Command(opcode::PH), kReplyTimeoutMs, nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_relative_move(const int axis, const bool sign, const int steps,
+  CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis, sign, steps](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_relative_move", axis)) return done(asio::error::invalid_argument);
+      __ClearCached(&jog_speed_[axis - 1]);
+      __AsyncSet(options, Command(axis, opcode::PR).AppendSigned(sign, steps), nullptr,
+        std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_reset_controller(CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this](AsyncSetDone done, const CallOptions& options) {
+      __ClearCache();
+      remote_mode_ = false; // RS restarts in local mode
+      __AsyncSet(options, Command(opcode::RS), nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_stop_motion(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_stop_motion", axis)) return done(asio::error::invalid_argument);
+      __ClearCached(&jog_speed_[axis - 1]);
+      __AsyncSet(options, Command(axis, opcode::ST), nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_set_step_amplitude(const int axis, const bool sign, const int amplitude,
+  CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis, sign, amplitude](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_set_step_amplitude", axis)) return done(asio::error::invalid_argument);
+      if (!__CheckArgument(amplitude != 0 && amplitude >= -50 && amplitude <= 50,
+        "async_set_step_amplitude: Invalid amplitude (must be between -50 and 50, excluding 0)")) {
+        return done(asio::error::invalid_argument);
+      }
+      // A negative amplitude flips the direction, like the controller does
+      const bool forward = sign == (amplitude > 0);
+      __AsyncSet(options, Command(axis, opcode::SU).AppendSigned(sign, amplitude),
+        [this, axis, forward, amplitude]() {
+          __SetCached(&step_amplitude_[axis - 1][forward], std::abs(amplitude));
+        }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_get_step_amplitude_setting(const int axis, const bool sign,
+  CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this, axis, sign](AsyncValueDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_get_step_amplitude_setting", axis)) return done(asio::error::invalid_argument, 0);
+      __AsyncGet(options, Command(axis, opcode::SU).Append(sign ? "?" : "-?"), kReplyTimeoutMs,
+        nullptr, [this, axis, sign, done](asio::error_code ec, int amplitude) {
+          amplitude = std::abs(amplitude);
+          if (!ec) __SetCached(&step_amplitude_[axis - 1][sign], amplitude);
+          done(ec, amplitude);
+        });
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_get_error_of_previous_command(CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this](AsyncValueDone done, const CallOptions& options) {
+      __AsyncGet(options, Command(opcode::TE), kReplyTimeoutMs, nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_tell_number_of_steps(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncValueDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_tell_number_of_steps", axis)) return done(asio::error::invalid_argument, 0);
+      __AsyncGet(options, Command(axis, opcode::TP), kReplyTimeoutMs, nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_get_axis_status(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncValueDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_get_axis_status", axis)) return done(asio::error::invalid_argument, 0);
+      __AsyncGet(options, Command(axis, opcode::TS), kReplyTimeoutMs, nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_wait_for_axis_ready(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncSetDone done, const CallOptions&) {
+      if (!__CheckAxis("async_wait_for_axis_ready", axis)) return done(asio::error::invalid_argument);
+      __AddMotionWaiter(axis, [done](int, bool completed) {
+        done(completed ? asio::error_code() : asio::error_code(asio::error::not_connected));
+      });
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, void(asio::error_code, std::string)>
+AgilisPiezo::async_get_controller_firmware_version(CompletionToken&& token) const {
+  using Signature = void(asio::error_code, std::string);
+  return __AsyncInitiate<Signature>(std::forward<CompletionToken>(token),
+    [this](std::function<Signature> done, const CallOptions& options) {
+      __AsyncSubmit(options, Command(opcode::VE), true, kReplyTimeoutMs,
+        [this, done](asio::error_code ec, CommandResult r) {
+          std::string version = r.reply.substr(0, r.reply.find("\r\n"));
+          if (!ec) {
+            std::lock_guard<std::mutex> l(cache_m_);
+            version_text_ = version;
+            version_.valid = true;
+            version_.at = sclock::now();
+          }
+          done(ec, std::move(version));
+        });
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_zero_position(const int axis, CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, axis](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckAxis("async_zero_position", axis)) return done(asio::error::invalid_argument);
+      __AsyncSet(options, Command(axis, opcode::ZP), nullptr, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::SetSignature>
+AgilisPiezo::async_change_channel(const int channel, CompletionToken&& token) const {
+  return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+    [this, channel](AsyncSetDone done, const CallOptions& options) {
+      if (!__CheckArgument(channel >= 0 && channel <= 4,
+        "async_change_channel: Invalid channel (must be between 0 and 4)")) {
+        return done(asio::error::invalid_argument);
+      }
+      __AsyncSet(options, Command(opcode::CC).Append(channel), [this, channel]() {
+        __SetCached(&channel_, channel);
+      }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, AgilisPiezo::ValueSignature>
+AgilisPiezo::async_get_channel(CompletionToken&& token) const {
+  return __AsyncInitiate<ValueSignature>(std::forward<CompletionToken>(token),
+    [this](AsyncValueDone done, const CallOptions& options) {
+      __AsyncGet(options, Command(opcode::CC).Append('?'), kReplyTimeoutMs, [this](int channel) {
+        __SetCached(&channel_, channel);
+      }, std::move(done));
+    });
+}
+
+template <typename CompletionToken>
+AgilisPiezo::AsyncResult<CompletionToken, void(asio::error_code, AgilisPiezo::CommandResult)>
+AgilisPiezo::async_submit_command(const Command& command, const bool expect_reply,
+  const int timeout_ms, CompletionToken&& token) const {
+  return __AsyncInitiate<void(asio::error_code, CommandResult)>(std::forward<CompletionToken>(token),
+    [this, command, expect_reply, timeout_ms](AsyncResultDone done, const CallOptions& options) {
+      __AsyncSubmit(options, command, expect_reply, timeout_ms,
+        [done](asio::error_code ec, CommandResult r) {
+          // r.replied tells, only a deadline is an error
+          if (ec == asio::error::timed_out && !r.expired) ec = asio::error_code();
+          done(ec, std::move(r));
+        });
+    });
+}
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,114 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBAGILISPIEZO_AXIS_GROUP_H
+#define LIBAGILISPIEZO_AXIS_GROUP_H
+
+#include <memory>
+#include <utility>
+#include <vector>
+#include "agilispiezo.h"
+
+namespace agilispiezo {
+
+/**
+ * @brief Actuators on several controllers and AG-UC8 channels as one array.
+ * Axes get a global index in the order they are added. Every vectorized
+ * call is planned per controller: the controllers work in parallel, e.g.
+ * the controllers of one ControllerPool, and the work of each controller
+ * is grouped by channel, so a channel is selected at most once per call,
+ * starting with the one already selected. Axis 1 and axis 2 of a channel
+ * move at the same time.
+ *
+ * An AG-UC8 only drives its selected channel, so MoveAll() runs in rounds:
+ * round n sends the moves of the n-th channel of every controller with one
+ * write each, then waits until they are done.
+ *
+ * Not thread-safe. The controllers must not be driven from elsewhere while
+ * a call is active, or the tracked channels go stale.
+*/
+class AxisGroup {
+public:
+  /// One actuator of the group.
+  struct Member {
+    std::shared_ptr<AgilisPiezo> controller;
+    int channel = 0; ///< AG-UC8 channel 1-4, 0 for controllers without channels.
+    int axis = 1;
+  };
+
+  /**
+   * @brief Append an actuator.
+   * A controller has either channel 0 members only or channel 1-4 members only.
+   * @return The global index, or -1 if invalid or already in the group.
+  */
+  int Add(std::shared_ptr<AgilisPiezo> controller, const int channel, const int axis);
+  void Clear();
+  size_t size() const;
+  const Member& GetMember(const size_t index) const;
+
+  /**
+   * @brief Command-"PR" on every axis, then wait until all are ready.
+   * A controller whose batch fails or whose axes time out skips the rest of
+   * its moves; the other controllers go on.
+   * @param steps Signed step count per global index, 0 or missing skips the axis, INT_MIN fails it.
+   * @param move_timeout_ms Longest wait for the moves of one round.
+   * @return Per global index, true if the axis was skipped or has moved.
+  */
+  std::vector<bool> MoveAll(const std::vector<int>& steps, const int move_timeout_ms = 30000);
+
+  /**
+   * @brief Command-"TP" on every axis.
+   * The channel changes and reads of every controller are queued at once,
+   * so the wall time is that of the slowest controller.
+   * Failed entries leave out_steps at 0.
+  */
+  std::vector<bool> TellNumberOfStepsAll(std::vector<int>* out_steps);
+
+  /// Wait until the axes on the selected channel of every controller are ready.
+  bool WaitAllReady(const int timeout_ms = 30000);
+
+  /// AgilisPiezo::SubmitEmergencyStop() on every controller of the group at once.
+  bool StopAll();
+
+  /// CC commands sent by the last MoveAll() or TellNumberOfStepsAll().
+  int GetChannelSwitchCount() const;
+
+private:
+  /// Work of one controller, by channel in visiting order.
+  struct Plan {
+    AgilisPiezo* controller = nullptr;
+    int current = 0; // Selected channel, 0 without channels
+    /// Channel and the global indices of its members, in visiting order
+    std::vector<std::pair<int, std::vector<size_t>>> channels;
+    size_t done = 0; // Channels finished by MoveAll()
+    bool ok = true;
+  };
+
+  /// Plans for the members with wanted[i] set.
+  std::vector<Plan> __Plan(const std::vector<bool>& wanted) const;
+  /// Select channel with a batch, counted as a switch.
+  AgilisPiezo::CommandBatch __Batch(Plan* plan, const int channel);
+
+  std::vector<Member> members_;
+  int channel_switches_ = 0;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_AXIS_GROUP_H
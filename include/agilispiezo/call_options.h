@@ -0,0 +1,136 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBAGILISPIEZO_CALL_OPTIONS_H
+#define LIBAGILISPIEZO_CALL_OPTIONS_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace agilispiezo {
+
+/**
+ * @brief Lets any thread give up on the calls it was passed to.
+ * Copies share one state. A default constructed token is empty and never
+ * fires, Create() makes one that can. Cancelling is final, so a loop that
+ * abandons a round of calls creates a new token for the next round.
+*/
+class CancellationToken {
+public:
+  CancellationToken() = default;
+  static CancellationToken Create();
+
+  /// Complete every call still holding this token. Safe from any thread.
+  void Cancel() const;
+  bool IsCancelled() const;
+  bool empty() const { return !state_; }
+
+  /**
+   * @brief Run fn once when the token is cancelled, or at once if it already is.
+   * fn runs on the thread calling Cancel() with the token locked, so it must
+   * only hand the work off. Cancellation is watched until the returned
+   * handle is released; an empty token returns an empty handle.
+  */
+  std::shared_ptr<void> OnCancel(std::function<void()> fn) const;
+
+private:
+  struct State;
+  struct Registration;
+  std::shared_ptr<State> state_;
+};
+
+/**
+ * @brief Limits of one call, the last argument of the AgilisPiezo commands.
+ * A command still queued when its deadline passes or its token is cancelled
+ * is dropped without being sent. One already waiting for its reply
+ * completes at once; unless another caller shares that reply the engine
+ * stops waiting for it too and paces the next command as after a timeout,
+ * so a late reply is discarded instead of being taken for the next one's.
+*/
+struct CallOptions {
+  using Clock = std::chrono::steady_clock;
+
+  /// Give up at this time. The default only applies the reply timeout.
+  Clock::time_point deadline = Clock::time_point::max();
+  CancellationToken cancellation;
+
+  /// Deadline timeout_ms from now.
+  static CallOptions Within(const int64_t timeout_ms) {
+    CallOptions options;
+    options.deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    return options;
+  }
+
+  CallOptions& SetCancellation(CancellationToken token) {
+    cancellation = std::move(token);
+    return *this;
+  }
+
+  bool HasDeadline() const { return deadline != Clock::time_point::max(); }
+  bool empty() const { return !HasDeadline() && cancellation.empty(); }
+};
+
+/// Completion token of an async_* call together with its CallOptions.
+template <typename CompletionToken>
+struct CallOptionsBinder {
+  CallOptions options;
+  CompletionToken token;
+};
+
+/**
+ * @brief Pass CallOptions to an async_* command, like asio::bind_executor().
+ * @code
+ * int steps = co_await piezo.async_tell_number_of_steps(1,
+ *   BindCallOptions(CallOptions::Within(20), asio::use_awaitable));
+ * @endcode
+*/
+template <typename CompletionToken>
+CallOptionsBinder<typename std::decay<CompletionToken>::type> BindCallOptions(
+  CallOptions options, CompletionToken&& token) {
+  return { std::move(options),
+    typename std::decay<CompletionToken>::type(std::forward<CompletionToken>(token)) };
+}
+
+/// Splits a completion token into the token Asio sees and its CallOptions.
+template <typename CompletionToken,
+  typename Decayed = typename std::decay<CompletionToken>::type>
+struct CallOptionsOf {
+  using Token = CompletionToken;
+  static CallOptions Get(const Decayed&) { return CallOptions(); }
+  static Decayed& Unbind(Decayed& token) { return token; }
+  static const Decayed& Unbind(const Decayed& token) { return token; }
+};
+
+template <typename CompletionToken, typename Inner>
+struct CallOptionsOf<CompletionToken, CallOptionsBinder<Inner>> {
+  using Token = typename std::conditional<
+    std::is_const<typename std::remove_reference<CompletionToken>::type>::value,
+    const Inner&, Inner>::type;
+  static CallOptions Get(const CallOptionsBinder<Inner>& bound) { return bound.options; }
+  static Inner& Unbind(CallOptionsBinder<Inner>& bound) { return bound.token; }
+  static const Inner& Unbind(const CallOptionsBinder<Inner>& bound) { return bound.token; }
+};
+
+}
+
+#endif // LIBAGILISPIEZO_CALL_OPTIONS_H
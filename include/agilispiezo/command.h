@@ -0,0 +1,277 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_COMMAND_H
+#define LIBAGILISPIEZO_COMMAND_H
+
+#include <asio.hpp>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include "reply.h"
+
+namespace agilispiezo {
+
+namespace opcode {
+constexpr char CC[] = "CC";
+constexpr char DL[] = "DL";
+constexpr char JA[] = "JA";
+constexpr char MA[] = "MA";
+constexpr char ML[] = "ML";
+constexpr char MR[] = "MR";
+constexpr char MV[] = "MV";
+constexpr char PA[] = "PA";
+constexpr char PH[] = "PH";
+constexpr char PR[] = "PR";
+constexpr char RS[] = "RS";
+constexpr char ST[] = "ST";
+constexpr char SU[] = "SU";
+constexpr char TE[] = "TE";
+constexpr char TP[] = "TP";
+constexpr char TS[] = "TS";
+constexpr char VE[] = "VE";
+constexpr char ZP[] = "ZP";
+}
+
+/**
+ * @brief Scheduling class of a command, most urgent first.
+ * The engine sends the most urgent queued command that does not overtake
+ * an earlier command of the same axis; axis-less commands keep their place
+ * against everything. A stop overtakes everything.
+*/
+enum CommandPriority {
+  PRIORITY_STOP = 0,      // ST, skips the fixed pacing term and cancels queued motion of its axis
+  PRIORITY_MOTION = 1,    // PR, PA, MV, JA, MA
+  PRIORITY_CONFIG = 2,    // SU, DL, CC, MR, ML, RS, ZP
+  PRIORITY_TELEMETRY = 3  // TP, TS, PH, TE, VE and "?" reads
+};
+
+/**
+ * @brief One command line, e.g. "1PR-500\r\n", in a fixed inline buffer.
+ * Building and sending a command never touches the heap.
+ * The "\r\n" terminator is kept behind the payload at all times.
+*/
+class Command {
+public:
+  static constexpr size_t kCapacity = 32;
+  static constexpr size_t kMaxSize = kCapacity - 2;
+
+  Command() { Terminate(); }
+
+  /// Axis-less command, e.g. Command(opcode::TE).
+  explicit Command(const char* op) { Append(op); }
+
+  /// Axis command, e.g. Command(1, opcode::TP) -> "1TP".
+  Command(const int axis, const char* op) {
+    Append(axis);
+    Append(op);
+  }
+
+  /// Raw command text. Fails (ok() == false) when longer than kMaxSize.
+  static Command FromString(const std::string& text) {
+    Command c;
+    c.Append(text.data(), text.size());
+    return c;
+  }
+
+  Command& Append(const char* s) { return Append(s, std::strlen(s)); }
+
+  Command& Append(const char* s, const size_t n) {
+    if (size_ + n > kMaxSize) {
+      overflow_ = true;
+      return *this;
+    }
+    std::memcpy(buf_ + size_, s, n);
+    size_ += n;
+    return Terminate();
+  }
+
+  Command& Append(const char c) { return Append(&c, 1); }
+
+  /// Decimal integer formatted straight into the buffer.
+  Command& Append(const int value) {
+    char digits[12];
+    size_t n = 0;
+    unsigned int v = value < 0 ? 0u - static_cast<unsigned int>(value)
+                               : static_cast<unsigned int>(value);
+    do {
+      digits[n++] = static_cast<char>('0' + v % 10);
+      v /= 10;
+    } while (v != 0);
+    if (value < 0) digits[n++] = '-';
+    if (size_ + n > kMaxSize) {
+      overflow_ = true;
+      return *this;
+    }
+    for (size_t i = 0; i < n; ++i) buf_[size_ + i] = digits[n - 1 - i];
+    size_ += n;
+    return Terminate();
+  }
+
+  /// Sign prefix in the style of the Agilis set commands: "" or "-".
+  Command& AppendSigned(const bool sign, const int value) {
+    if (!sign) Append('-');
+    return Append(value);
+  }
+
+  bool ok() const { return !overflow_; }
+  const char* data() const { return buf_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::string str() const { return std::string(buf_, size_); }
+
+  bool operator==(const char* s) const {
+    return std::strlen(s) == size_ && std::memcmp(buf_, s, size_) == 0;
+  }
+  bool operator!=(const char* s) const { return !(*this == s); }
+  bool operator==(const Command& other) const {
+    return size_ == other.size_ && std::memcmp(buf_, other.buf_, size_) == 0;
+  }
+
+  /// Payload plus "\r\n", ready for the wire.
+  asio::const_buffer Line() const { return asio::buffer(buf_, size_ + 2); }
+
+  /// Leading axis digit of the command, 0 if none.
+  int Axis() const {
+    return size_ > 0 && buf_[0] >= '0' && buf_[0] <= '9' ? buf_[0] - '0' : 0;
+  }
+
+  /// Two-letter opcode following the optional axis digits.
+  bool HasOpcode(const char* op) const {
+    const size_t n = PrefixSize();
+    return n >= 2 && buf_[n - 2] == op[0] && buf_[n - 1] == op[1];
+  }
+
+  /// Scheduling class, see CommandPriority.
+  CommandPriority Priority() const {
+    if (HasOpcode(opcode::ST)) return PRIORITY_STOP;
+    if ((size_ > 0 && buf_[size_ - 1] == '?') || HasOpcode(opcode::TP) || HasOpcode(opcode::TS)
+      || HasOpcode(opcode::PH) || HasOpcode(opcode::TE) || HasOpcode(opcode::VE)) {
+      return PRIORITY_TELEMETRY;
+    }
+    if (HasOpcode(opcode::PR) || HasOpcode(opcode::PA) || HasOpcode(opcode::MV)
+      || HasOpcode(opcode::JA) || HasOpcode(opcode::MA)) {
+      return PRIORITY_MOTION;
+    }
+    return PRIORITY_CONFIG;
+  }
+
+  /**
+   * @brief Length of the prefix echoed in the reply.
+   * Replies repeat the axis and opcode, e.g. "1TP" -> "1TP-42".
+   * VE answers with the bare version string, so its prefix is empty.
+  */
+  size_t ReplyPrefixSize() const {
+    if (*this == opcode::VE) return 0;
+    return PrefixSize();
+  }
+
+  /// True if the decoded frame carries this command's axis and opcode. VE matches any frame.
+  bool Matches(const Reply& reply) const {
+    const size_t prefix_size = ReplyPrefixSize();
+    if (prefix_size == 0) return true;
+    return reply.prefix_size == prefix_size && std::memcmp(reply.prefix, buf_, prefix_size) == 0;
+  }
+
+  /**
+   * @brief Value of a reply frame to this command in one pass, e.g. "1TP-42\r\n" -> -42.
+   * Never throws; a malformed frame or the reply to another command comes
+   * back as its ReplyStatus and leaves *out untouched.
+  */
+  ReplyStatus DecodeReply(const char* data, const size_t size, int* out) const {
+    const Reply reply = Reply::Decode(data, size);
+    if (reply.status == REPLY_EMPTY || reply.status == REPLY_NO_OPCODE) return reply.status;
+    if (!Matches(reply)) return REPLY_PREFIX_MISMATCH;
+    if (reply.status == REPLY_OK) *out = reply.value;
+    return reply.status;
+  }
+
+  ReplyStatus DecodeReply(const std::string& reply, int* out) const {
+    return DecodeReply(reply.data(), reply.size(), out);
+  }
+
+  /// Integer value of a reply to this command, false if there is none.
+  bool ParseReply(const std::string& reply, int* out) const {
+    return DecodeReply(reply, out) == REPLY_OK;
+  }
+
+private:
+  size_t PrefixSize() const {
+    size_t n = 0;
+    while (n < size_ && buf_[n] >= '0' && buf_[n] <= '9') ++n;
+    return n + 2 <= size_ ? n + 2 : size_;
+  }
+
+  Command& Terminate() {
+    buf_[size_] = '\r';
+    buf_[size_ + 1] = '\n';
+    return *this;
+  }
+
+  char buf_[kCapacity];
+  size_t size_ = 0;
+  bool overflow_ = false;
+};
+
+/**
+ * @brief Commands written and still waiting for their reply, oldest first.
+ * Replies come back in send order, so a frame belongs to the oldest entry
+ * with the same axis and opcode; entries ahead of it will not be answered
+ * any more. Fixed capacity, no heap.
+*/
+class CommandFifo {
+public:
+  static constexpr size_t kCapacity = 16;
+
+  bool Push(const Command& command) {
+    if (size_ == kCapacity) return false;
+    ring_[(head_ + size_) % kCapacity] = command;
+    ++size_;
+    return true;
+  }
+
+  const Command& Front() const { return ring_[head_]; }
+  const Command& At(const size_t i) const { return ring_[(head_ + i) % kCapacity]; }
+
+  void Pop() {
+    if (size_ == 0) return;
+    head_ = (head_ + 1) % kCapacity;
+    --size_;
+  }
+
+  void Clear() { size_ = 0; }
+  size_t Size() const { return size_; }
+  bool Empty() const { return size_ == 0; }
+
+  /// Position of the oldest command the frame answers, -1 if none.
+  int Match(const Reply& reply) const {
+    for (size_t i = 0; i < size_; ++i) {
+      if (At(i).Matches(reply)) return static_cast<int>(i);
+    }
+    return -1;
+  }
+
+private:
+  Command ring_[kCapacity];
+  size_t head_ = 0;
+  size_t size_ = 0;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_COMMAND_H
@@ -0,0 +1,216 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBAGILISPIEZO_CONTROLLER_MODEL_H
+#define LIBAGILISPIEZO_CONTROLLER_MODEL_H
+
+#include <string>
+#include "agilispiezo.h"
+
+namespace agilispiezo {
+
+/// AG-UC2: two axes, no channels.
+struct ModelUC2 {
+  static constexpr const char* kName = "AG-UC2";
+  static constexpr int kChannels = 0;
+};
+
+/// AG-UC8: two axes on each of four channels, selected with CC.
+struct ModelUC8 {
+  static constexpr const char* kName = "AG-UC8";
+  static constexpr int kChannels = 4;
+};
+
+/**
+ * @brief AgilisPiezo for a model known at compile time.
+ * Checked by the compiler:
+ * - ChangeChannel(), GetChannel(), async_change_channel() and
+ *   async_get_channel() only compile for models with channels.
+ * - ChangeChannel<n>() only compiles for a channel of the model.
+ * - The axis overloads, e.g. RelativeMove<1>(true, 500), only compile
+ *   for axis 1 and 2.
+ *
+ * Arguments only known when running are checked when called, channels
+ * against the model; the async calls complete with invalid_argument.
+ * Not covered: Batch().ChangeChannel(), which is shared by all models,
+ * and calls made through an AgilisPiezo reference. Everything else is
+ * inherited unchanged, so a BasicAgilisPiezo works wherever an
+ * AgilisPiezo is expected, e.g. in an AxisGroup.
+ *
+ * @code
+ * agilispiezo::AgilisPiezoUC8 uc8;
+ * uc8.ChangeChannel<3>();      // ChangeChannel<5>() does not compile
+ * uc8.RelativeMove<1>(true, 500); // RelativeMove<3>(...) does not compile
+ * agilispiezo::AgilisPiezoUC2 uc2;
+ * uc2.ChangeChannel(1);        // Does not compile, AG-UC2 has no channels
+ * @endcode
+*/
+template <typename Model>
+class BasicAgilisPiezo : public AgilisPiezo {
+public:
+  using ModelType = Model;
+  static constexpr bool kHasChannels = Model::kChannels > 0;
+
+  static constexpr bool IsValidAxis(const int axis) { return axis == 1 || axis == 2; }
+  static constexpr bool IsValidChannel(const int channel) {
+    return channel >= 1 && channel <= Model::kChannels;
+  }
+
+  using AgilisPiezo::AgilisPiezo;
+
+  /// Command-"CC" with the channel checked at compile time.
+  template <int Channel>
+  bool ChangeChannel(const int64_t max_age_ms = 0, const CallOptions& options = CallOptions()) {
+    static_assert(kHasChannels, "ChangeChannel: the model has no channels");
+    static_assert(IsValidChannel(Channel), "ChangeChannel: channel out of range");
+    return AgilisPiezo::ChangeChannel(Channel, max_age_ms, options);
+  }
+
+  /// Command-"CC", false for a channel the model does not have.
+  bool ChangeChannel(const int channel, const int64_t max_age_ms = 0,
+    const CallOptions& options = CallOptions()) {
+    static_assert(kHasChannels, "ChangeChannel: the model has no channels");
+    if (!__CheckArgument(IsValidChannel(channel),
+      "ChangeChannel: Invalid channel (must be one of the model's channels)")) {
+      return false;
+    }
+    return AgilisPiezo::ChangeChannel(channel, max_age_ms, options);
+  }
+
+  /// Command-"CC?"
+  bool GetChannel(int* out_channel, const int64_t max_age_ms = 0,
+    const CallOptions& options = CallOptions()) {
+    static_assert(kHasChannels, "GetChannel: the model has no channels");
+    return AgilisPiezo::GetChannel(out_channel, max_age_ms, options);
+  }
+
+  /// CC, invalid_argument for a channel the model does not have.
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, SetSignature> async_change_channel(
+    const int channel, CompletionToken&& token) const {
+    static_assert(kHasChannels, "async_change_channel: the model has no channels");
+    return __AsyncInitiate<SetSignature>(std::forward<CompletionToken>(token),
+      [this, channel](AsyncSetDone done, const CallOptions& options) {
+        if (!__CheckArgument(IsValidChannel(channel),
+          "async_change_channel: Invalid channel (must be one of the model's channels)")) {
+          return done(asio::error::invalid_argument);
+        }
+        __AsyncSet(options, Command(opcode::CC).Append(channel), [this, channel]() {
+          __SetCached(&channel_, channel);
+        }, std::move(done));
+      });
+  }
+
+  /// CC?, completes with the channel
+  template <typename CompletionToken>
+  AsyncResult<CompletionToken, ValueSignature> async_get_channel(CompletionToken&& token) const {
+    static_assert(kHasChannels, "async_get_channel: the model has no channels");
+    return AgilisPiezo::async_get_channel(std::forward<CompletionToken>(token));
+  }
+
+  // Axis checked at compile time; the runtime overloads stay available
+  using AgilisPiezo::StartJogMotion;
+  using AgilisPiezo::MoveToLimit;
+  using AgilisPiezo::AbsoluteMove;
+  using AgilisPiezo::RelativeMove;
+  using AgilisPiezo::StopMotion;
+  using AgilisPiezo::ZeroPosition;
+  using AgilisPiezo::TellNumberOfSteps;
+  using AgilisPiezo::GetAxisStatus;
+  using AgilisPiezo::WaitForAxisReady;
+  using AgilisPiezo::EstimatedSteps;
+
+  template <int Axis>
+  bool StartJogMotion(const bool sign, const int jog_speed,
+    const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::StartJogMotion(CheckedAxis<Axis>::value, sign, jog_speed, options);
+  }
+
+  template <int Axis>
+  bool MoveToLimit(const bool sign, const int jog_speed = JOGSPEED_1700,
+    const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::MoveToLimit(CheckedAxis<Axis>::value, sign, jog_speed, options);
+  }
+
+  template <int Axis>
+  bool AbsoluteMove(const int position, const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::AbsoluteMove(CheckedAxis<Axis>::value, position, options);
+  }
+
+  template <int Axis>
+  bool RelativeMove(const bool sign, const int steps,
+    const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::RelativeMove(CheckedAxis<Axis>::value, sign, steps, options);
+  }
+
+  template <int Axis>
+  bool StopMotion(const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::StopMotion(CheckedAxis<Axis>::value, options);
+  }
+
+  template <int Axis>
+  bool ZeroPosition(const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::ZeroPosition(CheckedAxis<Axis>::value, options);
+  }
+
+  template <int Axis>
+  bool TellNumberOfSteps(int* out_steps, const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::TellNumberOfSteps(CheckedAxis<Axis>::value, out_steps, options);
+  }
+
+  template <int Axis>
+  bool GetAxisStatus(int* out_axis_status, const CallOptions& options = CallOptions()) const {
+    return AgilisPiezo::GetAxisStatus(CheckedAxis<Axis>::value, out_axis_status, options);
+  }
+
+  template <int Axis>
+  bool WaitForAxisReady(const int timeout_ms) const {
+    return AgilisPiezo::WaitForAxisReady(CheckedAxis<Axis>::value, timeout_ms);
+  }
+
+  template <int Axis>
+  PositionEstimate EstimatedSteps() const {
+    return AgilisPiezo::EstimatedSteps(CheckedAxis<Axis>::value);
+  }
+
+  /**
+   * @brief True if the connected controller reports this model.
+   * Compares the start of the VE reply, e.g. "AG-UC8 v2.2.1".
+   * max_age_ms accepts a cached version up to this old, 0 always reads.
+  */
+  bool IsExpectedModel(const int64_t max_age_ms = 0) const {
+    std::string version;
+    if (!GetControllerFirmwareVersion(&version, max_age_ms)) return false;
+    return version.compare(0, std::char_traits<char>::length(Model::kName), Model::kName) == 0;
+  }
+
+private:
+  template <int Axis>
+  struct CheckedAxis {
+    static_assert(IsValidAxis(Axis), "Invalid axis (must be 1 or 2)");
+    static constexpr int value = Axis;
+  };
+};
+
+using AgilisPiezoUC2 = BasicAgilisPiezo<ModelUC2>;
+using AgilisPiezoUC8 = BasicAgilisPiezo<ModelUC8>;
+
+}
+
+#endif // LIBAGILISPIEZO_CONTROLLER_MODEL_H
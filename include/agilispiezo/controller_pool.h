@@ -0,0 +1,108 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_CONTROLLER_POOL_H
+#define LIBAGILISPIEZO_CONTROLLER_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "agilispiezo.h"
+
+namespace agilispiezo {
+
+/**
+ * @brief Many controllers on one io_context served by a small thread pool.
+ * A standalone AgilisPiezo runs its own I/O thread. Controllers created by
+ * a pool share the pool's threads instead, so the thread count stays at
+ * num_threads no matter how many controllers are attached.
+*/
+class ControllerPool {
+public:
+  /// @param num_threads I/O threads shared by every controller of the pool.
+  explicit ControllerPool(const size_t num_threads = 2);
+  ~ControllerPool();
+
+  ControllerPool(const ControllerPool&) = delete;
+  ControllerPool& operator=(const ControllerPool&) = delete;
+
+  /**
+   * @brief Create a controller bound to the pool's io_context.
+   * The controller is not connected yet. Handles must not outlive the pool.
+  */
+  std::shared_ptr<AgilisPiezo> CreateController();
+
+  /// Controllers created by this pool, in creation order.
+  std::vector<std::shared_ptr<AgilisPiezo>> GetControllers() const;
+
+  size_t GetControllerCount() const;
+
+  /**
+   * Broadcast and scatter/gather over every controller of the pool.
+   * Each call submits to all controllers first and only then waits, so the
+   * ports work in parallel and the wall time is about one round trip for
+   * any number of controllers. Results are in GetControllers() order.
+  */
+  using CommandResult = AgilisPiezo::CommandResult;
+
+  /// Send the same command to every controller.
+  std::vector<CommandResult> Broadcast(const Command& command,
+    const bool expect_reply, const int timeout_ms = 3000) const;
+
+  /// Send commands[i] to controller i. Missing entries are not sent.
+  std::vector<CommandResult> Scatter(const std::vector<Command>& commands,
+    const bool expect_reply, const int timeout_ms = 3000) const;
+
+  /// Command-"PR" on every controller.
+  std::vector<bool> RelativeMoveAll(
+    const int axis, const bool sign, const int steps) const;
+
+  /// Command-"PR" with a signed step count per controller, 0 skips it.
+  std::vector<bool> RelativeMoveEach(
+    const int axis, const std::vector<int>& steps) const;
+
+  /// Command-"ST" on every controller.
+  std::vector<bool> StopMotionAll(const int axis) const;
+
+  /// Command-"ZP" on every controller.
+  std::vector<bool> ZeroPositionAll(const int axis) const;
+
+  /// Command-"TP" on every controller. Failed entries leave out_steps at 0.
+  std::vector<bool> TellNumberOfStepsAll(
+    const int axis, std::vector<int>* out_steps) const;
+
+  /**
+   * @brief AgilisPiezo::EmergencyStop() on every controller at once.
+   * Stops both axes everywhere, ahead of anything already queued.
+  */
+  std::vector<bool> EmergencyStopAll() const;
+  size_t GetThreadCount() const;
+  asio::io_context& GetIOContext();
+
+private:
+  asio::io_context io_;
+  std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> work_;
+  std::vector<std::thread> threads_;
+  mutable std::mutex m_;
+  std::vector<std::shared_ptr<AgilisPiezo>> controllers_;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_CONTROLLER_POOL_H
@@ -0,0 +1,43 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBAGILISPIEZO_ERROR_H
+#define LIBAGILISPIEZO_ERROR_H
+
+#include <asio.hpp>
+#include "reply.h"
+
+namespace agilispiezo {
+
+/**
+ * @brief Category of the async_* completion errors for replies that arrived
+ * but could not be decoded. The values are ReplyStatus. Transport problems
+ * use the Asio codes: not_connected (not sent), in_progress (rejected while
+ * MA or PA runs), timed_out (no reply or past the CallOptions deadline) and
+ * operation_aborted (cancelled).
+*/
+const asio::error_category& GetReplyCategory();
+
+inline asio::error_code MakeErrorCode(const ReplyStatus status) {
+  return asio::error_code(static_cast<int>(status), GetReplyCategory());
+}
+
+}
+
+#endif // LIBAGILISPIEZO_ERROR_H
@@ -0,0 +1,71 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_MEMORY_TRANSPORT_H
+#define LIBAGILISPIEZO_MEMORY_TRANSPORT_H
+
+#include <asio.hpp>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "transport.h"
+
+namespace agilispiezo {
+
+/**
+ * @brief In-process transport that hands each command line to a function.
+ * Meant for emulators, tests and benchmarks: there is no device, no OS
+ * buffer and no byte timing, only the framing and engine of the library.
+*/
+class MemoryTransport : public Transport {
+public:
+  /**
+   * Called with each command line without "\r\n", returns the reply without
+   * "\r\n" or an empty string. Runs inside Send(), so it should return quickly.
+  */
+  using Handler = std::function<std::string(const std::string& line)>;
+
+  explicit MemoryTransport(Handler handler);
+  MemoryTransport(asio::io_context& io, Handler handler);
+  ~MemoryTransport() override;
+
+  /// Start accepting commands; a device that is always there.
+  bool Connect();
+
+protected:
+  bool IsOpen() const override;
+  void AsyncReadSome(const asio::mutable_buffer& buffer, ReadHandler handler) override;
+  size_t Write(const std::vector<asio::const_buffer>& writes, asio::error_code& ec) override;
+  void Close() override;
+
+private:
+  /// Complete the pending read from rx_. Call with m_ held.
+  void __CompleteRead();
+
+  Handler handler_;
+  mutable std::mutex m_;
+  bool open_ = false;
+  std::string tx_; // Partial command line
+  std::string rx_; // Replies not read yet
+  asio::mutable_buffer read_buffer_;
+  ReadHandler read_handler_;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_MEMORY_TRANSPORT_H
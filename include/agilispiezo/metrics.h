@@ -0,0 +1,135 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_METRICS_H
+#define LIBAGILISPIEZO_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "command.h"
+
+namespace agilispiezo {
+
+enum MetricStage {
+  STAGE_QUEUE = 0,      // Submitted until taken by the engine
+  STAGE_PACING = 1,     // Taken until written, i.e. the pacing gap
+  STAGE_WRITE = 2,      // Writing the command line to the port
+  STAGE_FIRST_BYTE = 3, // Written until the first reply byte arrived
+  STAGE_REPLY = 4,      // Written until the complete reply arrived
+  STAGE_COUNT = 5
+};
+
+enum MetricCounter {
+  COUNTER_SUBMITTED = 0,
+  COUNTER_SENT = 1,
+  COUNTER_REPLIED = 2,
+  COUNTER_TIMEOUT = 3,  // Reply expected but none arrived
+  COUNTER_REJECTED = 4, // Not sent: busy, stopped, dropped or failed write
+  COUNTER_COALESCED = 5, // Answered with the reply of an identical query
+  COUNTER_COUNT = 6
+};
+
+/**
+ * @brief Log-linear latency histogram in microseconds.
+ * Four sub-buckets per power of two keep the relative error below 25%
+ * from 1 µs up to about 2 minutes. Recording is a few relaxed atomic
+ * increments, so it never blocks the I/O engine.
+*/
+class LatencyHistogram {
+public:
+  static constexpr size_t kBuckets = 108;
+
+  struct Snapshot {
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+    uint64_t max_us = 0;
+    std::array<uint64_t, kBuckets> buckets{};
+
+    /// Upper bound in µs of the bucket holding quantile q (0..1), 0 if empty.
+    uint64_t Percentile(const double q) const;
+    double MeanUs() const { return count == 0 ? 0.0 : double(sum_us) / count; }
+  };
+
+  void Record(const std::chrono::steady_clock::duration elapsed);
+  Snapshot Load() const;
+  void Reset();
+
+  static size_t BucketIndex(const uint64_t us);
+  /// Smallest value in µs that no longer falls into bucket i.
+  static uint64_t BucketUpperBound(const size_t i);
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_us_{0};
+  std::atomic<uint64_t> max_us_{0};
+};
+
+/// Point-in-time copy of the metrics of one controller.
+struct MetricsSnapshot {
+  struct Opcode {
+    std::string opcode; ///< Two-letter opcode, "??" for anything else
+    std::array<uint64_t, COUNTER_COUNT> counters{};
+    std::array<LatencyHistogram::Snapshot, STAGE_COUNT> stages;
+  };
+
+  std::vector<Opcode> opcodes; ///< Opcodes that were submitted at least once
+  /// TE replies by error code, index 1..6 for -1..-6.
+  std::array<uint64_t, 7> te_errors{};
+
+  /**
+   * @brief Prometheus text exposition format.
+   * @param port Value of the "port" label, e.g. AgilisPiezo::GetPortName().
+  */
+  std::string ToPrometheus(const std::string& port) const;
+};
+
+/// Lock-free per-opcode counters and stage histograms.
+class Metrics {
+public:
+  static constexpr size_t kOpcodes = 19; // 18 known opcodes and "other"
+
+  void Count(const Command& command, const MetricCounter counter);
+  void Record(const Command& command, const MetricStage stage,
+    const std::chrono::steady_clock::duration elapsed);
+  /// Count a TE reply carrying error code e (-1..-6).
+  void CountError(const int e);
+
+  MetricsSnapshot Snapshot() const;
+  void Reset();
+
+  static size_t OpcodeIndex(const Command& command);
+  static const char* OpcodeName(const size_t index);
+
+private:
+  struct PerOpcode {
+    std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters{};
+    LatencyHistogram stages[STAGE_COUNT];
+  };
+
+  PerOpcode opcodes_[kOpcodes];
+  std::array<std::atomic<uint64_t>, 7> te_errors_{};
+};
+
+}
+
+#endif // LIBAGILISPIEZO_METRICS_H
@@ -0,0 +1,81 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_MOTION_SCHEDULER_H
+#define LIBAGILISPIEZO_MOTION_SCHEDULER_H
+
+#include <vector>
+#include "agilispiezo.h"
+
+namespace agilispiezo {
+
+/**
+ * @brief Runs relative moves across the channels of an AG-UC8.
+ * Moves are grouped by channel, so each channel is selected once per run,
+ * starting with the channel that is already selected. The channel is
+ * tracked by the library and CC is only sent when it changes. Within a
+ * channel the moves of each axis keep their order; the n-th moves of axis 1
+ * and axis 2 are sent with one write and run at the same time.
+ *
+ * Not thread-safe. The controller must not be driven from elsewhere while
+ * Run() is active, or the tracked channel goes stale.
+*/
+class MotionScheduler {
+public:
+  explicit MotionScheduler(AgilisPiezo& piezo);
+
+  /// Queue a relative move of steps (signed, INT_MIN rejected) on channel and axis. 0 steps is ignored.
+  bool Add(const int channel, const int axis, const int steps);
+  void Clear();
+  size_t GetMoveCount() const;
+
+  /**
+   * Run axis 1 and axis 2 of a channel at the same time (default).
+   * Disable for setups that must not draw current for two actuators at once.
+  */
+  void SetOverlapAxes(const bool overlap);
+
+  /**
+   * @brief Execute and remove all queued moves.
+   * Stops at the first failed move and drops the rest.
+   * @param move_timeout_ms Longest wait for one move (or move pair) to finish.
+   * @return true if every move was sent and its axes became ready.
+  */
+  bool Run(const int move_timeout_ms = 30000);
+
+  /// CC commands sent by the last Run().
+  int GetChannelSwitchCount() const;
+
+private:
+  struct Move {
+    int channel = 0;
+    int axis = 0;
+    int steps = 0;
+  };
+
+  bool __RunStep(const int steps1, const int steps2, const int move_timeout_ms);
+
+  AgilisPiezo& piezo_;
+  std::vector<Move> moves_;
+  bool overlap_axes_ = true;
+  int channel_switches_ = 0;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_MOTION_SCHEDULER_H
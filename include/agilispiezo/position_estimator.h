@@ -0,0 +1,118 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LIBAGILISPIEZO_POSITION_ESTIMATOR_H
+#define LIBAGILISPIEZO_POSITION_ESTIMATOR_H
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include "command.h"
+
+namespace agilispiezo {
+
+/// Extrapolated step count of one axis, see AgilisPiezo::EstimatedSteps().
+struct PositionEstimate {
+  bool valid = false;  ///< False until the step count is known, see PositionEstimator.
+  int steps = 0;       ///< Estimated TP result at the time of the call.
+  int error = 0;       ///< The real count is within steps +- error.
+  bool moving = false; ///< A JA or PR is believed to be running.
+  std::chrono::steady_clock::time_point sampled; ///< Time of the last TP sample.
+};
+
+/**
+ * @brief Predicts TP between real samples from the commands on the wire.
+ * The engine feeds it every written command and every reply. A TP reply
+ * is taken as the count at the middle of its round trip; from there a JA
+ * runs at its nominal speed (5, 100, 1700 or 666 steps/s) and a PR at
+ * kMaxStepRate with the DL delay added to every step, stopping at the
+ * commanded count. A TS ready reply ends a PR at its target.
+ *
+ * The error bound adds the timing uncertainty of the sample and of the
+ * motion start or stop (the last query round trip) to kRateTolerance of
+ * the steps extrapolated since. It assumes the nominal rates: a jog that
+ * runs into a limit is only noticed by the next TS or TP.
+ *
+ * The estimate is invalid until a TP sample or ZP, and again after MV,
+ * PA, MA, a failed batch or a TS reply that does not fit the model, until
+ * TS reports the axis ready and TP is read. RS, ML and CC forget both axes.
+ * Thread-safe; Estimate() takes one short lock and never waits for I/O.
+*/
+class PositionEstimator {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  /// Steps/s of JA3, taken as the PR rate at DL0.
+  static constexpr double kMaxStepRate = 1700.0;
+  /// Relative deviation of the real step rates from the nominal ones.
+  static constexpr double kRateTolerance = 0.05;
+
+  /// Nominal signed steps/s of a JA speed, 0 for JA0 or an invalid speed.
+  static double JogRate(const int jog_speed);
+  /// Nominal steps/s of PR with step delay DL, in 10 us units.
+  static double StepRate(const int step_delay);
+
+  /// A set-only command was written at written.
+  void OnCommand(const Command& command, const Clock::time_point written);
+  /// A query written at written was answered at received.
+  void OnReply(const Command& command, const std::string& reply,
+    const Clock::time_point written, const Clock::time_point received);
+  /// Forget the count of axis, 0 for both, until TS ready and TP.
+  void Invalidate(const int axis);
+  /// Forget everything, e.g. after reconnecting.
+  void Reset();
+
+  PositionEstimate Estimate(const int axis, const Clock::time_point at = Clock::now()) const;
+
+private:
+  enum Motion {
+    MOTION_NONE = 0,   // Standing still
+    MOTION_JOG = 1,    // JA at rate
+    MOTION_STEP = 2,   // PR at rate until end
+    MOTION_UNKNOWN = 3 // Moving in a way that cannot be modelled
+  };
+
+  struct Axis {
+    bool valid = false;
+    Motion motion = MOTION_NONE;
+    int base = 0;            // Count at base_time
+    double base_error = 0;
+    Clock::time_point base_time;
+    Clock::time_point start; // Motion start, i.e. its command written
+    bool start_seen = false; // A TP sample since start pins the timing
+    double rate = 0;         // Signed steps/s
+    int end = 0;             // Count at the end of a PR
+    int step_delay = 0;      // Last DL, 0 after power-up and RS
+    Clock::time_point sampled;
+  };
+
+  /// Estimate of a at time at, the lock held.
+  PositionEstimate __Estimate(const Axis& a, const Clock::time_point at) const;
+  /// Start a new motion segment at time at from the estimate there.
+  void __Fold(Axis* a, const Clock::time_point at, const bool stop) const;
+  void __Lose(Axis* a) const;
+
+  mutable std::mutex m_;
+  Axis axes_[2];
+  double latency_s_ = 0.005; // Last query round trip
+};
+
+}
+
+#endif // LIBAGILISPIEZO_POSITION_ESTIMATOR_H
@@ -0,0 +1,121 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_REPLY_H
+#define LIBAGILISPIEZO_REPLY_H
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+
+namespace agilispiezo {
+
+/// Outcome of decoding a reply frame. Nothing in here throws.
+enum ReplyStatus {
+  REPLY_OK = 0,
+  REPLY_EMPTY,           // No bytes at all
+  REPLY_NO_OPCODE,       // Does not start with [axis digits] and two capitals
+  REPLY_NO_VALUE,        // Nothing numeric after the opcode
+  REPLY_BAD_VALUE,       // Number followed by something other than "\r\n"
+  REPLY_OUT_OF_RANGE,    // Number does not fit an int
+  REPLY_PREFIX_MISMATCH  // Well formed, but the reply to another command
+};
+
+inline const char* ReplyStatusText(const ReplyStatus status) {
+  switch (status) {
+  case REPLY_OK: return "ok";
+  case REPLY_EMPTY: return "empty reply";
+  case REPLY_NO_OPCODE: return "no opcode";
+  case REPLY_NO_VALUE: return "no value";
+  case REPLY_BAD_VALUE: return "malformed value";
+  case REPLY_OUT_OF_RANGE: return "value out of range";
+  case REPLY_PREFIX_MISMATCH: return "reply to another command";
+  }
+  return "unknown";
+}
+
+/// Result of ParseInt(), in the style of std::from_chars.
+struct ParseIntResult {
+  const char* ptr;     ///< First character not consumed.
+  ReplyStatus status;  ///< REPLY_OK, REPLY_NO_VALUE or REPLY_OUT_OF_RANGE.
+};
+
+/**
+ * @brief Decimal integer with an optional sign at [first, last).
+ * On REPLY_OK *out is set and ptr points past the last digit. On
+ * REPLY_NO_VALUE ptr is first; on REPLY_OUT_OF_RANGE it is past the digits.
+*/
+inline ParseIntResult ParseInt(const char* first, const char* last, int* out) {
+  const char* p = first;
+  const bool negative = p != last && *p == '-';
+  if (p != last && (*p == '-' || *p == '+')) ++p;
+  const char* digits = p;
+  int64_t v = 0;
+  bool overflow = false;
+  for (; p != last && *p >= '0' && *p <= '9'; ++p) {
+    v = v * 10 + (*p - '0');
+    if (v > static_cast<int64_t>(INT_MAX) + 1) {
+      overflow = true;
+      v = 0;
+    }
+  }
+  if (p == digits) return { first, REPLY_NO_VALUE };
+  if (negative) v = -v;
+  if (overflow || v < INT_MIN || v > INT_MAX) return { p, REPLY_OUT_OF_RANGE };
+  *out = static_cast<int>(v);
+  return { p, REPLY_OK };
+}
+
+/**
+ * @brief One reply frame split in a single pass, e.g. "1TP-42\r\n".
+ * prefix points into the decoded data, which must outlive the Reply.
+*/
+struct Reply {
+  ReplyStatus status = REPLY_EMPTY;
+  const char* prefix = nullptr; ///< Axis digits and opcode, e.g. "1TP".
+  size_t prefix_size = 0;
+  int value = 0;                ///< Valid if status == REPLY_OK.
+
+  static Reply Decode(const char* data, const size_t size) {
+    Reply r;
+    if (size == 0) return r;
+    const char* p = data;
+    const char* last = data + size;
+    while (p != last && *p >= '0' && *p <= '9') ++p;
+    if (last - p < 2 || p[0] < 'A' || p[0] > 'Z' || p[1] < 'A' || p[1] > 'Z') {
+      r.status = REPLY_NO_OPCODE;
+      return r;
+    }
+    p += 2;
+    r.prefix = data;
+    r.prefix_size = static_cast<size_t>(p - data);
+    const ParseIntResult v = ParseInt(p, last, &r.value);
+    r.status = v.status;
+    if (v.status != REPLY_OK) return r;
+    // The frame ends with the number and optional blanks; a bare end is accepted too
+    p = v.ptr;
+    while (p != last && *p == ' ') ++p;
+    const size_t rest = static_cast<size_t>(last - p);
+    if (rest != 0 && !(rest == 2 && p[0] == '\r' && p[1] == '\n')) r.status = REPLY_BAD_VALUE;
+    return r;
+  }
+};
+
+}
+
+#endif // LIBAGILISPIEZO_REPLY_H
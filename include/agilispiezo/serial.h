@@ -16,13 +16,12 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-
 #ifndef LIBAGILISPIEZO_SERIAL_H
 #define LIBAGILISPIEZO_SERIAL_H
 
 #include <asio.hpp>
 #include <string>
-#include <functional>
+#include "transport.h"
 
 #define STOPBITS_TYPE asio::serial_port_base::stop_bits
 #define ONESTOPBIT    STOPBITS_TYPE(STOPBITS_TYPE::one)
@@ -36,13 +35,14 @@
 
 namespace agilispiezo {
 
-// Callback type for logging
-using LogCallback = std::function<void(const std::string&)>;
-
-class Serial {
+/// Transport over a local serial port (USB virtual COM port or RS232).
+class Serial : public Transport {
 public:
+  /// Runs its own io_context on a private I/O thread.
   Serial();
-  ~Serial();
+  /// Uses an io_context run by the caller, e.g. a ControllerPool. No thread is started.
+  explicit Serial(asio::io_context& io);
+  ~Serial() override;
 
   bool Connect(const std::string& device_port_name,
     const unsigned int baud_rate, const unsigned int byte_size,
@@ -50,29 +50,18 @@ public:
     const int handshake_timeout_ms = 1000,
     const std::string& handshake_send = "",
     const std::string& handshake_expect = "");
-  void Disconnect();
-  bool IsConnected();
-  size_t Send(const std::string& write);
-  bool ListenUntil(std::string* read, const std::string& delimiter,
-    const int timeout_ms);
-  void FlushListen();
-  void FlushSend();
-  
-  // Set callback for logging
-  void SetLogCallback(LogCallback callback);
+  bool IsConnected() override;
 
-private:
-  void Log(const std::string& message);
-  std::string BytesToHex(const std::string& data);
-  std::string EscapeString(const std::string& data);
-  void StartIOThread();
-  void StopIOThread();
+protected:
+  bool IsOpen() const override;
+  void AsyncReadSome(const asio::mutable_buffer& buffer, ReadHandler handler) override;
+  size_t Write(const std::vector<asio::const_buffer>& writes, asio::error_code& ec) override;
+  void Close() override;
+  void DiscardInput() override;
+  void DiscardOutput() override;
 
-  std::unique_ptr<asio::serial_port> port_ = nullptr;
-  asio::io_context io_;
-  std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> work_;
-  std::thread io_thread_;
-  LogCallback log_callback_ = nullptr;
+private:
+  asio::serial_port port_;
 };
 
 }
@@ -0,0 +1,86 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_SPSC_RING_H
+#define LIBAGILISPIEZO_SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace agilispiezo {
+
+/**
+ * @brief Bounded lock-free ring for one producer and one consumer thread.
+ * Push() and Pop() never block and never allocate. The capacity is rounded
+ * up to a power of two.
+*/
+template <typename T>
+class SpscRing {
+public:
+  explicit SpscRing(const size_t capacity) {
+    size_t n = 1;
+    while (n < capacity) n <<= 1;
+    buffer_.resize(n);
+    mask_ = n - 1;
+  }
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+  /// Producer side. Returns false and drops value when the ring is full.
+  bool Push(const T& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+    buffer_[tail & mask_] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Consumer side. Returns false when the ring is empty.
+  bool Pop(T* out) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    *out = buffer_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// Elements ready to pop. Exact on the consumer thread, a hint elsewhere.
+  size_t Size() const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+  size_t Capacity() const { return mask_ + 1; }
+
+private:
+  static constexpr size_t kCacheLine = 64;
+
+  std::vector<T> buffer_;
+  size_t mask_ = 0;
+  // head_ and tail_ on separate cache lines, so the threads do not share one
+  char pad0_[kCacheLine];
+  std::atomic<size_t> head_{0}; // Next slot to pop, written by the consumer
+  char pad1_[kCacheLine - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail_{0}; // Next slot to push, written by the producer
+  char pad2_[kCacheLine - sizeof(std::atomic<size_t>)];
+};
+
+}
+
+#endif // LIBAGILISPIEZO_SPSC_RING_H
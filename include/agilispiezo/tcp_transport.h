@@ -0,0 +1,63 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_TCP_TRANSPORT_H
+#define LIBAGILISPIEZO_TCP_TRANSPORT_H
+
+#include <asio.hpp>
+#include <string>
+#include "transport.h"
+
+namespace agilispiezo {
+
+/**
+ * @brief Transport over a raw TCP socket, e.g. a serial-to-Ethernet server
+ * in TCP server mode. Nagle is disabled so each command leaves right away.
+*/
+class TcpTransport : public Transport {
+public:
+  /// Runs its own io_context on a private I/O thread.
+  TcpTransport();
+  /// Uses an io_context run by the caller, e.g. a ControllerPool. No thread is started.
+  explicit TcpTransport(asio::io_context& io);
+  ~TcpTransport() override;
+
+  /**
+   * @brief Connect to host:port and run the handshake.
+   * Blocks until connected or timeout_ms elapsed, plus the name lookup of a
+   * non-numeric host. Must not be called from a thread running the
+   * transport's io_context.
+  */
+  bool Connect(const std::string& host, const unsigned short port,
+    const int timeout_ms = 1000,
+    const std::string& handshake_send = "",
+    const std::string& handshake_expect = "");
+
+protected:
+  bool IsOpen() const override;
+  void AsyncReadSome(const asio::mutable_buffer& buffer, ReadHandler handler) override;
+  size_t Write(const std::vector<asio::const_buffer>& writes, asio::error_code& ec) override;
+  void Close() override;
+
+private:
+  asio::ip::tcp::socket socket_;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_TCP_TRANSPORT_H
@@ -0,0 +1,148 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_TRACE_H
+#define LIBAGILISPIEZO_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace agilispiezo {
+
+enum TraceDirection {
+  TRACE_TX = 0, // Bytes written to the controller
+  TRACE_RX = 1  // "\r\n" terminated frame received from the controller
+};
+
+/// TraceEntry::flags
+enum TraceFlag {
+  TRACE_FLAG_SAME_WRITE = 1 // TX buffer gathered into the write of the previous entry
+};
+
+/// One captured write or frame. 64 bytes, stored as is in trace files.
+struct TraceEntry {
+  static constexpr size_t kMaxData = 52;
+
+  int64_t time_ns;   ///< Since the recorder was created.
+  uint16_t size;     ///< Original length; only the first kMaxData bytes are kept.
+  uint8_t direction; ///< TraceDirection.
+  uint8_t flags;     ///< TraceFlag bits.
+  char data[kMaxData];
+
+  size_t StoredSize() const { return size < kMaxData ? size : kMaxData; }
+  std::string str() const { return std::string(data, StoredSize()); }
+};
+
+/**
+ * @brief Captures raw TX/RX traffic into a preallocated lock-free ring.
+ * Record() is lock-free: the I/O thread and the engine only claim a slot
+ * and copy at most 52 bytes into it, nothing is formatted or allocated.
+ * When the ring is full new entries are dropped and counted. Entries are
+ * taken out with Pop() or written to a file by a background thread.
+ *
+ * Trace file: 16 byte header "AGTR", uint16 version (1), uint16 entry size
+ * (64), 8 reserved bytes; then TraceEntry records in host byte order.
+*/
+class TraceRecorder {
+public:
+  static constexpr uint16_t kFileVersion = 1;
+
+  /// capacity is rounded up to a power of two.
+  explicit TraceRecorder(const size_t capacity = 8192);
+  ~TraceRecorder();
+
+  TraceRecorder(const TraceRecorder&) = delete;
+  TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+  /// Safe to call from any number of threads.
+  void Record(const TraceDirection direction, const char* data, const size_t size,
+    const uint8_t flags = 0);
+
+  /// Oldest entry. Single consumer; not while a file flush is running.
+  bool Pop(TraceEntry* out);
+
+  size_t GetCapacity() const;
+  /// Entries lost because the ring was full.
+  uint64_t GetDroppedCount() const;
+
+  /**
+   * @brief Write entries to path from a background thread.
+   * The thread drains the ring every interval_ms, so the writers never
+   * wait for the disk. Size the ring for the traffic of one interval.
+  */
+  bool StartFileFlush(const std::string& path, const int interval_ms = 10);
+  /// Write what is left and close the file.
+  void StopFileFlush();
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    TraceEntry entry;
+  };
+
+  void __FlushLoop(const int interval_ms);
+
+  static constexpr size_t kCacheLine = 64;
+
+  const std::chrono::steady_clock::time_point start_;
+  size_t mask_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  // Writers and the reader on separate cache lines
+  char pad0_[kCacheLine];
+  std::atomic<size_t> enqueue_{0}; // Next slot to claim, shared by the writers
+  char pad1_[kCacheLine - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_{0}; // Next slot to pop
+  char pad2_[kCacheLine - sizeof(std::atomic<size_t>)];
+  std::atomic<uint64_t> dropped_{0};
+
+  std::mutex flush_m_;
+  std::condition_variable flush_cv_;
+  std::thread flush_thread_;
+  std::FILE* file_ = nullptr;
+  bool flush_stop_ = false;
+};
+
+/// Reads a trace file written by TraceRecorder::StartFileFlush().
+class TraceReader {
+public:
+  TraceReader() = default;
+  ~TraceReader();
+
+  TraceReader(const TraceReader&) = delete;
+  TraceReader& operator=(const TraceReader&) = delete;
+
+  bool Open(const std::string& path, std::string* out_error = nullptr);
+  void Close();
+  /// Next entry, false at the end of the file.
+  bool Next(TraceEntry* out);
+
+private:
+  std::FILE* file_ = nullptr;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_TRACE_H
@@ -0,0 +1,134 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_TRAJECTORY_H
+#define LIBAGILISPIEZO_TRAJECTORY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include "agilispiezo.h"
+
+namespace agilispiezo {
+
+/// One step of a trajectory, see TrajectoryFile for the file layout.
+struct TrajectoryRecord {
+  int axis = 0;          ///< 1 or 2.
+  int channel = 0;       ///< 1-4 selects the AG-UC8 channel first, 0 keeps the current one.
+  char opcode[2] = { 0, 0 }; ///< PR, PA, SU, DL, ZP or ST.
+  int32_t argument = 0;  ///< Steps, position, signed amplitude or delay.
+  uint32_t dwell_ms = 0; ///< Wait after the record, once its axis is ready again.
+};
+
+/**
+ * @brief Read-only, memory-mapped trajectory file.
+ * Layout, little endian: a 16 byte header "AGTJ", uint16 version (1),
+ * uint16 record size (12), uint32 record count, uint32 reserved; then the
+ * records as uint8 axis, uint8 channel, char opcode[2], int32 argument,
+ * uint32 dwell_ms. Opening maps the file without reading it, so any size
+ * opens at once and pages are only touched while they are played.
+*/
+class TrajectoryFile {
+public:
+  static constexpr size_t kHeaderSize = 16;
+  static constexpr size_t kRecordSize = 12;
+  static constexpr uint16_t kVersion = 1;
+
+  TrajectoryFile() = default;
+  ~TrajectoryFile();
+
+  TrajectoryFile(const TrajectoryFile&) = delete;
+  TrajectoryFile& operator=(const TrajectoryFile&) = delete;
+
+  bool Open(const std::string& path, std::string* out_error = nullptr);
+  void Close();
+  bool IsOpen() const;
+  size_t GetRecordCount() const;
+  /// Decode record i, false if i is out of range.
+  bool GetRecord(const size_t i, TrajectoryRecord* out) const;
+
+  /**
+   * @brief Compile a text trajectory into the binary format, line by line.
+   * One command per line in controller syntax with an optional dwell in
+   * milliseconds, e.g. "1PR-500 20". "CC<n>" selects the channel of the
+   * lines that follow, "#" starts a comment.
+   * @param out_error "line N: ..." for the first bad line.
+  */
+  static bool Compile(const std::string& text_path,
+    const std::string& binary_path, std::string* out_error = nullptr);
+
+private:
+  const unsigned char* data_ = nullptr;
+  size_t size_ = 0;
+  size_t count_ = 0;
+#if defined(_WIN64) || defined(_WIN32)
+  void* mapping_ = nullptr;
+#endif
+};
+
+/**
+ * @brief Plays a TrajectoryFile on one controller.
+ * Records are streamed straight from the mapping into command batches, so
+ * memory use does not depend on the trajectory length. Consecutive records
+ * go out in one write until a dwell, a channel change or a record on an
+ * axis that is still moving; one batch is queued while the next is built.
+ * Moves of axis 1 and axis 2 overlap: a record for a moving axis waits
+ * for both axes, so alternating moves run in pairs like MotionScheduler.
+ *
+ * Not thread-safe apart from Stop() and GetPlayedCount(). The controller
+ * must not be driven from elsewhere while Play() is active.
+*/
+class TrajectoryPlayer {
+public:
+  explicit TrajectoryPlayer(AgilisPiezo& piezo);
+
+  /**
+   * @brief Play every record of the trajectory.
+   * @param move_timeout_ms Longest wait for a moving axis to become ready.
+   * @return true if every record was accepted and every move finished.
+  */
+  bool Play(const TrajectoryFile& trajectory, const int move_timeout_ms = 30000);
+
+  /// Let Play() return false after the batch in progress; a dwell ends at once.
+  void Stop();
+
+  /// Records sent so far by the current or last Play().
+  size_t GetPlayedCount() const;
+
+private:
+  bool __Flush();
+  bool __WaitBatch();
+  bool __WaitAxis(const int axis, const int move_timeout_ms);
+
+  AgilisPiezo& piezo_;
+  AgilisPiezo::CommandBatch batch_;
+  std::future<AgilisPiezo::CommandResult> pending_;
+  size_t pending_count_ = 0;
+  bool moving_[2] = { false, false };
+  std::atomic<bool> stop_{false};
+  std::mutex stop_m_;
+  std::condition_variable stop_cv_; // Wakes a dwell on Stop()
+  std::atomic<size_t> played_{0};
+};
+
+}
+
+#endif // LIBAGILISPIEZO_TRAJECTORY_H
@@ -0,0 +1,161 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBAGILISPIEZO_TRANSPORT_H
+#define LIBAGILISPIEZO_TRANSPORT_H
+
+#include <asio.hpp>
+#include <string>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <memory>
+#include "trace.h"
+
+namespace agilispiezo {
+
+// Callback type for logging
+using LogCallback = std::function<void(const std::string&)>;
+
+// Called from the read loop when frames arrived or the loop stopped
+using FrameCallback = std::function<void()>;
+
+/**
+ * @brief Byte stream to a controller with "\r\n" framing.
+ * The read loop, frame splitting, handshake and logging live here and are
+ * shared by every transport. Implementations only open the stream and
+ * provide the raw read, write, close and discard operations.
+*/
+class Transport {
+public:
+  /// Runs its own io_context on a private I/O thread.
+  Transport();
+  /// Uses an io_context run by the caller, e.g. a ControllerPool. No thread is started.
+  explicit Transport(asio::io_context& io);
+  virtual ~Transport();
+
+  Transport(const Transport&) = delete;
+  Transport& operator=(const Transport&) = delete;
+
+  void Disconnect();
+  virtual bool IsConnected();
+  size_t Send(const std::string& write);
+  size_t Send(const asio::const_buffer& write);
+  /// Write all buffers with one gathered write.
+  size_t Send(const std::vector<asio::const_buffer>& writes);
+  /**
+   * Send handshake_send and wait for a reply ending with handshake_expect.
+   * settle_ms is waited after opening before anything is sent; the reply,
+   * if any, is stored in out_reply.
+  */
+  bool Handshake(const std::string& handshake_send,
+    const std::string& handshake_expect, const int timeout_ms,
+    std::string* out_reply = nullptr, const int settle_ms = 100);
+  /// Pop received "\r\n" terminated frames until the data ends with delimiter.
+  bool ListenUntil(std::string* read, const std::string& delimiter,
+    const int timeout_ms);
+  /// Drop received frames and pending partial data.
+  void FlushListen();
+  /// Pop the oldest received frame without waiting.
+  bool PopFrame(std::string* frame);
+  /// True while the read loop is armed on an open stream.
+  bool IsListening();
+  /// Arrival of the first byte received since the last Send(), epoch if none yet.
+  std::chrono::steady_clock::time_point GetFirstByteTime() const;
+  /**
+   * Set callback for new frames and read loop failures.
+   * The callback runs on an I/O thread with the receive lock held;
+   * it must only post work, e.g. to a strand, and return.
+  */
+  void SetFrameCallback(FrameCallback callback);
+  asio::io_context& GetIOContext();
+  /// Discard bytes not transmitted yet, including the tail of a line being sent.
+  void FlushSend();
+  
+  /// Capture every write and received frame into recorder, nullptr stops.
+  void SetTraceRecorder(std::shared_ptr<TraceRecorder> recorder);
+  
+  // Set callback for logging
+  void SetLogCallback(LogCallback callback);
+  // Messages are formatted and passed to the callback only while enabled
+  void SetLogEnabled(const bool enabled);
+
+protected:
+  using ReadHandler = std::function<void(const asio::error_code&, size_t)>;
+
+  // Stream operations of the implementation
+  virtual bool IsOpen() const = 0;
+  virtual void AsyncReadSome(const asio::mutable_buffer& buffer, ReadHandler handler) = 0;
+  virtual size_t Write(const std::vector<asio::const_buffer>& writes, asio::error_code& ec) = 0;
+  /// Cancel pending reads and close. The pending read must complete afterwards.
+  virtual void Close() = 0;
+  /// Drop bytes buffered by the OS or device, if the stream has such a buffer.
+  virtual void DiscardInput() { }
+  virtual void DiscardOutput() { }
+
+  /// Arm the read loop once the stream is open.
+  void StartReadLoop();
+  bool IsLogEnabled() const;
+  void Log(const std::string& message);
+  static std::string BytesToHex(const std::string& data);
+  static std::string EscapeString(const std::string& data);
+
+private:
+  void Trace(const TraceDirection direction, const char* data, const size_t size,
+    const uint8_t flags = 0);
+  void StartIOThread();
+  void StopIOThread();
+  void ReadSome(const uint64_t generation);
+  void OnRead(const uint64_t generation, const asio::error_code& ec, const size_t bytes);
+  std::string RingToString(size_t begin, const size_t end) const;
+
+  static constexpr size_t kRxRingSize = 4096;
+
+  std::unique_ptr<asio::io_context> own_io_;
+  asio::io_context& io_;
+  std::unique_ptr<asio::executor_work_guard<asio::io_context::executor_type>> work_;
+  std::thread io_thread_;
+  LogCallback log_callback_ = nullptr;
+  std::atomic<bool> log_enabled_{false};
+  std::shared_ptr<TraceRecorder> trace_; // std::atomic_load/store only
+  std::atomic<bool> tracing_{false};
+
+  // Receive side, fed by a continuously armed AsyncReadSome.
+  // rx_head_/rx_tail_/rx_scan_ are monotonic offsets into rx_ring_.
+  std::mutex rx_m_;
+  std::condition_variable rx_cv_;
+  char rx_ring_[kRxRingSize];
+  size_t rx_head_ = 0;
+  size_t rx_tail_ = 0;
+  size_t rx_scan_ = 0;
+  std::deque<std::string> rx_frames_;
+  bool rx_failed_ = true; // Until the read loop is started
+  bool rx_pending_ = false;
+  uint64_t rx_generation_ = 0;
+  std::atomic<std::chrono::steady_clock::rep> rx_first_byte_{0}; // 0 until data after Send()
+  FrameCallback frame_callback_ = nullptr;
+};
+
+}
+
+#endif // LIBAGILISPIEZO_TRANSPORT_H
@@ -18,65 +18,445 @@
 
 
 #include "agilispiezo.h"
+#include "tcp_transport.h"
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
 #include <iostream>
-#include <sstream>
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#endif
+
+// Evaluates the message only when the level is enabled at run time.
+// Sites below AGILISPIEZO_MIN_LOG_LEVEL are compiled out.
+#ifndef AGILISPIEZO_MIN_LOG_LEVEL
+#define AGILISPIEZO_MIN_LOG_LEVEL 0
+#endif
+#define AGILISPIEZO_LOG(level, message) \
+  do { \
+    if ((level) >= AGILISPIEZO_MIN_LOG_LEVEL && __IsLogEnabled(level)) \
+      __Log((level), (message)); \
+  } while (0)
 
 namespace agilispiezo {
 
-AgilisPiezo::AgilisPiezo() {
-  serial_ = std::make_unique<Serial>();
-  serial_->SetLogCallback([this](const std::string& message) {
-    __Log(LOG_DEBUG, "Serial: " + message);
+namespace {
+// Lower bound of the learned set-only delay in PACING_ADAPTIVE
+constexpr int64_t kAdaptiveMinDelayMs = 2;
+// EnumerateControllers waits at least this long, or 4 round trips, for the
+// fallback VE; well above the 16 ms latency timer of FTDI adapters
+constexpr int64_t kProbeMinTimeoutMs = 100;
+}
+
+AgilisPiezo::AgilisPiezo()
+  : own_io_(std::make_unique<asio::io_context>()), io_(*own_io_) {
+  work_ = std::make_unique<asio::executor_work_guard<asio::io_context::executor_type>>(io_.get_executor());
+  io_thread_ = std::thread([this]() {
+    io_.run();
   });
-  cmd_term_timer_.Start();
+  __Init();
+}
+
+AgilisPiezo::AgilisPiezo(asio::io_context& io) : io_(io) {
+  __Init();
 }
 
 AgilisPiezo::~AgilisPiezo() {
-  __Log(LOG_INFO, "Destroying AgilisPiezo instance");
+  AGILISPIEZO_LOG(LOG_INFO, "Destroying AgilisPiezo instance");
+  {
+    std::lock_guard<std::mutex> l(reconnect_m_);
+    reconnect_stop_ = true;
+  }
+  reconnect_cv_.notify_all();
+  if (reconnect_thread_.joinable()) reconnect_thread_.join();
   DisconnectDevice();
+  __StopEngine();
+  transport_->SetFrameCallback(nullptr);
+  transport_.reset();
+  timer_.reset();
+  deadline_timer_.reset();
+  if (own_io_) {
+    work_.reset();
+    io_.stop();
+    if (io_thread_.joinable()) io_thread_.join();
+  }
+}
+
+void AgilisPiezo::__Init() {
+  strand_ = std::make_unique<Strand>(io_.get_executor());
+  timer_ = std::make_unique<asio::steady_timer>(io_);
+  deadline_timer_ = std::make_unique<asio::steady_timer>(io_);
+  transport_ = std::make_unique<Serial>(io_);
+  __PrepareTransport(transport_.get());
+  cmd_term_timer_.Start();
+}
+
+void AgilisPiezo::__PrepareTransport(Transport* transport) {
+  transport->SetLogCallback([this](const std::string& message) {
+    __Log(LOG_DEBUG, "Transport: " + message);
+  });
+  transport->SetLogEnabled(log_level_.load() <= LOG_DEBUG);
+  transport->SetFrameCallback([this]() {
+    asio::post(*strand_, [this]() { __OnFrames(); });
+  });
+  std::lock_guard<std::mutex> l(transport_m_);
+  transport->SetTraceRecorder(trace_);
+}
+
+asio::io_context& AgilisPiezo::GetIOContext() {
+  return io_;
 }
 
 bool AgilisPiezo::ConnectDeviceUSB(const std::string& port_name) {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Connecting to USB device on port: " + port_name);
-  if (serial_->Connect(port_name, 921600, 8,
-    ONESTOPBIT, NOPARITY, 1000, "VE\r\n", "\r\n"
-  )) {
-    last_port_name_ = port_name;
-    __Log(LOG_INFO, "Successfully connected to USB device");
-    return true;
-  }
-  __Log(LOG_ERROR, "Failed to connect to USB device");
-  return false;
+  return __ConnectSerial(port_name, 921600, "USB");
 }
 
 bool AgilisPiezo::ConnectDeviceRS232(const std::string& port_name) {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Connecting to RS232 device on port: " + port_name);
-  if (serial_->Connect(port_name, 115200, 8,
-    ONESTOPBIT, NOPARITY, 1000, "VE\r\n", "\r\n"
-  )) {
-    last_port_name_ = port_name;
-    __Log(LOG_INFO, "Successfully connected to RS232 device");
-    return true;
+  return __ConnectSerial(port_name, 115200, "RS232");
+}
+
+bool AgilisPiezo::ConnectDeviceTCP(const std::string& host, const unsigned short port) {
+  return __ConnectTCP(host, port);
+}
+
+bool AgilisPiezo::ConnectDevice(std::unique_ptr<Transport> transport, const std::string& name) {
+  if (!transport || &transport->GetIOContext() != &io_) {
+    AGILISPIEZO_LOG(LOG_ERROR, "Transport must run on the controller's io_context");
+    return false;
   }
-  __Log(LOG_ERROR, "Failed to connect to RS232 device");
-  return false;
+  Transport* raw = transport.get();
+  // A transport of the caller cannot be reopened, so there is no reconnect
+  return __ConnectDevice(std::move(transport), name, "custom",
+    [raw]() {
+      return raw->IsListening() && raw->Handshake("VE\r\n", "\r\n", 1000);
+    }, nullptr, 0);
+}
+
+bool AgilisPiezo::__ConnectSerial(const std::string& port_name,
+  const unsigned int baud_rate, const std::string& kind,
+  const uint64_t reconnect_session) {
+  auto serial = std::make_unique<Serial>(io_);
+  Serial* raw = serial.get();
+  return __ConnectDevice(std::move(serial), port_name, kind,
+    [raw, &port_name, baud_rate]() {
+      return raw->Connect(port_name, baud_rate, 8,
+        ONESTOPBIT, NOPARITY, 1000, "VE\r\n", "\r\n");
+    },
+    [this, port_name, baud_rate, kind](uint64_t session) {
+      return __ConnectSerial(port_name, baud_rate, kind, session);
+    }, reconnect_session);
+}
+
+bool AgilisPiezo::__ConnectTCP(const std::string& host, const unsigned short port,
+  const uint64_t reconnect_session) {
+  auto tcp = std::make_unique<TcpTransport>(io_);
+  TcpTransport* raw = tcp.get();
+  return __ConnectDevice(std::move(tcp), host + ":" + std::to_string(port), "TCP",
+    [raw, &host, port]() {
+      return raw->Connect(host, port, 1000, "VE\r\n", "\r\n");
+    },
+    [this, host, port](uint64_t session) {
+      return __ConnectTCP(host, port, session);
+    }, reconnect_session);
+}
+
+bool AgilisPiezo::__ConnectDevice(std::unique_ptr<Transport> transport,
+  const std::string& port_name, const std::string& kind,
+  const std::function<bool()>& open, Reopen reopen,
+  const uint64_t reconnect_session) {
+  __PauseEngine();
+  bool connected = false;
+  bool superseded = false;
+  {
+    std::lock_guard<std::mutex> l(connect_m_);
+    superseded = reconnect_session != 0 && reconnect_session != session_id_;
+    if (!superseded) {
+      AGILISPIEZO_LOG(LOG_INFO, "Connecting to " + kind + " device on port: " + port_name);
+      transport_->Disconnect();
+      __PrepareTransport(transport.get());
+      connected = open();
+      std::atomic_store(&port_name_, std::make_shared<const std::string>(
+        connected ? port_name : std::string()));
+      {
+        // The paused engine leaves transport_ alone, other readers hold transport_m_
+        std::lock_guard<std::mutex> lt(transport_m_);
+        transport_->SetFrameCallback(nullptr);
+        transport_ = std::move(transport);
+        transport_->SetLogEnabled(log_level_.load() <= LOG_DEBUG); // SetLogLevel() during open()
+      }
+      if (reconnect_session == 0) {
+        // A new session; a reconnect keeps the link down until restored
+        ++session_id_;
+        link_down_ = false;
+        session_active_ = connected;
+        std::lock_guard<std::mutex> lr(reconnect_m_);
+        reopen_ = connected ? std::move(reopen) : nullptr;
+        reconnect_pending_ = false;
+      }
+    }
+  }
+  if (!superseded) {
+    __ClearCache();
+    estimator_.Reset();
+  }
+  __ResumeEngine();
+  if (superseded) {
+    AGILISPIEZO_LOG(LOG_INFO, "Reconnect cancelled, the connection was changed meanwhile");
+  } else if (connected) {
+    AGILISPIEZO_LOG(LOG_INFO, "Successfully connected to " + kind + " device");
+  } else {
+    AGILISPIEZO_LOG(LOG_ERROR, "Failed to connect to " + kind + " device");
+  }
+  return connected;
 }
 
 void AgilisPiezo::DisconnectDevice() {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Disconnecting device");
-  serial_->Disconnect();
-  last_port_name_.clear();
+  __PauseEngine();
+  {
+    std::lock_guard<std::mutex> l(connect_m_);
+    AGILISPIEZO_LOG(LOG_INFO, "Disconnecting device");
+    transport_->Disconnect();
+    std::atomic_store(&port_name_, std::make_shared<const std::string>());
+    ++session_id_;
+    link_down_ = false;
+    session_active_ = false;
+    std::lock_guard<std::mutex> lr(reconnect_m_);
+    reopen_ = nullptr;
+    reconnect_pending_ = false;
+  }
+  __ClearCache();
+  estimator_.Reset();
+  __ResumeEngine();
+}
+
+std::vector<std::string> AgilisPiezo::ListSerialPorts() {
+  std::vector<std::string> ports;
+#if defined(_WIN64) || defined(_WIN32)
+  char target[256];
+  for (int i = 1; i <= 256; ++i) {
+    const std::string name = "COM" + std::to_string(i);
+    if (QueryDosDeviceA(name.c_str(), target, sizeof(target)) == 0) continue;
+    ports.push_back(i < 10 ? name : "\\\\.\\" + name);
+  }
+#elif defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+  static const char* const kPrefixes[] = {
+    "ttyUSB", "ttyACM", "cu.usbserial", "cu.usbmodem" };
+  DIR* dir = opendir("/dev");
+  if (!dir) return ports;
+  while (const dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    for (const char* prefix : kPrefixes) {
+      if (name.compare(0, std::strlen(prefix), prefix) == 0) {
+        ports.push_back("/dev/" + name);
+        break;
+      }
+    }
+  }
+  closedir(dir);
+  std::sort(ports.begin(), ports.end());
+#endif
+  return ports;
+}
+
+std::map<std::string, AgilisPiezo::ControllerInfo> AgilisPiezo::EnumerateControllers(
+  const std::vector<std::string>& port_names, const int handshake_timeout_ms) {
+  const std::vector<std::string> ports = port_names.empty() ? ListSerialPorts() : port_names;
+  std::map<std::string, ControllerInfo> found;
+  if (ports.empty()) return found;
+
+  static const struct { unsigned int baud_rate; const char* kind; } kProbes[] = {
+    { 921600, "USB" }, { 115200, "RS232" } };
+
+  // The probes block in Handshake(), their read loops share one I/O thread
+  asio::io_context io;
+  asio::executor_work_guard<asio::io_context::executor_type> work(io.get_executor());
+  std::thread io_thread([&io]() { io.run(); });
+
+  std::mutex found_m;
+  std::atomic<int64_t> max_rtt_us{0}; // Slowest VE round trip so far, 0 until one answered
+  std::vector<std::thread> probes;
+  probes.reserve(ports.size());
+  for (const std::string& port : ports) {
+    probes.emplace_back([&, port]() {
+      Serial serial(io);
+      for (const auto& probe : kProbes) {
+        // A port that cannot be opened will not open at the other rate either
+        if (!serial.Connect(port, probe.baud_rate, 8, ONESTOPBIT, NOPARITY)) return;
+        int64_t timeout_ms = handshake_timeout_ms;
+        // Only the fallback rate is shortened, a slow adapter gets the full
+        // timeout at the first rate no matter how fast other ports answered
+        const int64_t rtt_us = max_rtt_us.load();
+        if (&probe != &kProbes[0] && rtt_us > 0) {
+          timeout_ms = std::min(timeout_ms, std::max(kProbeMinTimeoutMs, 4 * rtt_us / 1000 + 1));
+        }
+        std::string reply;
+        const auto start = sclock::now();
+        const bool answered = serial.Handshake("VE\r\n", "\r\n",
+          static_cast<int>(timeout_ms), &reply, 0);
+        const int64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+          sclock::now() - start).count();
+        serial.Disconnect();
+        reply.erase(reply.size() - std::min<size_t>(reply.size(), 2));
+        // Line noise at the wrong rate can end in "\r\n" too
+        const bool valid = !reply.empty() && std::all_of(reply.begin(), reply.end(),
+          [](const char c) { return c >= 0x20 && c < 0x7f; });
+        if (!answered || !valid) continue;
+
+        int64_t seen = max_rtt_us.load();
+        while (elapsed_us > seen && !max_rtt_us.compare_exchange_weak(seen, elapsed_us)) { }
+        ControllerInfo info;
+        info.kind = probe.kind;
+        info.baud_rate = probe.baud_rate;
+        info.firmware_version = reply;
+        std::lock_guard<std::mutex> l(found_m);
+        found[port] = info;
+        return;
+      }
+    });
+  }
+  for (auto& probe : probes) probe.join();
+  work.reset();
+  io_thread.join();
+  return found;
+}
+
+void AgilisPiezo::SetAutoReconnect(const bool enabled,
+  const int initial_delay_ms, const int max_delay_ms) {
+  {
+    std::lock_guard<std::mutex> l(reconnect_m_);
+    AGILISPIEZO_LOG(LOG_INFO, std::string("Auto reconnect ") + (enabled ? "enabled" : "disabled"));
+    auto_reconnect_ = enabled;
+    reconnect_initial_ms_ = std::max(1, initial_delay_ms);
+    reconnect_max_ms_ = std::max(reconnect_initial_ms_, max_delay_ms);
+    if (!enabled) {
+      reconnect_pending_ = false;
+    }
+    else if (link_down_ && reopen_) {
+      reconnect_pending_ = true;
+      reconnect_session_ = session_id_;
+    }
+    if (enabled && !reconnect_thread_.joinable()) {
+      reconnect_thread_ = std::thread([this]() { __SuperviseConnection(); });
+    }
+  }
+  reconnect_cv_.notify_all();
+}
+
+bool AgilisPiezo::IsLinkDown() const {
+  return link_down_.load();
+}
+
+void AgilisPiezo::__OnLinkLost() const {
+  if (!session_active_ || link_down_.exchange(true)) return;
+  AGILISPIEZO_LOG(LOG_ERROR, "Connection lost, failing queued commands");
+  Session session;
+  session.remote = remote_mode_;
+  {
+    std::lock_guard<std::mutex> l(cache_m_);
+    for (int a = 0; a < 2; ++a) {
+      session.step_delay[a] = step_delay_[a];
+      session.step_amplitude[a][0] = step_amplitude_[a][0];
+      session.step_amplitude[a][1] = step_amplitude_[a][1];
+    }
+    session.channel = channel_;
+  }
+  std::deque<PendingCommand> dropped;
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    dropped.swap(queue_);
+  }
+  for (auto& cmd : dropped) cmd.Finish(CommandResult());
+  {
+    std::lock_guard<std::mutex> l(reconnect_m_);
+    lost_session_ = session;
+    if (auto_reconnect_ && reopen_) {
+      reconnect_pending_ = true;
+      reconnect_session_ = session_id_;
+    }
+  }
+  reconnect_cv_.notify_all();
+}
+
+void AgilisPiezo::__SuperviseConnection() {
+  std::unique_lock<std::mutex> l(reconnect_m_);
+  while (!reconnect_stop_) {
+    reconnect_cv_.wait(l, [this]() { return reconnect_stop_ || reconnect_pending_; });
+    int delay_ms = reconnect_initial_ms_;
+    for (int attempt = 1; reconnect_pending_ && !reconnect_stop_; ++attempt) {
+      if (reconnect_cv_.wait_for(l, std::chrono::milliseconds(delay_ms),
+        [this]() { return reconnect_stop_ || !reconnect_pending_; })) {
+        break;
+      }
+      const Reopen reopen = reopen_;
+      const uint64_t session = reconnect_session_;
+      const Session restore = lost_session_;
+      l.unlock();
+      AGILISPIEZO_LOG(LOG_INFO, "Reconnecting, attempt " + std::to_string(attempt));
+      const bool restored = reopen && reopen(session) && __RestoreSession(restore);
+      l.lock();
+      if (restored && session == reconnect_session_ && session == session_id_) {
+        link_down_ = false;
+        reconnect_pending_ = false;
+        AGILISPIEZO_LOG(LOG_INFO, "Reconnected after " + std::to_string(attempt) + " attempts");
+      }
+      delay_ms = std::min(delay_ms * 2, reconnect_max_ms_);
+    }
+  }
+}
+
+bool AgilisPiezo::__RestoreSession(const Session& session) const {
+  // Remote mode first, the controller refuses settings in local mode
+  PendingCommand cmd;
+  cmd.command = Command(opcode::TE);
+  cmd.expect_reply = true;
+  cmd.recovery = true;
+  if (session.remote) cmd.batch.push_back(Command(opcode::MR));
+  for (int a = 0; a < 2; ++a) {
+    for (int forward = 0; forward < 2; ++forward) {
+      const CachedValue& su = session.step_amplitude[a][forward];
+      if (su.valid) cmd.batch.push_back(Command(a + 1, opcode::SU).AppendSigned(forward != 0, su.value));
+    }
+    if (session.step_delay[a].valid)
+      cmd.batch.push_back(Command(a + 1, opcode::DL).Append(session.step_delay[a].value));
+  }
+  if (session.channel.valid) cmd.batch.push_back(Command(opcode::CC).Append(session.channel.value));
+  if (cmd.batch.empty()) return true;
+
+  AGILISPIEZO_LOG(LOG_INFO, "Restoring " + std::to_string(cmd.batch.size()) + " session settings");
+  const CommandResult r = __Submit(std::move(cmd)).get();
+  int e = ERRORCODE_NOERROR;
+  if (!r.replied || !Command(opcode::TE).ParseReply(r.reply, &e) || e != ERRORCODE_NOERROR) {
+    AGILISPIEZO_LOG(LOG_ERROR, "Failed to restore session settings, error " + std::to_string(e));
+    return false;
+  }
+  for (int a = 0; a < 2; ++a) {
+    for (int forward = 0; forward < 2; ++forward) {
+      const CachedValue& su = session.step_amplitude[a][forward];
+      if (su.valid) __SetCached(&step_amplitude_[a][forward], su.value);
+    }
+    if (session.step_delay[a].valid) __SetCached(&step_delay_[a], session.step_delay[a].value);
+  }
+  if (session.channel.valid) __SetCached(&channel_, session.channel.value);
+  return true;
 }
 
-bool AgilisPiezo::IsConnected() const {
+bool AgilisPiezo::IsConnected(const int64_t max_age_ms) const {
+  AGILISPIEZO_LOG(LOG_DEBUG, "Checking connection status");
+  {
+    std::lock_guard<std::mutex> l(transport_m_);
+    if (!transport_->IsListening()) return false;
+  }
+  const int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    sclock::now().time_since_epoch()).count();
+  if (max_age_ms > 0 && now_ms - last_reply_ms_.load() <= max_age_ms) return true;
   std::string buf;
-  __Log(LOG_DEBUG, "Checking connection status");
   bool ret = GetControllerFirmwareVersion(&buf);
-  __Log(LOG_DEBUG, "Connection status: " + std::string(ret ? "Connected" : "Disconnected"));
+  AGILISPIEZO_LOG(LOG_DEBUG, "Connection status: " + std::string(ret ? "Connected" : "Disconnected"));
   return ret;
 }
 
@@ -97,64 +477,71 @@ std::string AgilisPiezo::GetErrorText(const int e) const {
 }
 
 std::string AgilisPiezo::GetPortName() const {
-  return last_port_name_;
+  const std::shared_ptr<const std::string> name = std::atomic_load(&port_name_);
+  return name ? *name : std::string();
 }
 
-bool AgilisPiezo::SetStepDelay(const int axis, const int delay) const {
+bool AgilisPiezo::SetStepDelay(const int axis, const int delay,
+  const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "SetStepDelay: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "SetStepDelay: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Setting step delay for axis " + std::to_string(axis) + " to " + std::to_string(delay));
-  return __SendCommand(DL[axis] + std::to_string(delay));
+  AGILISPIEZO_LOG(LOG_INFO, "Setting step delay for axis " + std::to_string(axis) + " to " + std::to_string(delay));
+  const bool sent = SubmitCommand(Command(axis, opcode::DL).Append(delay), false, kReplyTimeoutMs, options).get().sent;
+  if (sent) __SetCached(&step_delay_[axis - 1], delay);
+  return sent;
 }
 
-bool AgilisPiezo::GetStepDelay(const int axis, int* out_delay) const {
+bool AgilisPiezo::GetStepDelay(
+  const int axis, int* out_delay, const int64_t max_age_ms, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "GetStepDelay: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "GetStepDelay: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting step delay for axis " + std::to_string(axis));
-  const bool ret = __SendCommand(DL[axis] + "?");
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, DL[axis], out_delay);
-  __Log(LOG_INFO, "Step delay for axis " + std::to_string(axis) + ": " + std::to_string(*out_delay));
-  return ret;
+  if (__GetCached(step_delay_[axis - 1], max_age_ms, out_delay)) return true;
+  AGILISPIEZO_LOG(LOG_INFO, "Getting step delay for axis " + std::to_string(axis));
+  const CommandResult r = SubmitCommand(Command(axis, opcode::DL).Append('?'), true, kReplyTimeoutMs, options).get();
+  if (__GetIntegerFromReturnValue(r.reply, Command(axis, opcode::DL), out_delay))
+    __SetCached(&step_delay_[axis - 1], *out_delay);
+  AGILISPIEZO_LOG(LOG_INFO, "Step delay for axis " + std::to_string(axis) + ": " + std::to_string(*out_delay));
+  return r.sent;
 }
 
 bool AgilisPiezo::StartJogMotion(
-  const int axis, const bool sign, const int jog_speed) const {
+  const int axis, const bool sign, const int jog_speed, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "StartJogMotion: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "StartJogMotion: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
   int speed = jog_speed;
   if (!sign) speed = -speed;
-  __Log(LOG_INFO, "Starting jog motion for axis " + std::to_string(axis) + 
+  AGILISPIEZO_LOG(LOG_INFO, "Starting jog motion for axis " + std::to_string(axis) + 
         " with speed " + std::to_string(speed));
-  return __SendCommand(JA[axis] + std::to_string(speed));
+  const bool sent = SubmitCommand(Command(axis, opcode::JA).Append(speed), false, kReplyTimeoutMs, options).get().sent;
+  if (sent) __SetCached(&jog_speed_[axis - 1], speed);
+  else __ClearCached(&jog_speed_[axis - 1]);
+  return sent;
 }
 
-bool AgilisPiezo::GetJogMode(
-  const int axis, bool* out_sign, int* out_jog_speed) const {
+bool AgilisPiezo::GetJogMode(const int axis, bool* out_sign,
+  int* out_jog_speed, const int64_t max_age_ms, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "GetJogMode: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "GetJogMode: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting jog mode for axis " + std::to_string(axis));
-  const bool ret = __SendCommand(JA[axis] + "?");
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, JA[axis], out_jog_speed);
+  bool sent = true;
+  if (!__GetCached(jog_speed_[axis - 1], max_age_ms, out_jog_speed)) {
+    AGILISPIEZO_LOG(LOG_INFO, "Getting jog mode for axis " + std::to_string(axis));
+    const CommandResult r = SubmitCommand(Command(axis, opcode::JA).Append('?'), true, kReplyTimeoutMs, options).get();
+    if (__GetIntegerFromReturnValue(r.reply, Command(axis, opcode::JA), out_jog_speed))
+      __SetCached(&jog_speed_[axis - 1], *out_jog_speed);
+    sent = r.sent;
+  }
   if (*out_jog_speed < 0) {
     *out_sign = false;
     *out_jog_speed = -(*out_jog_speed);
@@ -162,207 +549,317 @@ bool AgilisPiezo::GetJogMode(
   else {
     *out_sign = true;
   }
-  __Log(LOG_INFO, "Jog mode for axis " + std::to_string(axis) + ": sign=" + 
+  AGILISPIEZO_LOG(LOG_INFO, "Jog mode for axis " + std::to_string(axis) + ": sign=" + 
         (*out_sign ? "positive" : "negative") + ", speed=" + std::to_string(*out_jog_speed));
-  return ret; 
+  return sent;
 }
 
 bool AgilisPiezo::MeasureCurrentPosition(
-  const int axis, std::future<int>* out_position) const {
+  const int axis, std::future<int>* out_position, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "MeasureCurrentPosition: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "MeasureCurrentPosition: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Measuring current position for axis " + std::to_string(axis));
-  const bool ret = __SendCommand(MA[axis]);
-  *out_position = std::async(std::launch::async, [=]() {
-    std::string buf;
-    __Log(LOG_INFO, "Waiting for position measurement result (up to 130 seconds)");
-    __GetReturnValue(buf, 130000); // Up to 130 seconds 
+  AGILISPIEZO_LOG(LOG_INFO, "Measuring current position for axis " + std::to_string(axis));
+  __ClearCached(&jog_speed_[axis - 1]);
+  // The engine keeps MA in flight until the reply arrives (up to 130 seconds)
+  // and marks the controller busy, so nothing else can race the measurement.
+  auto position = std::make_shared<std::promise<int>>();
+  *out_position = position->get_future();
+  PendingCommand cmd;
+  cmd.command = Command(axis, opcode::MA);
+  cmd.expect_reply = true;
+  cmd.timeout_ms = kLongOperationTimeoutMs;
+  cmd.on_complete = [this, axis, position](const CommandResult& r) {
     int v = 0;
-    bool success = __GetIntegerFromReturnValue(buf, MA[axis], &v);
+    bool success = __GetIntegerFromReturnValue(r.reply, Command(axis, opcode::MA), &v);
     if (success) {
-      __Log(LOG_INFO, "Position measurement for axis " + std::to_string(axis) + ": " + std::to_string(v));
+      AGILISPIEZO_LOG(LOG_INFO, "Position measurement for axis " + std::to_string(axis) + ": " + std::to_string(v));
     } else {
-      __Log(LOG_ERROR, "Failed to parse position measurement result");
+      AGILISPIEZO_LOG(LOG_ERROR, "Failed to parse position measurement result");
     }
-    return v;
-  });
-  return ret;
+    position->set_value(v);
+  };
+  std::future<CommandResult> result = __Submit(std::move(cmd), options);
+  if (result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    return result.get().sent;
+  return true;
 }
 
-bool AgilisPiezo::SetToLocalMode() const {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Setting to local mode");
-  return __SendCommand("ML");
+bool AgilisPiezo::SetToLocalMode(const CallOptions& options) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Setting to local mode");
+  // The pushbuttons can change settings behind our back
+  __ClearCache();
+  remote_mode_ = false;
+  return SubmitCommand(Command(opcode::ML), false, kReplyTimeoutMs, options).get().sent;
 }
 
-bool AgilisPiezo::SetToRemoteMode() const {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Setting to remote mode");
-  return __SendCommand("MR");
+bool AgilisPiezo::SetToRemoteMode(const CallOptions& options) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Setting to remote mode");
+  const bool sent = SubmitCommand(Command(opcode::MR), false, kReplyTimeoutMs, options).get().sent;
+  if (sent) remote_mode_ = true;
+  return sent;
 }
 
 bool AgilisPiezo::MoveToLimit(
   const int axis, const bool sign,
-  const int jog_speed) const {
+  const int jog_speed, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "MoveToLimit: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "MoveToLimit: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
   std::string direction = sign ? "positive" : "negative";
-  __Log(LOG_INFO, "Moving axis " + std::to_string(axis) + " to " + direction + 
+  AGILISPIEZO_LOG(LOG_INFO, "Moving axis " + std::to_string(axis) + " to " + direction + 
         " limit with speed " + std::to_string(jog_speed));
-  return __SendCommand(MV[axis] + (sign ? "" : "-") + std::to_string(jog_speed));
+  __ClearCached(&jog_speed_[axis - 1]);
+  return SubmitCommand(
+    Command(axis, opcode::MV).AppendSigned(sign, jog_speed), false, kReplyTimeoutMs, options).get().sent;
 }
 
-bool AgilisPiezo::AbsoluteMove(const int axis, const int position) const {
+bool AgilisPiezo::AbsoluteMove(const int axis, const int position,
+  const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "AbsoluteMove: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "AbsoluteMove: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Moving axis " + std::to_string(axis) + " to absolute position " + 
+  AGILISPIEZO_LOG(LOG_INFO, "Moving axis " + std::to_string(axis) + " to absolute position " + 
         std::to_string(position));
-  return __SendCommand(PA[axis] + std::to_string(position));
+  __ClearCached(&jog_speed_[axis - 1]);
+  return SubmitCommand(Command(axis, opcode::PA).Append(position), false, kReplyTimeoutMs, options).get().sent;
 }
 
-bool AgilisPiezo::TellLimitStatus(bool* out_axis1, bool* out_axis2) const {
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting limit status");
-  const bool ret = __SendCommand(PH);
-  __GetReturnValue(buf);
-  int v;
-  __GetIntegerFromReturnValue(buf, PH, &v);
+bool AgilisPiezo::TellLimitStatus(bool* out_axis1, bool* out_axis2,
+  const CallOptions& options) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Getting limit status");
+  const CommandResult r = SubmitCommand(Command(opcode::PH), true, kReplyTimeoutMs, options).get();
+  int v = 0;
+  __GetIntegerFromReturnValue(r.reply, Command(opcode::PH), &v);
   switch (v) {
   case 0: *out_axis1 = false, *out_axis2 = false; break;
   case 1: *out_axis1 = true, *out_axis2 = false; break;
   case 2: *out_axis1 = false, *out_axis2 = true; break;
   case 3: *out_axis1 = true, *out_axis2 = true; break;
   }
-  __Log(LOG_INFO, "Limit status: axis1=" + std::string(*out_axis1 ? "at limit" : "not at limit") + 
+  AGILISPIEZO_LOG(LOG_INFO, "Limit status: axis1=" + std::string(*out_axis1 ? "at limit" : "not at limit") + 
         ", axis2=" + std::string(*out_axis2 ? "at limit" : "not at limit"));
-  return ret;
+  return r.sent;
 }
 
 bool AgilisPiezo::RelativeMove(
-  const int axis, const bool sign, const int steps) const {
+  const int axis, const bool sign, const int steps, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "RelativeMove: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "RelativeMove: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
   std::string direction = sign ? "positive" : "negative";
-  __Log(LOG_INFO, "Moving axis " + std::to_string(axis) + " " + std::to_string(steps) + 
+  AGILISPIEZO_LOG(LOG_INFO, "Moving axis " + std::to_string(axis) + " " + std::to_string(steps) + 
         " steps in " + direction + " direction");
-  return __SendCommand(PR[axis] + (sign ? "" : "-") + std::to_string(steps));
+  __ClearCached(&jog_speed_[axis - 1]);
+  return SubmitCommand(
+    Command(axis, opcode::PR).AppendSigned(sign, steps), false, kReplyTimeoutMs, options).get().sent;
+}
+
+bool AgilisPiezo::MoveToStepCount(const int axis, const int target,
+  const int tolerance, std::future<bool>* out_done, const int max_iterations) const {
+  return MoveToStepCount(axis, target, tolerance, out_done, max_iterations, StepMoveProfile());
+}
+
+bool AgilisPiezo::MoveToStepCount(const int axis, const int target,
+  const int tolerance, std::future<bool>* out_done, const int max_iterations,
+  const StepMoveProfile& profile) const {
+  if (axis != 1 && axis != 2) {
+    AGILISPIEZO_LOG(LOG_ERROR, "MoveToStepCount: Invalid axis (must be 1 or 2)");
+    return false;
+  }
+  
+  if (tolerance < 0 || max_iterations < 1) {
+    AGILISPIEZO_LOG(LOG_ERROR, "MoveToStepCount: Invalid tolerance or iteration count");
+    return false;
+  }
+  
+  if (profile.coarse_amplitude < 1 || profile.coarse_amplitude > 50
+    || profile.fine_amplitude < 1 || profile.fine_amplitude > 50) {
+    AGILISPIEZO_LOG(LOG_ERROR, "MoveToStepCount: Invalid amplitude (must be between 1 and 50)");
+    return false;
+  }
+  
+  AGILISPIEZO_LOG(LOG_INFO, "Moving axis " + std::to_string(axis) + " to step count " +
+        std::to_string(target) + " +/- " + std::to_string(tolerance));
+  __ClearCached(&jog_speed_[axis - 1]);
+  auto move = std::make_shared<StepMove>();
+  move->axis = axis;
+  move->target = target;
+  move->tolerance = tolerance;
+  move->iterations_left = max_iterations;
+  move->profile = profile;
+  *out_done = move->done.get_future();
+  __StepMoveMeasure(move);
+  return true;
 }
 
-bool AgilisPiezo::ResetController() const {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Resetting controller");
-  return __SendCommand("RS");
+bool AgilisPiezo::ResetController(const CallOptions& options) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Resetting controller");
+  __ClearCache();
+  remote_mode_ = false; // RS restarts in local mode
+  return SubmitCommand(Command(opcode::RS), false, kReplyTimeoutMs, options).get().sent;
 }
 
-bool AgilisPiezo::StopMotion(const int axis) const {
+bool AgilisPiezo::StopMotion(const int axis, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "StopMotion: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "StopMotion: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Stopping motion for axis " + std::to_string(axis));
-  return __SendCommand(ST[axis]);
+  AGILISPIEZO_LOG(LOG_INFO, "Stopping motion for axis " + std::to_string(axis));
+  __ClearCached(&jog_speed_[axis - 1]);
+  return SubmitCommand(Command(axis, opcode::ST), false, kReplyTimeoutMs, options).get().sent;
+}
+
+bool AgilisPiezo::EmergencyStop() const {
+  return SubmitEmergencyStop().get();
+}
+
+std::future<bool> AgilisPiezo::SubmitEmergencyStop() const {
+  AGILISPIEZO_LOG(LOG_WARNING, "Emergency stop, dropping queued commands");
+  __ClearCached(&jog_speed_[0]);
+  __ClearCached(&jog_speed_[1]);
+  // 1ST always completes before 2ST, so the second one reports both
+  auto first_sent = std::make_shared<bool>(false);
+  auto both_sent = std::make_shared<std::promise<bool>>();
+  std::future<bool> sent = both_sent->get_future();
+  PendingCommand stops[2];
+  stops[0].command = Command(1, opcode::ST);
+  stops[0].on_complete = [first_sent](const CommandResult& r) { *first_sent = r.sent; };
+  stops[1].command = Command(2, opcode::ST);
+  for (auto& stop : stops) stop.Classify();
+  stops[1].on_complete = [first_sent, both_sent](const CommandResult& r) {
+    both_sent->set_value(*first_sent && r.sent);
+  };
+  std::deque<PendingCommand> dropped;
+  bool stopped = false;
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    stopped = engine_stop_;
+    if (!stopped) {
+      dropped.swap(queue_);
+      queue_.push_back(std::move(stops[0]));
+      queue_.push_back(std::move(stops[1]));
+    }
+  }
+  // Outside queue_m_, on_complete hooks may submit again
+  if (stopped) {
+    for (auto& stop : stops) stop.Finish(CommandResult());
+    return sent;
+  }
+  // Reported like motion cancelled by a queued stop
+  CommandResult cancelled;
+  cancelled.cancelled = true;
+  for (auto& cmd : dropped) cmd.Finish(cancelled);
+  asio::post(*strand_, [this, cancelled]() {
+    if (phase_ == PHASE_PACING && !in_flight_.command.HasOpcode(opcode::ST)) {
+      // Not on the wire yet, so it must not go out ahead of the stops
+      ++timer_seq_;
+      timer_->cancel();
+      phase_ = PHASE_IDLE;
+      in_flight_.Finish(cancelled);
+    }
+    __Pump();
+  });
+  return sent;
 }
 
 bool AgilisPiezo::SetStepAmplitude(
-  const int axis, const bool sign, const int amplitude) const {
+  const int axis, const bool sign, const int amplitude, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "SetStepAmplitude: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "SetStepAmplitude: Invalid axis (must be 1 or 2)");
     return false;
   }
   
   if (amplitude == 0 || amplitude < -50 || amplitude > 50) {
-    __Log(LOG_ERROR, "SetStepAmplitude: Invalid amplitude (must be between -50 and 50, excluding 0)");
+    AGILISPIEZO_LOG(LOG_ERROR, "SetStepAmplitude: Invalid amplitude (must be between -50 and 50, excluding 0)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
   std::string direction = sign ? "positive" : "negative";
-  __Log(LOG_INFO, "Setting step amplitude for axis " + std::to_string(axis) + 
+  AGILISPIEZO_LOG(LOG_INFO, "Setting step amplitude for axis " + std::to_string(axis) + 
         " to " + std::to_string(amplitude) + " in " + direction + " direction");
-  return __SendCommand(SU[axis] + (sign ? "" : "-") + std::to_string(amplitude));
+  const bool sent = SubmitCommand(
+    Command(axis, opcode::SU).AppendSigned(sign, amplitude), false, kReplyTimeoutMs, options).get().sent;
+  // A negative amplitude flips the direction, like the controller does
+  const bool forward = sign == (amplitude > 0);
+  if (sent) __SetCached(&step_amplitude_[axis - 1][forward], std::abs(amplitude));
+  return sent;
 }
 
-bool AgilisPiezo::GetStepAmplitudeSetting(
-  const int axis, const bool sign, int* out_amplitude) const {
+bool AgilisPiezo::GetStepAmplitudeSetting(const int axis, const bool sign,
+  int* out_amplitude, const int64_t max_age_ms, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "GetStepAmplitudeSetting: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "GetStepAmplitudeSetting: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
+  if (__GetCached(step_amplitude_[axis - 1][sign], max_age_ms, out_amplitude)) return true;
   std::string direction = sign ? "positive" : "negative";
-  __Log(LOG_INFO, "Getting step amplitude for axis " + std::to_string(axis) + 
+  AGILISPIEZO_LOG(LOG_INFO, "Getting step amplitude for axis " + std::to_string(axis) + 
         " in " + direction + " direction");
-  const bool ret = __SendCommand(SU[axis] + (sign ? "?" : "-?"));
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, SU[axis], out_amplitude);
+  const CommandResult r = SubmitCommand(
+    Command(axis, opcode::SU).Append(sign ? "?" : "-?"), true, kReplyTimeoutMs, options).get();
+  const bool parsed = __GetIntegerFromReturnValue(r.reply, Command(axis, opcode::SU), out_amplitude);
   if (*out_amplitude < 0) *out_amplitude = -(*out_amplitude);
-  __Log(LOG_INFO, "Step amplitude for axis " + std::to_string(axis) + 
+  if (parsed) __SetCached(&step_amplitude_[axis - 1][sign], *out_amplitude);
+  AGILISPIEZO_LOG(LOG_INFO, "Step amplitude for axis " + std::to_string(axis) + 
         " in " + direction + " direction: " + std::to_string(*out_amplitude));
-  return ret;
+  return r.sent;
 }
 
-bool AgilisPiezo::GetErrorOfPreviousCommand(int* out_error_code) const {
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting error of previous command");
-  const bool ret = __SendCommand("TE");
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, "TE", out_error_code);
-  __Log(LOG_INFO, "Error of previous command: " + std::to_string(*out_error_code) + 
+bool AgilisPiezo::GetErrorOfPreviousCommand(int* out_error_code,
+  const CallOptions& options) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Getting error of previous command");
+  const CommandResult r = SubmitCommand(Command(opcode::TE), true, kReplyTimeoutMs, options).get();
+  __GetIntegerFromReturnValue(r.reply, Command(opcode::TE), out_error_code);
+  AGILISPIEZO_LOG(LOG_INFO, "Error of previous command: " + std::to_string(*out_error_code) + 
         " (" + GetErrorText(*out_error_code) + ")");
-  return ret;
+  return r.sent;
 }
 
-bool AgilisPiezo::TellNumberOfSteps(const int axis, int* out_steps) const {
+bool AgilisPiezo::TellNumberOfSteps(const int axis, int* out_steps,
+  const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "TellNumberOfSteps: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "TellNumberOfSteps: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting number of steps for axis " + std::to_string(axis));
-  const bool ret = __SendCommand(TP[axis]);
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, TP[axis], out_steps);
-  __Log(LOG_INFO, "Number of steps for axis " + std::to_string(axis) + ": " + 
+  AGILISPIEZO_LOG(LOG_INFO, "Getting number of steps for axis " + std::to_string(axis));
+  const CommandResult r = SubmitCommand(Command(axis, opcode::TP), true, kReplyTimeoutMs, options).get();
+  __GetIntegerFromReturnValue(r.reply, Command(axis, opcode::TP), out_steps);
+  AGILISPIEZO_LOG(LOG_INFO, "Number of steps for axis " + std::to_string(axis) + ": " + 
         std::to_string(*out_steps));
-  return ret; 
+  return r.sent;
 }
 
-bool AgilisPiezo::GetAxisStatus(const int axis, int* out_axis_status) const {
+PositionEstimate AgilisPiezo::EstimatedSteps(const int axis) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "GetAxisStatus: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "EstimatedSteps: Invalid axis (must be 1 or 2)");
+    return PositionEstimate();
+  }
+  // Polled at high rates, so nothing is logged
+  return estimator_.Estimate(axis);
+}
+
+bool AgilisPiezo::GetAxisStatus(const int axis, int* out_axis_status,
+  const CallOptions& options) const {
+  if (axis != 1 && axis != 2) {
+    AGILISPIEZO_LOG(LOG_ERROR, "GetAxisStatus: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting status for axis " + std::to_string(axis));
-  const bool ret = __SendCommand(TS[axis]);
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, TS[axis], out_axis_status);
+  AGILISPIEZO_LOG(LOG_INFO, "Getting status for axis " + std::to_string(axis));
+  const CommandResult r = SubmitCommand(Command(axis, opcode::TS), true, kReplyTimeoutMs, options).get();
+  __GetIntegerFromReturnValue(r.reply, Command(axis, opcode::TS), out_axis_status);
   
   std::string status_str;
   switch (*out_axis_status) {
@@ -373,88 +870,1333 @@ bool AgilisPiezo::GetAxisStatus(const int axis, int* out_axis_status) const {
     default: status_str = "Unknown"; break;
   }
   
-  __Log(LOG_INFO, "Status for axis " + std::to_string(axis) + ": " + 
+  AGILISPIEZO_LOG(LOG_INFO, "Status for axis " + std::to_string(axis) + ": " + 
         std::to_string(*out_axis_status) + " (" + status_str + ")");
-  return ret;
+  return r.sent;
+}
+
+bool AgilisPiezo::WaitForAxisReady(const int axis, const int timeout_ms) const {
+  if (axis != 1 && axis != 2) {
+    AGILISPIEZO_LOG(LOG_ERROR, "WaitForAxisReady: Invalid axis (must be 1 or 2)");
+    return false;
+  }
+
+  AGILISPIEZO_LOG(LOG_INFO, "Waiting for axis " + std::to_string(axis) + " to be ready");
+  auto ready = std::make_shared<std::promise<bool>>();
+  std::future<bool> f = ready->get_future();
+  const uint64_t id = __AddMotionWaiter(axis, [ready](int, bool completed) {
+    ready->set_value(completed);
+  });
+  if (f.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready
+    && __RemoveMotionWaiter(id)) {
+    AGILISPIEZO_LOG(LOG_WARNING, "Timeout waiting for axis " + std::to_string(axis) + " to be ready");
+    return false;
+  }
+  return f.get();
+}
+
+bool AgilisPiezo::OnMotionComplete(const int axis, MotionCallback callback) const {
+  if (axis != 1 && axis != 2) {
+    AGILISPIEZO_LOG(LOG_ERROR, "OnMotionComplete: Invalid axis (must be 1 or 2)");
+    return false;
+  }
+  if (!callback) {
+    AGILISPIEZO_LOG(LOG_ERROR, "OnMotionComplete: Empty callback");
+    return false;
+  }
+
+  AGILISPIEZO_LOG(LOG_INFO, "Registering motion complete callback for axis " + std::to_string(axis));
+  __AddMotionWaiter(axis, std::move(callback));
+  return true;
+}
+
+std::shared_ptr<AgilisPiezo::ScanRing> AgilisPiezo::StartJogScan(
+  const JogScanOptions& options) const {
+  if (options.axis != 1 && options.axis != 2) {
+    AGILISPIEZO_LOG(LOG_ERROR, "StartJogScan: Invalid axis (must be 1 or 2)");
+    return nullptr;
+  }
+  if (options.capacity == 0) {
+    AGILISPIEZO_LOG(LOG_ERROR, "StartJogScan: Invalid capacity");
+    return nullptr;
+  }
+  if (IsScanning()) {
+    AGILISPIEZO_LOG(LOG_ERROR, "StartJogScan: A scan is already running");
+    return nullptr;
+  }
+  
+  AGILISPIEZO_LOG(LOG_INFO, "Starting jog scan on axis " + std::to_string(options.axis));
+  if (!StartJogMotion(options.axis, options.sign, options.jog_speed)) return nullptr;
+  auto ring = std::make_shared<ScanRing>(options.capacity);
+  __RunOnEngine([&]() {
+    scan_.reset(new JogScan());
+    scan_->id = ++scan_id_;
+    scan_->options = options;
+    scan_->ring = ring;
+    scanning_ = true;
+  });
+  __PostPump();
+  return ring;
+}
+
+bool AgilisPiezo::StopJogScan() const {
+  bool stopped = false;
+  __RunOnEngine([&]() {
+    if (!scan_) return;
+    __EndScan(true);
+    stopped = true;
+  });
+  return stopped;
 }
 
-bool AgilisPiezo::GetControllerFirmwareVersion(std::string* out_version) const {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Getting controller firmware version");
-  const bool ret = __SendCommand("VE");
-  out_version->clear();
-  __GetReturnValue(*out_version);
-  int end = out_version->find("\r\n");
+bool AgilisPiezo::IsScanning() const {
+  return scanning_.load();
+}
+
+bool AgilisPiezo::GetControllerFirmwareVersion(
+  std::string* out_version, const int64_t max_age_ms, const CallOptions& options) const {
+  if (max_age_ms > 0) {
+    std::lock_guard<std::mutex> l(cache_m_);
+    if (version_.valid && sclock::now() - version_.at <= std::chrono::milliseconds(max_age_ms)) {
+      *out_version = version_text_;
+      return true;
+    }
+  }
+  AGILISPIEZO_LOG(LOG_INFO, "Getting controller firmware version");
+  const CommandResult r = SubmitCommand(Command(opcode::VE), true, kReplyTimeoutMs, options).get();
+  *out_version = r.reply;
+  const size_t end = out_version->find("\r\n");
   if (end != std::string::npos)
     *out_version = out_version->substr(0, end);
-  __Log(LOG_INFO, "Controller firmware version: " + *out_version);
-  return ret; 
+  if (r.replied) {
+    std::lock_guard<std::mutex> l(cache_m_);
+    version_text_ = *out_version;
+    version_.valid = true;
+    version_.at = sclock::now();
+  }
+  AGILISPIEZO_LOG(LOG_INFO, "Controller firmware version: " + *out_version);
+  return r.sent;
 }
 
-bool AgilisPiezo::ZeroPosition(const int axis) const {
+bool AgilisPiezo::ZeroPosition(const int axis, const CallOptions& options) const {
   if (axis != 1 && axis != 2) {
-    __Log(LOG_ERROR, "ZeroPosition: Invalid axis (must be 1 or 2)");
+    AGILISPIEZO_LOG(LOG_ERROR, "ZeroPosition: Invalid axis (must be 1 or 2)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Zeroing position for axis " + std::to_string(axis));
-  return __SendCommand(ZP[axis]);
+  AGILISPIEZO_LOG(LOG_INFO, "Zeroing position for axis " + std::to_string(axis));
+  return SubmitCommand(Command(axis, opcode::ZP), false, kReplyTimeoutMs, options).get().sent;
 }
 
-bool AgilisPiezo::ChangeChannel(const int channel) {
+bool AgilisPiezo::ChangeChannel(const int channel, const int64_t max_age_ms,
+  const CallOptions& options) {
   if (channel < 0 || channel > 4) {
-    __Log(LOG_ERROR, "ChangeChannel: Invalid channel (must be between 0 and 4)");
+    AGILISPIEZO_LOG(LOG_ERROR, "ChangeChannel: Invalid channel (must be between 0 and 4)");
     return false;
   }
   
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Changing to channel " + std::to_string(channel));
-  return __SendCommand("CC" + channel_table_[channel]);
+  int current = 0;
+  if (__GetCached(channel_, max_age_ms, &current) && current == channel) {
+    AGILISPIEZO_LOG(LOG_DEBUG, "Channel " + std::to_string(channel) + " already selected");
+    return true;
+  }
+  AGILISPIEZO_LOG(LOG_INFO, "Changing to channel " + std::to_string(channel));
+  const bool sent = SubmitCommand(Command(opcode::CC).Append(channel), false, kReplyTimeoutMs, options).get().sent;
+  if (sent) __SetCached(&channel_, channel);
+  return sent;
 }
 
-bool AgilisPiezo::GetChannel(int* out_channel) {
-  std::lock_guard<std::mutex> l(m_);
-  std::string buf;
-  __Log(LOG_INFO, "Getting current channel");
-  const bool ret = __SendCommand("CC?");
-  __GetReturnValue(buf);
-  __GetIntegerFromReturnValue(buf, "CC", out_channel);
-  __Log(LOG_INFO, "Current channel: " + std::to_string(*out_channel));
-  return ret;
+bool AgilisPiezo::GetChannel(int* out_channel, const int64_t max_age_ms,
+  const CallOptions& options) {
+  if (__GetCached(channel_, max_age_ms, out_channel)) return true;
+  AGILISPIEZO_LOG(LOG_INFO, "Getting current channel");
+  const CommandResult r = SubmitCommand(Command(opcode::CC).Append('?'), true, kReplyTimeoutMs, options).get();
+  if (__GetIntegerFromReturnValue(r.reply, Command(opcode::CC), out_channel))
+    __SetCached(&channel_, *out_channel);
+  AGILISPIEZO_LOG(LOG_INFO, "Current channel: " + std::to_string(*out_channel));
+  return r.sent;
 }
 
 void AgilisPiezo::SetCommandTerm(const int64_t ms) {
-  std::lock_guard<std::mutex> l(m_);
-  __Log(LOG_INFO, "Setting command term to " + std::to_string(ms) + " ms");
+  AGILISPIEZO_LOG(LOG_INFO, "Setting command term to " + std::to_string(ms) + " ms");
   cmd_term_ = ms;
+  pacing_changed_ = true;
 }
 
 int64_t AgilisPiezo::GetCommandTerm() {
-  std::lock_guard<std::mutex> l(m_);
-  return cmd_term_;
+  return cmd_term_.load();
+}
+
+void AgilisPiezo::SetPacingMode(PacingMode mode) {
+  AGILISPIEZO_LOG(LOG_INFO, "Setting pacing mode to " + std::to_string(mode));
+  pacing_mode_ = mode;
+  pacing_changed_ = true;
+}
+
+AgilisPiezo::PacingMode AgilisPiezo::GetPacingMode() {
+  return pacing_mode_.load();
+}
+
+int64_t AgilisPiezo::GetAdaptiveDelay() {
+  return std::min(adaptive_delay_.load(), cmd_term_.load());
+}
+
+MetricsSnapshot AgilisPiezo::GetMetrics() const {
+  return metrics_.Snapshot();
+}
+
+std::string AgilisPiezo::GetMetricsPrometheus() const {
+  return metrics_.Snapshot().ToPrometheus(GetPortName());
+}
+
+void AgilisPiezo::ResetMetrics() {
+  metrics_.Reset();
+}
+
+void AgilisPiezo::SetBusyPolicy(BusyPolicy policy) {
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    AGILISPIEZO_LOG(LOG_INFO, "Setting busy policy to " + std::to_string(policy));
+    busy_policy_ = policy;
+  }
+  if (policy == BUSY_REJECT && IsBusy()) __RejectQueued();
+}
+
+void AgilisPiezo::SetCoalescingWindow(const int64_t window_ms) {
+  AGILISPIEZO_LOG(LOG_INFO, "Setting coalescing window to " + std::to_string(window_ms) + " ms");
+  coalescing_window_ = window_ms;
+}
+
+int64_t AgilisPiezo::GetCoalescingWindow() {
+  return coalescing_window_.load();
+}
+
+AgilisPiezo::BusyPolicy AgilisPiezo::GetBusyPolicy() {
+  std::lock_guard<std::mutex> l(queue_m_);
+  return busy_policy_;
+}
+
+bool AgilisPiezo::IsBusy() const {
+  return busy_axis_.load() != 0;
 }
 
 void AgilisPiezo::SetLogLevel(LogLevel level) {
-  std::lock_guard<std::mutex> l(m_);
   log_level_ = level;
-  __Log(LOG_INFO, "Log level set to " + std::to_string(level));
+  {
+    // Only held to swap or read the pointer, never across I/O
+    std::lock_guard<std::mutex> lt(transport_m_);
+    transport_->SetLogEnabled(level <= LOG_DEBUG);
+  }
+  AGILISPIEZO_LOG(LOG_INFO, "Log level set to " + std::to_string(level));
+}
+
+std::future<AgilisPiezo::CommandResult> AgilisPiezo::SubmitCommand(
+  const std::string& command, const bool expect_reply,
+  const int timeout_ms, const CallOptions& options) const {
+  return SubmitCommand(Command::FromString(command), expect_reply, timeout_ms, options);
+}
+
+std::future<AgilisPiezo::CommandResult> AgilisPiezo::SubmitCommand(
+  const Command& command, const bool expect_reply,
+  const int timeout_ms, const CallOptions& options) const {
+  PendingCommand cmd;
+  cmd.command = command;
+  cmd.expect_reply = expect_reply;
+  cmd.timeout_ms = timeout_ms;
+  return __Submit(std::move(cmd), options);
+}
+
+AgilisPiezo::CommandBatch AgilisPiezo::Batch() const {
+  return CommandBatch(this);
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::SetStepDelay(
+  const int axis, const int delay) {
+  if (axis != 1 && axis != 2) return __Fail("SetStepDelay: Invalid axis (must be 1 or 2)");
+  const AgilisPiezo* owner = owner_;
+  return __Add(Command(axis, opcode::DL).Append(delay), [owner, axis, delay]() {
+    owner->__SetCached(&owner->step_delay_[axis - 1], delay);
+  });
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::SetStepAmplitude(
+  const int axis, const bool sign, const int amplitude) {
+  if (axis != 1 && axis != 2) return __Fail("SetStepAmplitude: Invalid axis (must be 1 or 2)");
+  if (amplitude == 0 || amplitude < -50 || amplitude > 50) {
+    return __Fail("SetStepAmplitude: Invalid amplitude (must be between -50 and 50, excluding 0)");
+  }
+  const AgilisPiezo* owner = owner_;
+  const bool forward = sign == (amplitude > 0);
+  return __Add(Command(axis, opcode::SU).AppendSigned(sign, amplitude),
+    [owner, axis, forward, amplitude]() {
+      owner->__SetCached(&owner->step_amplitude_[axis - 1][forward], std::abs(amplitude));
+    });
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::StartJogMotion(
+  const int axis, const bool sign, const int jog_speed) {
+  if (axis != 1 && axis != 2) return __Fail("StartJogMotion: Invalid axis (must be 1 or 2)");
+  const AgilisPiezo* owner = owner_;
+  const int speed = sign ? jog_speed : -jog_speed;
+  owner_->__ClearCached(&owner_->jog_speed_[axis - 1]);
+  return __Add(Command(axis, opcode::JA).Append(speed), [owner, axis, speed]() {
+    owner->__SetCached(&owner->jog_speed_[axis - 1], speed);
+  });
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::MoveToLimit(
+  const int axis, const bool sign, const int jog_speed) {
+  if (axis != 1 && axis != 2) return __Fail("MoveToLimit: Invalid axis (must be 1 or 2)");
+  owner_->__ClearCached(&owner_->jog_speed_[axis - 1]);
+  return __Add(Command(axis, opcode::MV).AppendSigned(sign, jog_speed));
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::RelativeMove(
+  const int axis, const bool sign, const int steps) {
+  if (axis != 1 && axis != 2) return __Fail("RelativeMove: Invalid axis (must be 1 or 2)");
+  owner_->__ClearCached(&owner_->jog_speed_[axis - 1]);
+  return __Add(Command(axis, opcode::PR).AppendSigned(sign, steps));
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::StopMotion(const int axis) {
+  if (axis != 1 && axis != 2) return __Fail("StopMotion: Invalid axis (must be 1 or 2)");
+  owner_->__ClearCached(&owner_->jog_speed_[axis - 1]);
+  return __Add(Command(axis, opcode::ST));
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::ZeroPosition(const int axis) {
+  if (axis != 1 && axis != 2) return __Fail("ZeroPosition: Invalid axis (must be 1 or 2)");
+  return __Add(Command(axis, opcode::ZP));
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::ChangeChannel(const int channel) {
+  if (channel < 0 || channel > 4) return __Fail("ChangeChannel: Invalid channel (must be between 0 and 4)");
+  // The cached axis settings belong to the actuators of the old channel
+  const AgilisPiezo* owner = owner_;
+  return __Add(Command(opcode::CC).Append(channel), [owner, channel]() {
+    owner->__ClearCache();
+    owner->__SetCached(&owner->channel_, channel);
+  });
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::Add(const Command& command) {
+  // Only commands without a reply, so the TE reply is the only one coming back
+  const bool query = !command.empty() && command.data()[command.size() - 1] == '?';
+  if (command.empty() || !command.ok() || query
+    || command.HasOpcode(opcode::MA) || command.HasOpcode(opcode::PA)
+    || command.HasOpcode(opcode::RS) || command.HasOpcode(opcode::TE)
+    || command.HasOpcode(opcode::TP) || command.HasOpcode(opcode::TS)
+    || command.HasOpcode(opcode::PH) || command == opcode::VE) {
+    return __Fail("Batch: '" + command.str() + "' is not a set-only command");
+  }
+  if (command.HasOpcode(opcode::ML) || command.HasOpcode(opcode::CC)) {
+    // Same effect on the cache as SetToLocalMode() and ChangeChannel()
+    const AgilisPiezo* owner = owner_;
+    return __Add(command, [owner]() { owner->__ClearCache(); });
+  }
+  if (command.Axis() == 1 || command.Axis() == 2) {
+    owner_->__ClearCached(&owner_->jog_speed_[command.Axis() - 1]);
+  }
+  return __Add(command);
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::__Add(
+  const Command& command, std::function<void()> on_success) {
+  commands_.push_back(command);
+  if (on_success) on_success_.push_back(std::move(on_success));
+  return *this;
+}
+
+AgilisPiezo::CommandBatch& AgilisPiezo::CommandBatch::__Fail(const std::string& message) {
+  if (owner_->__IsLogEnabled(LOG_ERROR)) owner_->__Log(LOG_ERROR, message);
+  valid_ = false;
+  return *this;
 }
 
-bool AgilisPiezo::__SendCommand(const std::string& command, int* error_code) const {
-  const int remaintime = cmd_term_ - cmd_term_timer_.ElapsedMilli();
+bool AgilisPiezo::CommandBatch::Submit(int* out_error_code, const CallOptions& options) {
+  const CommandResult r = SubmitAsync(options).get();
+  int e = ERRORCODE_NOERROR;
+  if (!r.replied || !Command(opcode::TE).ParseReply(r.reply, &e)) return false;
+  if (out_error_code != nullptr) *out_error_code = e;
+  return e == ERRORCODE_NOERROR;
+}
+
+std::future<AgilisPiezo::CommandResult> AgilisPiezo::CommandBatch::SubmitAsync(
+  const CallOptions& options) {
+  PendingCommand cmd;
+  cmd.command = Command(opcode::TE);
+  cmd.expect_reply = true;
+  if (!valid_ || commands_.empty()) {
+    std::future<CommandResult> result = cmd.promise.get_future();
+    cmd.Finish(CommandResult());
+    return result;
+  }
+  auto on_success = std::make_shared<std::vector<std::function<void()>>>(std::move(on_success_));
+  cmd.on_complete = [on_success](const CommandResult& r) {
+    int e = ERRORCODE_NOERROR;
+    if (!r.replied || !Command(opcode::TE).ParseReply(r.reply, &e) || e != ERRORCODE_NOERROR) return;
+    for (const auto& fn : *on_success) fn();
+  };
+  cmd.batch = std::move(commands_);
+  // A batch is sent once
+  commands_.clear();
+  on_success_.clear();
+  valid_ = false;
+  return owner_->__Submit(std::move(cmd), options);
+}
+
+std::future<AgilisPiezo::CommandResult> AgilisPiezo::__Submit(
+  PendingCommand cmd, const CallOptions& options) const {
+  std::future<CommandResult> result = cmd.promise.get_future();
+  cmd.metrics = &metrics_;
+  cmd.submitted = sclock::now();
+  cmd.Classify();
+  metrics_.Count(cmd.command, COUNTER_SUBMITTED);
+  for (const auto& c : cmd.batch) metrics_.Count(c, COUNTER_SUBMITTED);
+  if (!options.empty()) {
+    if (options.cancellation.IsCancelled() || cmd.submitted >= options.deadline) {
+      AGILISPIEZO_LOG(LOG_INFO, "Command '" + cmd.command.str() + "' " +
+            (options.cancellation.IsCancelled() ? "cancelled" : "past its deadline") + " before queuing");
+      CommandResult r;
+      r.cancelled = options.cancellation.IsCancelled();
+      r.expired = !r.cancelled;
+      cmd.Finish(std::move(r));
+      return result;
+    }
+    const uint64_t id = ++call_ids_;
+    cmd.call_id = id;
+    cmd.deadline = options.deadline;
+    cmd.cancel_watch = options.cancellation.OnCancel([this, id]() {
+      asio::post(*strand_, [this, id]() { __Abandon(id, false); });
+    });
+  }
+  bool stop = false;
+  bool refused = false; // Finished outside queue_m_, its hooks may submit again
+  CommandResult refusal;
+  std::vector<PendingCommand> cancelled; // Queued motion of the stopped axis
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    if (engine_stop_ || !cmd.command.ok()) {
+      AGILISPIEZO_LOG(LOG_ERROR, "Command '" + cmd.command.str() + "' rejected: " +
+            (cmd.command.ok() ? "engine stopped" : "too long"));
+      refused = true;
+    }
+    else if (link_down_ && !cmd.recovery) {
+      AGILISPIEZO_LOG(LOG_WARNING, "Command '" + cmd.command.str() + "' failed: connection lost");
+      refused = true;
+    }
+    else if (busy_policy_ == BUSY_REJECT && IsBusy() && !cmd.command.HasOpcode(opcode::ST)) {
+      AGILISPIEZO_LOG(LOG_WARNING, "Command '" + cmd.command.str() +
+            "' rejected: controller busy with MA or PA");
+      refused = true;
+      refusal.rejected = true;
+    }
+    else {
+      stop = cmd.priority == PRIORITY_STOP && cmd.batch.empty();
+      const uint64_t id = cmd.call_id;
+      if (cmd.deadline != sclock::time_point::max()) {
+        const sclock::time_point deadline = cmd.deadline;
+        asio::post(*strand_, [this, id, deadline]() { __AddDeadline(id, deadline); });
+      }
+      if (stop) __QueueStop(std::move(cmd), &cancelled);
+      else queue_.push_back(std::move(cmd));
+      // A cancel between the check above and OnCancel() abandoned nothing yet
+      if (id != 0 && options.cancellation.IsCancelled()) {
+        asio::post(*strand_, [this, id]() { __Abandon(id, false); });
+      }
+    }
+  }
+  if (refused) {
+    cmd.Finish(std::move(refusal));
+    return result;
+  }
+  for (auto& c : cancelled) {
+    AGILISPIEZO_LOG(LOG_INFO, "Command '" + c.command.str() + "' cancelled by stop");
+    CommandResult r;
+    r.cancelled = true;
+    c.Finish(std::move(r));
+  }
+  if (stop) {
+    asio::post(*strand_, [this]() {
+      __PreemptPacing();
+      __Pump();
+    });
+  }
+  else {
+    __PostPump();
+  }
+  return result;
+}
+
+void AgilisPiezo::__QueueStop(
+  PendingCommand cmd, std::vector<PendingCommand>* cancelled) const {
+  const int axis = cmd.command.Axis();
+  auto it = std::stable_partition(queue_.begin(), queue_.end(),
+    [axis](const PendingCommand& c) { return c.recovery || !c.MovesAxis(axis); });
+  std::move(it, queue_.end(), std::back_inserter(*cancelled));
+  queue_.erase(it, queue_.end());
+  auto first_other = std::find_if(queue_.begin(), queue_.end(),
+    [](const PendingCommand& c) { return c.priority != PRIORITY_STOP; });
+  queue_.insert(first_other, std::move(cmd));
+}
+
+void AgilisPiezo::__PreemptPacing() const {
+  if (phase_ != PHASE_PACING || in_flight_.priority == PRIORITY_STOP) return;
+  ++timer_seq_;
+  timer_->cancel();
+  phase_ = PHASE_IDLE;
+  if (in_flight_.poll) {
+    in_flight_.Finish(CommandResult());
+    return;
+  }
+  std::vector<PendingCommand> cancelled;
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    for (const auto& c : queue_) {
+      if (c.priority == PRIORITY_STOP && in_flight_.MovesAxis(c.command.Axis())) {
+        cancelled.push_back(std::move(in_flight_));
+        break;
+      }
+    }
+    if (cancelled.empty()) {
+      auto first_other = std::find_if(queue_.begin(), queue_.end(),
+        [](const PendingCommand& c) { return c.priority != PRIORITY_STOP; });
+      queue_.insert(first_other, std::move(in_flight_));
+    }
+  }
+  for (auto& c : cancelled) {
+    CommandResult r;
+    r.cancelled = true;
+    c.Finish(std::move(r));
+  }
+}
+
+std::vector<AgilisPiezo::PendingCommand> AgilisPiezo::__TakeDuplicates(
+  const PendingCommand& leader, const sclock::time_point submitted_by) const {
+  std::vector<PendingCommand> duplicates;
+  if (!leader.Coalescable() || coalescing_window_ < 0) return duplicates;
+  auto end = std::find_if(queue_.begin(), queue_.end(), [&leader](const PendingCommand& c) {
+    return (c.axes & leader.axes) != 0 && c.priority != PRIORITY_TELEMETRY;
+  });
+  auto it = std::stable_partition(queue_.begin(), end, [&](const PendingCommand& c) {
+    return !(c.Coalescable() && c.command == leader.command && c.submitted <= submitted_by);
+  });
+  for (auto d = it; d != end; ++d) {
+    metrics_.Count(d->command, COUNTER_COALESCED);
+    d->metrics = nullptr; // Counted once, as the leader
+    duplicates.push_back(std::move(*d));
+  }
+  queue_.erase(it, end);
+  return duplicates;
+}
+
+std::deque<AgilisPiezo::PendingCommand>::iterator AgilisPiezo::__NextQueued() const {
+  // Most urgent command whose axes no earlier command touches; stops are in front
+  auto next = queue_.end();
+  unsigned seen = 0;
+  for (auto it = queue_.begin(); it != queue_.end() && seen != 3u; ++it) {
+    if ((it->axes & seen) == 0 && (next == queue_.end() || it->priority < next->priority))
+      next = it;
+    seen |= it->axes;
+  }
+  return next;
+}
+
+void AgilisPiezo::__Abandon(const uint64_t call_id, const bool expired) const {
+  CommandResult result;
+  result.expired = expired;
+  result.cancelled = !expired;
+  const std::string why = expired ? "' past its deadline" : "' cancelled";
+  auto has_id = [call_id](const PendingCommand& c) { return c.call_id == call_id; };
+  {
+    std::unique_lock<std::mutex> l(queue_m_);
+    auto it = std::find_if(queue_.begin(), queue_.end(), has_id);
+    if (it != queue_.end()) {
+      PendingCommand dropped = std::move(*it);
+      queue_.erase(it);
+      l.unlock();
+      AGILISPIEZO_LOG(LOG_INFO, "Command '" + dropped.command.str() + why + ", not sent");
+      dropped.Finish(std::move(result));
+      return;
+    }
+  }
+  if (phase_ == PHASE_IDLE) return;
+  result.sent = phase_ == PHASE_REPLY;
+  if (in_flight_.followers) {
+    auto& followers = *in_flight_.followers;
+    auto it = std::find_if(followers.begin(), followers.end(), has_id);
+    if (it != followers.end()) {
+      PendingCommand follower = std::move(*it);
+      followers.erase(it);
+      AGILISPIEZO_LOG(LOG_INFO, "Command '" + follower.command.str() + why);
+      follower.Finish(std::move(result));
+      return;
+    }
+  }
+  if (in_flight_.call_id != call_id) return;
+
+  const bool needed = (in_flight_.followers && !in_flight_.followers->empty())
+    || (phase_ == PHASE_REPLY && in_flight_.command.HasOpcode(opcode::MA));
+  if (needed) {
+    // Answer the submitter now, the engine keeps the command for the others
+    PendingCommand submitter;
+    submitter.command = in_flight_.command;
+    submitter.promise = std::move(in_flight_.promise);
+    submitter.on_complete = std::move(in_flight_.on_complete);
+    in_flight_.promise = std::promise<CommandResult>();
+    in_flight_.call_id = 0;
+    AGILISPIEZO_LOG(LOG_INFO, "Command '" + submitter.command.str() + why);
+    submitter.Finish(std::move(result));
+    return;
+  }
+  if (phase_ == PHASE_PACING) {
+    ++timer_seq_;
+    timer_->cancel();
+    phase_ = PHASE_IDLE;
+    PendingCommand dropped = std::move(in_flight_);
+    AGILISPIEZO_LOG(LOG_INFO, "Command '" + dropped.command.str() + why + ", not sent");
+    dropped.Finish(std::move(result));
+    __Pump();
+    return;
+  }
+  // Nobody else waits: give up the reply, the next command is paced as after a timeout
+  AGILISPIEZO_LOG(LOG_INFO, "Command '" + in_flight_.command.str() + why +
+        ", no longer waiting for its reply");
+  __Complete(std::move(result));
+}
+
+void AgilisPiezo::__AddDeadline(const uint64_t call_id, const sclock::time_point deadline) const {
+  deadlines_.emplace(deadline, call_id);
+  if (deadline < deadline_armed_) __ArmDeadlineTimer();
+}
+
+void AgilisPiezo::__RemoveDeadline(const PendingCommand& cmd) const {
+  if (cmd.call_id == 0 || cmd.deadline == sclock::time_point::max()) return;
+  const auto range = deadlines_.equal_range(cmd.deadline);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == cmd.call_id) {
+      deadlines_.erase(it);
+      return;
+    }
+  }
+}
+
+void AgilisPiezo::__ArmDeadlineTimer() const {
+  deadline_armed_ = deadlines_.begin()->first;
+  // Replaces the wait for a later deadline, whose handler then sees operation_aborted
+  deadline_timer_->expires_at(deadline_armed_);
+  deadline_timer_->async_wait(asio::bind_executor(*strand_,
+    [this](const std::error_code& ec) {
+      if (!ec) __OnDeadlines();
+    }));
+}
+
+void AgilisPiezo::__OnDeadlines() const {
+  deadline_armed_ = sclock::time_point::max();
+  const sclock::time_point now = sclock::now();
+  while (!deadlines_.empty() && deadlines_.begin()->first <= now) {
+    const uint64_t id = deadlines_.begin()->second;
+    deadlines_.erase(deadlines_.begin());
+    __Abandon(id, true);
+  }
+  if (!deadlines_.empty()) __ArmDeadlineTimer();
+}
+
+bool AgilisPiezo::__CheckAxis(const char* caller, const int axis) const {
+  if (axis == 1 || axis == 2) return true;
+  AGILISPIEZO_LOG(LOG_ERROR, std::string(caller) + ": Invalid axis (must be 1 or 2)");
+  return false;
+}
+
+bool AgilisPiezo::__CheckArgument(const bool valid, const char* message) const {
+  if (!valid) AGILISPIEZO_LOG(LOG_ERROR, message);
+  return valid;
+}
+
+void AgilisPiezo::__AsyncSubmit(const CallOptions& options, const Command& command,
+  const bool expect_reply, const int timeout_ms, AsyncResultDone done) const {
+  PendingCommand cmd;
+  cmd.command = command;
+  cmd.expect_reply = expect_reply;
+  cmd.timeout_ms = timeout_ms;
+  cmd.on_complete = [expect_reply, done](const CommandResult& r) {
+    asio::error_code ec;
+    if (r.cancelled) ec = asio::error::operation_aborted;
+    else if (r.expired) ec = asio::error::timed_out;
+    else if (r.rejected) ec = asio::error::in_progress;
+    else if (!r.sent) ec = asio::error::not_connected;
+    else if (expect_reply && !r.replied) ec = asio::error::timed_out;
+    done(ec, r);
+  };
+  __Submit(std::move(cmd), options);
+}
+
+void AgilisPiezo::__AsyncSet(const CallOptions& options, const Command& command,
+  std::function<void()> on_sent, AsyncSetDone done) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Sending '" + command.str() + "'");
+  __AsyncSubmit(options, command, false, kReplyTimeoutMs,
+    [on_sent, done](asio::error_code ec, const CommandResult&) {
+      if (!ec && on_sent) on_sent();
+      done(ec);
+    });
+}
+
+void AgilisPiezo::__AsyncGet(const CallOptions& options, const Command& command,
+  const int timeout_ms, std::function<void(int)> on_value, AsyncValueDone done) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Querying '" + command.str() + "'");
+  __AsyncSubmit(options, command, true, timeout_ms,
+    [this, command, on_value, done](asio::error_code ec, const CommandResult& r) {
+      int value = 0;
+      if (!ec) {
+        const ReplyStatus status = command.DecodeReply(r.reply, &value);
+        if (status != REPLY_OK) {
+          AGILISPIEZO_LOG(LOG_ERROR, "Reply to '" + command.str() + "': " + ReplyStatusText(status));
+          ec = MakeErrorCode(status);
+        }
+      }
+      if (!ec && on_value) on_value(value);
+      done(ec, value);
+    });
+}
+
+void AgilisPiezo::__StepMoveMeasure(std::shared_ptr<StepMove> move) const {
+  PendingCommand cmd;
+  cmd.command = Command(move->axis, opcode::TP);
+  cmd.expect_reply = true;
+  cmd.on_complete = [this, move](const CommandResult& r) {
+    int position = 0;
+    if (!r.replied || !Command(move->axis, opcode::TP).ParseReply(r.reply, &position)) {
+      AGILISPIEZO_LOG(LOG_ERROR, "MoveToStepCount: Failed to read the step count of axis " +
+            std::to_string(move->axis));
+      move->done.set_value(false);
+      return;
+    }
+    __StepMoveCorrect(move, position);
+  };
+  __Submit(std::move(cmd));
+}
+
+void AgilisPiezo::__StepMoveCorrect(
+  std::shared_ptr<StepMove> move, const int position) const {
+  const int axis = move->axis;
+  const int error = move->target - position;
+  if (std::abs(error) <= move->tolerance) {
+    AGILISPIEZO_LOG(LOG_INFO, "Axis " + std::to_string(axis) + " reached step count " +
+          std::to_string(position));
+    move->done.set_value(true);
+    return;
+  }
+  if (move->iterations_left-- <= 0) {
+    AGILISPIEZO_LOG(LOG_WARNING, "MoveToStepCount: Axis " + std::to_string(axis) +
+          " did not converge, " + std::to_string(error) + " steps off");
+    move->done.set_value(false);
+    return;
+  }
+
+  const bool forward = error > 0;
+  const bool coarse = std::abs(error) > move->profile.fine_window;
+  const int amplitude = coarse ? move->profile.coarse_amplitude : move->profile.fine_amplitude;
+  const int delay = coarse ? move->profile.coarse_delay : move->profile.fine_delay;
+  int cached = 0;
+  const bool amplitude_set = __GetCached(step_amplitude_[axis - 1][forward],
+    kTrackedStateMaxAgeMs, &cached) && cached == amplitude;
+  const bool delay_set = __GetCached(step_delay_[axis - 1],
+    kTrackedStateMaxAgeMs, &cached) && cached == delay;
+
+  // Settings and move in one write, checked by the trailing TE
+  PendingCommand cmd;
+  cmd.command = Command(opcode::TE);
+  cmd.expect_reply = true;
+  if (!amplitude_set) cmd.batch.push_back(Command(axis, opcode::SU).AppendSigned(forward, amplitude));
+  if (!delay_set) cmd.batch.push_back(Command(axis, opcode::DL).Append(delay));
+  cmd.batch.push_back(Command(axis, opcode::PR).AppendSigned(forward, std::abs(error)));
+  cmd.on_complete = [this, move, forward, amplitude, delay, amplitude_set, delay_set](
+    const CommandResult& r) {
+    const int axis = move->axis;
+    int e = ERRORCODE_NOERROR;
+    if (!r.replied || !Command(opcode::TE).ParseReply(r.reply, &e) || e != ERRORCODE_NOERROR) {
+      AGILISPIEZO_LOG(LOG_ERROR, "MoveToStepCount: Move of axis " + std::to_string(axis) +
+            " failed with error " + std::to_string(e));
+      move->done.set_value(false);
+      return;
+    }
+    if (!amplitude_set) __SetCached(&step_amplitude_[axis - 1][forward], amplitude);
+    if (!delay_set) __SetCached(&step_delay_[axis - 1], delay);
+    __AddMotionWaiter(axis, [this, move](int, bool completed) {
+      if (!completed) {
+        move->done.set_value(false);
+        return;
+      }
+      __StepMoveMeasure(move);
+    });
+  };
+  __Submit(std::move(cmd));
+}
+
+AgilisPiezo::PendingCommand AgilisPiezo::__NextScanPoll() const {
+  static const char* const kPolls[] = { opcode::TP, opcode::TS, opcode::TP };
+  const int poll = scan_->next_poll;
+  scan_->next_poll = (poll + 1) % 4;
+  PendingCommand cmd;
+  // PH reports the limits of both axes and takes no axis
+  cmd.command = poll == 3 ? Command(opcode::PH) : Command(scan_->options.axis, kPolls[poll]);
+  cmd.expect_reply = true;
+  cmd.poll = true;
+  const uint64_t id = scan_->id;
+  const Command command = cmd.command;
+  cmd.on_complete = [this, id, command](const CommandResult& r) {
+    __OnScanReply(id, command, r);
+  };
+  cmd.metrics = &metrics_;
+  cmd.submitted = cmd.taken = sclock::now();
+  metrics_.Count(cmd.command, COUNTER_SUBMITTED);
+  return cmd;
+}
+
+void AgilisPiezo::__OnScanReply(
+  const uint64_t id, const Command& command, const CommandResult& result) const {
+  if (!scan_ || scan_->id != id) return;
+  if (!result.sent) {
+    AGILISPIEZO_LOG(LOG_ERROR, "Jog scan stopped: port closed");
+    __EndScan(false);
+    return;
+  }
+  int v = 0;
+  if (!result.replied || !command.ParseReply(result.reply, &v)) return; // Next poll retries
+
+  const JogScanOptions& options = scan_->options;
+  if (command.HasOpcode(opcode::TP)) {
+    ScanSample sample;
+    sample.time = sclock::now();
+    sample.steps = v;
+    sample.status = scan_->status;
+    sample.at_limit = scan_->at_limit;
+    if (!scan_->ring->Push(sample)) ++scan_->dropped;
+    if (options.stop_at_steps
+      && (options.sign ? v >= options.stop_steps : v <= options.stop_steps)) {
+      AGILISPIEZO_LOG(LOG_INFO, "Jog scan reached " + std::to_string(v) + " steps");
+      __EndScan(true);
+    }
+  }
+  else if (command.HasOpcode(opcode::TS)) {
+    scan_->status = v;
+    if (v == AXISSTATUS_READY) {
+      AGILISPIEZO_LOG(LOG_INFO, "Jog scan ended: axis " + std::to_string(options.axis) + " stopped");
+      __EndScan(false);
+    }
+  }
+  else {
+    // PH: bit 0 axis 1, bit 1 axis 2
+    scan_->at_limit = (v & options.axis) != 0;
+    if (scan_->at_limit && options.stop_at_limit) {
+      AGILISPIEZO_LOG(LOG_INFO, "Jog scan reached the limit of axis " + std::to_string(options.axis));
+      __EndScan(true);
+    }
+  }
+}
+
+void AgilisPiezo::__EndScan(const bool stop) const {
+  const int axis = scan_->options.axis;
+  if (scan_->dropped > 0) {
+    AGILISPIEZO_LOG(LOG_WARNING, "Jog scan dropped " + std::to_string(scan_->dropped) +
+          " samples, the ring was full");
+  }
+  scan_.reset();
+  scanning_ = false;
+  __ClearCached(&jog_speed_[axis - 1]);
+  if (stop) {
+    PendingCommand cmd;
+    cmd.command = Command(axis, opcode::ST);
+    __Submit(std::move(cmd));
+  }
+}
+
+void AgilisPiezo::__StopEngine() {
+  std::deque<PendingCommand> dropped;
+  std::vector<MotionWaiter> waiters;
+  __RunOnEngine([&]() {
+    {
+      std::lock_guard<std::mutex> l(queue_m_);
+      engine_stop_ = true;
+      dropped.swap(queue_);
+      waiters.swap(motion_waiters_);
+    }
+    scan_.reset();
+    scanning_ = false;
+    ++timer_seq_;
+    timer_->cancel();
+    deadline_timer_->cancel();
+    deadlines_.clear();
+    deadline_armed_ = sclock::time_point::max();
+    if (phase_ != PHASE_IDLE) {
+      CommandResult result;
+      result.sent = phase_ == PHASE_REPLY;
+      phase_ = PHASE_IDLE;
+      in_flight_.Finish(result);
+      in_flight_ = PendingCommand(); // Releases its cancellation watch
+    }
+  });
+  // Fail whatever is left instead of talking to a closing port
+  for (auto& cmd : dropped) cmd.Finish(CommandResult());
+  for (auto& w : waiters) w.callback(w.axis, false);
+  // Drain handlers still queued on the strand, e.g. the cancelled timer
+  __RunOnEngine([]() {});
+}
+
+void AgilisPiezo::__RunOnEngine(const std::function<void()>& fn) const {
+  if (strand_->running_in_this_thread()) {
+    fn();
+    return;
+  }
+  std::promise<void> done;
+  asio::post(*strand_, [&fn, &done]() {
+    fn();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+void AgilisPiezo::__PauseEngine() const {
+  __RunOnEngine([this]() {
+    ++paused_;
+    if (phase_ == PHASE_PACING) {
+      // Not sent yet, keep its place in the queue
+      ++timer_seq_;
+      timer_->cancel();
+      phase_ = PHASE_IDLE;
+      if (!in_flight_.poll) {
+        std::lock_guard<std::mutex> l(queue_m_);
+        queue_.push_front(std::move(in_flight_));
+      }
+      else {
+        in_flight_.Finish(CommandResult());
+      }
+    }
+    else if (phase_ == PHASE_REPLY) {
+      // The reply cannot arrive on a port that is about to be replaced
+      CommandResult result;
+      result.sent = true;
+      __Complete(std::move(result));
+    }
+  });
+}
+
+void AgilisPiezo::__ResumeEngine() const {
+  asio::post(*strand_, [this]() {
+    --paused_;
+    __OnFrames(); // Drop frames that arrived while paused
+    __Pump();
+  });
+}
+
+void AgilisPiezo::__PostPump() const {
+  asio::post(*strand_, [this]() { __Pump(); });
+}
+
+void AgilisPiezo::__Pump() const {
+  if (phase_ != PHASE_IDLE || paused_ > 0) return;
+  if (IsBusy()) {
+    if (sclock::now() >= busy_deadline_) {
+      AGILISPIEZO_LOG(LOG_WARNING, "Long operation on axis " + std::to_string(busy_axis_.load()) +
+            " did not finish in time, accepting commands again");
+      __RemoveMotionWaiter(busy_waiter_);
+      __EndBusy();
+    }
+    else {
+      __RejectQueued();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    if (engine_stop_) return;
+    // While busy only ST may pass, the TS polls below keep watching the axis
+    const auto next = __NextQueued();
+    if (next != queue_.end() && (!IsBusy() || next->command.HasOpcode(opcode::ST))) {
+      in_flight_ = std::move(*next);
+      queue_.erase(next);
+      in_flight_.taken = sclock::now();
+      metrics_.Record(in_flight_.command, STAGE_QUEUE, in_flight_.taken - in_flight_.submitted);
+      std::vector<PendingCommand> duplicates = __TakeDuplicates(in_flight_, sclock::time_point::max());
+      if (!duplicates.empty()) {
+        if (!in_flight_.followers) in_flight_.followers = std::make_shared<std::vector<PendingCommand>>();
+        std::move(duplicates.begin(), duplicates.end(), std::back_inserter(*in_flight_.followers));
+      }
+    }
+    else if (scan_ && (motion_waiters_.empty() || !poll_waiters_next_)) {
+      // Idle slot: sample the jog scan, taking turns with motion waiters
+      poll_waiters_next_ = true;
+      in_flight_ = __NextScanPoll();
+    }
+    else if (!motion_waiters_.empty()) {
+      // Idle slot: poll the status of an axis somebody is waiting for
+      poll_waiters_next_ = false;
+      const bool other_axis_waited = std::any_of(
+        motion_waiters_.begin(), motion_waiters_.end(),
+        [this](const MotionWaiter& w) { return w.axis != poll_axis_; });
+      if (other_axis_waited) poll_axis_ = 3 - poll_axis_;
+      in_flight_ = PendingCommand();
+      in_flight_.command = Command(poll_axis_, opcode::TS);
+      in_flight_.expect_reply = true;
+      in_flight_.poll = true;
+      in_flight_.metrics = &metrics_;
+      in_flight_.submitted = in_flight_.taken = sclock::now();
+      metrics_.Count(in_flight_.command, COUNTER_SUBMITTED);
+    }
+    else {
+      return;
+    }
+  }
+
+  const int64_t remaintime = __PacingRemaining(in_flight_.priority == PRIORITY_STOP);
   if (remaintime > 0) {
-    __Log(LOG_DEBUG, "Waiting " + std::to_string(remaintime) + " ms before sending command");
-    std::this_thread::sleep_for(std::chrono::milliseconds(remaintime));
+    AGILISPIEZO_LOG(LOG_DEBUG, "Waiting " + std::to_string(remaintime) + " ms before sending command");
+    phase_ = PHASE_PACING;
+    __ArmTimer(remaintime);
+    return;
   }
-  
-  serial_->FlushSend();
-  __Log(LOG_DEBUG, "Sending command: " + command);
-  const size_t written_size = serial_->Send(command + "\r\n");
+  __SendInFlight();
+}
+
+void AgilisPiezo::__SendInFlight() const {
+  CommandResult result;
+  const sclock::time_point write_begin = sclock::now();
+  metrics_.Record(in_flight_.command, STAGE_PACING, write_begin - in_flight_.taken);
+  result.sent = in_flight_.batch.empty()
+    ? __SendCommand(in_flight_.command) : __SendBatch(in_flight_);
+  if (!result.sent) __OnLinkLost();
+  in_flight_.written = sclock::now();
+  metrics_.Record(in_flight_.command, STAGE_WRITE, in_flight_.written - write_begin);
+  if (result.sent && in_flight_.command.HasOpcode(opcode::MA)) {
+    // Ends when the reply arrives or times out, see __Complete()
+    __BeginBusy(in_flight_.command.Axis(), in_flight_.timeout_ms);
+  }
+  else if (result.sent && in_flight_.command.HasOpcode(opcode::PA)) {
+    const int axis = in_flight_.command.Axis();
+    __BeginBusy(axis, kLongOperationTimeoutMs);
+    busy_waiter_ = __AddMotionWaiter(axis, [this](int, bool) { __EndBusy(); });
+  }
+  if (!result.sent || !in_flight_.expect_reply) {
+    __Complete(std::move(result));
+    return;
+  }
+  awaiting_.Push(in_flight_.command);
+  AGILISPIEZO_LOG(LOG_DEBUG, "Waiting for response (timeout: " +
+        std::to_string(in_flight_.timeout_ms) + " ms)");
+  phase_ = PHASE_REPLY;
+  __ArmTimer(in_flight_.timeout_ms);
+  __OnFrames();
+}
+
+void AgilisPiezo::__OnFrames() const {
+  if (paused_ > 0) return;
+  std::string frame;
+  while (transport_->PopFrame(&frame)) {
+    const int match = awaiting_.Match(Reply::Decode(frame.data(), frame.size()));
+    for (int i = 0; i < match; ++i) {
+      // Answered in order, so the commands ahead will not get a reply any more
+      AGILISPIEZO_LOG(LOG_WARNING, "No response to '" + awaiting_.Front().str() + "'");
+      awaiting_.Pop();
+    }
+    if (match >= 0) awaiting_.Pop();
+    if (match >= 0 && phase_ == PHASE_REPLY && awaiting_.Empty()) {
+      AGILISPIEZO_LOG(LOG_DEBUG, "Got response: " + frame);
+      CommandResult result;
+      result.sent = true;
+      result.replied = true;
+      result.reply = std::move(frame);
+      __Complete(std::move(result));
+    }
+    else {
+      // A late reply of an earlier command
+      AGILISPIEZO_LOG(LOG_WARNING, "Discarding unexpected response: " + frame);
+    }
+  }
+  if (!transport_->IsListening()) {
+    // Fail over to the queue before the in-flight command pumps the next one
+    __OnLinkLost();
+    if (phase_ == PHASE_REPLY) {
+      AGILISPIEZO_LOG(LOG_ERROR, "Failed to get response (port closed)");
+      CommandResult result;
+      result.sent = true;
+      __Complete(std::move(result));
+    }
+  }
+}
+
+void AgilisPiezo::__ArmTimer(const int64_t ms) const {
+  const uint64_t seq = ++timer_seq_;
+  timer_->expires_after(std::chrono::milliseconds(ms));
+  timer_->async_wait(asio::bind_executor(*strand_,
+    [this, seq](const std::error_code& ec) {
+      if (ec || seq != timer_seq_) return;
+      if (phase_ == PHASE_PACING) {
+        __SendInFlight();
+      }
+      else if (phase_ == PHASE_REPLY) {
+        AGILISPIEZO_LOG(LOG_ERROR, "Failed to get response (timeout)");
+        CommandResult result;
+        result.sent = true;
+        __Complete(std::move(result));
+      }
+    }));
+}
+
+void AgilisPiezo::__Complete(CommandResult result) const {
+  ++timer_seq_;
+  timer_->cancel();
+  awaiting_.Clear(); // A late reply to a timed out command is discarded as unexpected
+  phase_ = PHASE_IDLE;
+  PendingCommand done = std::move(in_flight_);
+  if (done.command.HasOpcode(opcode::MA) && IsBusy()) __EndBusy();
+  if (result.replied) {
+    const sclock::time_point now = sclock::now();
+    last_reply_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+      now.time_since_epoch()).count();
+    const sclock::time_point first_byte = transport_->GetFirstByteTime();
+    // Serial clears the first byte time when the command is written
+    if (first_byte.time_since_epoch().count() != 0)
+      metrics_.Record(done.command, STAGE_FIRST_BYTE, first_byte - done.written);
+    metrics_.Record(done.command, STAGE_REPLY, now - done.written);
+    int e = ERRORCODE_NOERROR;
+    if (done.command == opcode::TE && __GetIntegerFromReturnValue(result.reply, done.command, &e))
+      metrics_.CountError(e);
+  }
+  __RemoveDeadline(done);
+  if (done.followers) {
+    for (const auto& f : *done.followers) __RemoveDeadline(f);
+  }
+  __UpdatePacing(done, result);
+  __NotifyMotionWaiters(done, result);
+  __UpdateEstimator(done, result);
+  std::vector<PendingCommand> duplicates;
+  if (result.replied) {
+    // Queued since done was written, or within the coalescing window before
+    const int64_t window = std::max<int64_t>(coalescing_window_, 0);
+    std::lock_guard<std::mutex> l(queue_m_);
+    duplicates = __TakeDuplicates(done, done.written + std::chrono::milliseconds(window));
+  }
+  for (auto& d : duplicates) d.Finish(result);
+  done.Finish(std::move(result));
+  __Pump();
+}
+
+int64_t AgilisPiezo::__PacingRemaining(const bool stop) const {
+  const int64_t term = cmd_term_.load();
+  // A new term or mode starts over from the full term, like after connecting
+  if (pacing_changed_.exchange(false) || pacing_mode_.load() == PACING_FIXED) pacing_gap_ = term;
+  int64_t gap = std::min(pacing_gap_, term);
+  if (stop && !pacing_after_reset_) gap = std::min(gap, adaptive_delay_.load());
+  return gap - static_cast<int64_t>(cmd_term_timer_.ElapsedMilli());
+}
+
+void AgilisPiezo::__BeginBusy(const int axis, const int timeout_ms) const {
+  AGILISPIEZO_LOG(LOG_INFO, "Controller busy with '" + in_flight_.command.str() + "'");
+  busy_deadline_ = sclock::now() + std::chrono::milliseconds(timeout_ms);
+  busy_waiter_ = 0;
+  busy_axis_ = axis;
+  __RejectQueued();
+}
+
+void AgilisPiezo::__EndBusy() const {
+  busy_axis_ = 0;
+  AGILISPIEZO_LOG(LOG_INFO, "Controller no longer busy");
+}
+
+void AgilisPiezo::__RejectQueued() const {
+  std::vector<PendingCommand> rejected;
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    if (busy_policy_ != BUSY_REJECT || !IsBusy()) return;
+    auto it = std::stable_partition(queue_.begin(), queue_.end(),
+      [](const PendingCommand& c) { return c.command.HasOpcode(opcode::ST); });
+    std::move(it, queue_.end(), std::back_inserter(rejected));
+    queue_.erase(it, queue_.end());
+  }
+  for (auto& cmd : rejected) {
+    AGILISPIEZO_LOG(LOG_WARNING, "Command '" + cmd.command.str() +
+          "' rejected: controller busy with MA or PA");
+    CommandResult result;
+    result.rejected = true;
+    cmd.Finish(std::move(result));
+  }
+}
+
+uint64_t AgilisPiezo::__AddMotionWaiter(const int axis, MotionCallback callback) const {
+  uint64_t id = 0;
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    if (!engine_stop_) {
+      MotionWaiter waiter;
+      waiter.id = id = next_waiter_id_++;
+      waiter.axis = axis;
+      waiter.callback = std::move(callback);
+      motion_waiters_.push_back(std::move(waiter));
+    }
+  }
+  if (id == 0) {
+    callback(axis, false);
+    return 0;
+  }
+  __PostPump();
+  return id;
+}
+
+bool AgilisPiezo::__RemoveMotionWaiter(const uint64_t id) const {
+  std::lock_guard<std::mutex> l(queue_m_);
+  auto it = std::find_if(motion_waiters_.begin(), motion_waiters_.end(),
+    [id](const MotionWaiter& w) { return w.id == id; });
+  if (it == motion_waiters_.end()) return false;
+  motion_waiters_.erase(it);
+  return true;
+}
+
+void AgilisPiezo::__NotifyMotionWaiters(
+  const PendingCommand& cmd, const CommandResult& result) const {
+  if (!cmd.command.HasOpcode(opcode::TS)) return;
+
+  const int axis = cmd.command.Axis();
+  int status = AXISSTATUS_READY;
+  if (result.sent && (!result.replied
+    || !__GetIntegerFromReturnValue(result.reply, cmd.command, &status))) {
+    return; // Lost or garbled reply, try again on the next poll
+  }
+  if (status != AXISSTATUS_READY) return;
+
+  std::vector<MotionWaiter> completed;
+  {
+    std::lock_guard<std::mutex> l(queue_m_);
+    auto it = std::stable_partition(motion_waiters_.begin(), motion_waiters_.end(),
+      [axis](const MotionWaiter& w) { return w.axis != axis; });
+    std::move(it, motion_waiters_.end(), std::back_inserter(completed));
+    motion_waiters_.erase(it, motion_waiters_.end());
+  }
+  for (auto& w : completed) w.callback(axis, result.sent);
+}
+
+void AgilisPiezo::__UpdateEstimator(
+  const PendingCommand& cmd, const CommandResult& result) const {
+  if (!result.sent) return;
+  if (!cmd.batch.empty()) {
+    // TE only reports the last command, so any error leaves the batch's axes unknown
+    int e = ERRORCODE_NOERROR;
+    const bool accepted = result.replied && cmd.command.ParseReply(result.reply, &e)
+      && e == ERRORCODE_NOERROR;
+    for (const auto& c : cmd.batch) {
+      __InvalidateCached(c);
+      if (accepted) estimator_.OnCommand(c, cmd.written);
+      else estimator_.Invalidate(c.Axis());
+    }
+    return;
+  }
+  __InvalidateCached(cmd.command);
+  estimator_.OnCommand(cmd.command, cmd.written);
+  if (result.replied) estimator_.OnReply(cmd.command, result.reply, cmd.written, sclock::now());
+}
+
+void AgilisPiezo::__UpdatePacing(
+  const PendingCommand& cmd, const CommandResult& result) const {
+  const int64_t term = cmd_term_.load();
+  pacing_after_reset_ = cmd.command == opcode::RS;
+  if (pacing_mode_.load() == PACING_FIXED || cmd.command == opcode::RS) {
+    pacing_gap_ = term;
+    return;
+  }
+  int64_t delay = std::min(adaptive_delay_.load(), term);
+
+  bool overrun = false;
+  if (cmd.expect_reply && !result.replied) {
+    overrun = true;
+  }
+  else if (cmd.command == opcode::TE && result.replied) {
+    int e = ERRORCODE_NOERROR;
+    if (__GetIntegerFromReturnValue(result.reply, cmd.command, &e)) {
+      if (e == ERRORCODE_UNKNOWN_COMMAND || e == ERRORCODE_WRONG_FORMAT_FOR_PARAMETER) {
+        overrun = true;
+      }
+      else if (e == ERRORCODE_NOERROR && delay > kAdaptiveMinDelayMs) {
+        --delay;
+      }
+    }
+  }
+
+  if (overrun) {
+    delay = std::min(std::max(delay * 2, kAdaptiveMinDelayMs), term);
+    AGILISPIEZO_LOG(LOG_WARNING, "Possible command overrun after '" + cmd.command.str() +
+          "', adaptive delay backed off to " + std::to_string(delay) + " ms");
+    pacing_gap_ = term;
+  }
+  else if (cmd.expect_reply) {
+    // The reply terminator proves the controller has consumed the command
+    pacing_gap_ = 0;
+  }
+  else {
+    pacing_gap_ = delay;
+  }
+  adaptive_delay_ = delay;
+}
+
+bool AgilisPiezo::__GetCached(
+  const CachedValue& entry, const int64_t max_age_ms, int* out) const {
+  if (max_age_ms <= 0) return false;
+  std::lock_guard<std::mutex> l(cache_m_);
+  if (!entry.valid || sclock::now() - entry.at > std::chrono::milliseconds(max_age_ms))
+    return false;
+  *out = entry.value;
+  return true;
+}
+
+void AgilisPiezo::__SetCached(CachedValue* entry, const int value) const {
+  std::lock_guard<std::mutex> l(cache_m_);
+  entry->valid = true;
+  entry->value = value;
+  entry->at = sclock::now();
+}
+
+void AgilisPiezo::__ClearCached(CachedValue* entry) const {
+  std::lock_guard<std::mutex> l(cache_m_);
+  entry->valid = false;
+}
+
+void AgilisPiezo::__InvalidateCached(const Command& command) const {
+  const CommandPriority priority = command.Priority();
+  if (priority == PRIORITY_TELEMETRY) return;
+  if (command == opcode::RS || command == opcode::ML || command.HasOpcode(opcode::CC)) {
+    __ClearCache();
+    return;
+  }
+  // Without an axis digit, count the command against both axes
+  const int axis = command.Axis();
+  const int first = axis == 2 ? 1 : 0;
+  const int last = axis == 1 ? 1 : 2;
+  std::lock_guard<std::mutex> l(cache_m_);
+  for (int a = first; a < last; ++a) {
+    if (priority != PRIORITY_CONFIG) jog_speed_[a].valid = false;
+    else if (command.HasOpcode(opcode::DL)) step_delay_[a].valid = false;
+    else if (command.HasOpcode(opcode::SU)) {
+      for (auto& e : step_amplitude_[a]) e.valid = false;
+    }
+  }
+}
+
+void AgilisPiezo::__ClearCache() const {
+  std::lock_guard<std::mutex> l(cache_m_);
+  for (auto& e : step_delay_) e.valid = false;
+  for (auto& axis : step_amplitude_) for (auto& e : axis) e.valid = false;
+  for (auto& e : jog_speed_) e.valid = false;
+  channel_.valid = false;
+  version_.valid = false;
+  version_text_.clear();
+}
+
+bool AgilisPiezo::__SendCommand(const Command& command) const {
+  // The output is not flushed first: the previous line may still be draining
+  // and cutting its tail would merge it with this one
+  AGILISPIEZO_LOG(LOG_DEBUG, "Sending command: " + command.str());
+  const size_t written_size = transport_->Send(command.Line());
   cmd_term_timer_.Start();
   
   if (written_size != command.size() + 2) {
-    __Log(LOG_ERROR, "Failed to send command: wrote " + 
+    AGILISPIEZO_LOG(LOG_ERROR, "Failed to send command: wrote " + 
           std::to_string(written_size) + " bytes, expected " + 
           std::to_string(command.size() + 2));
     return false;
@@ -463,66 +2205,76 @@ bool AgilisPiezo::__SendCommand(const std::string& command, int* error_code) con
   return true;
 }
 
-inline bool AgilisPiezo::__GetReturnValue(std::string& buf, const int timeout_ms) const {
-  __Log(LOG_DEBUG, "Waiting for response (timeout: " + std::to_string(timeout_ms) + " ms)");
-  const bool ret = serial_->ListenUntil(&buf, "\r\n", timeout_ms);
-  serial_->FlushListen();
-  
-  if (!ret) {
-    __Log(LOG_ERROR, "Failed to get response (timeout)");
-  } else {
-    __Log(LOG_DEBUG, "Got response: " + buf);
+bool AgilisPiezo::__SendBatch(const PendingCommand& cmd) const {
+  std::vector<asio::const_buffer> lines;
+  lines.reserve(cmd.batch.size() + 1);
+  size_t expected_size = 0;
+  for (const auto& c : cmd.batch) {
+    lines.push_back(c.Line());
+    expected_size += c.size() + 2;
   }
-  
-  return ret;
-}
+  lines.push_back(cmd.command.Line());
+  expected_size += cmd.command.size() + 2;
 
-inline bool AgilisPiezo::__GetIntegerFromReturnValue(
-  const std::string& buf, const std::string& command, int* out) const {
-  const size_t begin = buf.find(command);
-  if (begin == std::string::npos) {
-    __Log(LOG_ERROR, "Failed to find command '" + command + "' in response");
-    return false;
-  }
+  AGILISPIEZO_LOG(LOG_DEBUG, "Sending batch of " + std::to_string(cmd.batch.size()) +
+        " commands and " + cmd.command.str());
+  const size_t written_size = transport_->Send(lines);
+  cmd_term_timer_.Start();
   
-  const size_t end = buf.find("\r\n");
-  if (end == std::string::npos) {
-    __Log(LOG_ERROR, "Failed to find end marker in response");
+  if (written_size != expected_size) {
+    AGILISPIEZO_LOG(LOG_ERROR, "Failed to send batch: wrote " + 
+          std::to_string(written_size) + " bytes, expected " + 
+          std::to_string(expected_size));
     return false;
   }
   
-  std::string int_str = buf.substr(begin + command.size(), end - (begin + command.size()));
-  try {
-    *out = std::stoi(int_str);
-    return true;
-  } catch (const std::exception& err) {
-    __Log(LOG_ERROR, "Failed to convert '" + int_str + "' to integer: " + err.what());
+  return true;
+}
+
+inline bool AgilisPiezo::__GetIntegerFromReturnValue(
+  const std::string& buf, const Command& command, int* out) const {
+  const ReplyStatus status = command.DecodeReply(buf, out);
+  if (status != REPLY_OK) {
+    AGILISPIEZO_LOG(LOG_ERROR, "Failed to parse response to '" + command.str() + "': " +
+      ReplyStatusText(status));
     return false;
   }
+  return true;
 }
 
 void AgilisPiezo::SetLogCallback(LogCallback callback) {
-  log_callback_ = std::move(callback);
+  std::atomic_store(&log_callback_, callback ?
+    std::make_shared<const LogCallback>(std::move(callback)) : std::shared_ptr<const LogCallback>());
+}
+
+void AgilisPiezo::SetTraceRecorder(std::shared_ptr<TraceRecorder> recorder) {
+  std::lock_guard<std::mutex> l(transport_m_);
+  trace_ = std::move(recorder);
+  transport_->SetTraceRecorder(trace_);
+}
+
+bool AgilisPiezo::__IsLogEnabled(LogLevel level) const {
+  return level >= log_level_.load() && level < LOG_NONE;
 }
 
 void AgilisPiezo::__Log(LogLevel level, const std::string& message) const {
-  if (level >= log_level_) {
-    std::string level_str;
-    switch (level) {
-      case LOG_DEBUG: level_str = "DEBUG"; break;
-      case LOG_INFO: level_str = "INFO"; break;
-      case LOG_WARNING: level_str = "WARNING"; break;
-      case LOG_ERROR: level_str = "ERROR"; break;
-      default: level_str = "UNKNOWN"; break;
-    }
-
-    std::ostringstream ss;
-    ss << "[" << level_str << "] " << message;
-    if (log_callback_)
-      log_callback_(level, ss.str());
-    else
-      std::cout << ss.str() << std::endl;
+  if (!__IsLogEnabled(level)) return;
+
+  const char* level_str;
+  switch (level) {
+    case LOG_DEBUG: level_str = "[DEBUG] "; break;
+    case LOG_INFO: level_str = "[INFO] "; break;
+    case LOG_WARNING: level_str = "[WARNING] "; break;
+    case LOG_ERROR: level_str = "[ERROR] "; break;
+    default: level_str = "[UNKNOWN] "; break;
   }
+
+  // A snapshot, so the callback can be replaced while another thread logs
+  const std::shared_ptr<const LogCallback> callback = std::atomic_load(&log_callback_);
+  if (callback)
+    (*callback)(level, level_str + message);
+  else
+    std::cout << level_str << message << std::endl;
 }
 
 }
\ No newline at end of file
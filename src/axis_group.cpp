@@ -0,0 +1,240 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "axis_group.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <future>
+#include <map>
+
+namespace agilispiezo {
+
+namespace {
+bool BatchSucceeded(const AgilisPiezo::CommandResult& r) {
+  int e = AgilisPiezo::ERRORCODE_NOERROR;
+  return r.replied && Command(opcode::TE).ParseReply(r.reply, &e)
+    && e == AgilisPiezo::ERRORCODE_NOERROR;
+}
+
+int RemainingMs(const sclock::time_point deadline) {
+  const int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    deadline - sclock::now()).count();
+  return static_cast<int>(std::max<int64_t>(ms, 0));
+}
+}
+
+int AxisGroup::Add(std::shared_ptr<AgilisPiezo> controller, const int channel, const int axis) {
+  if (!controller || channel < 0 || channel > 4 || (axis != 1 && axis != 2)) return -1;
+  for (const auto& m : members_) {
+    if (m.controller != controller) continue;
+    if ((m.channel == 0) != (channel == 0)) return -1;
+    if (m.channel == channel && m.axis == axis) return -1;
+  }
+  Member member;
+  member.controller = std::move(controller);
+  member.channel = channel;
+  member.axis = axis;
+  members_.push_back(std::move(member));
+  return static_cast<int>(members_.size() - 1);
+}
+
+void AxisGroup::Clear() {
+  members_.clear();
+}
+
+size_t AxisGroup::size() const {
+  return members_.size();
+}
+
+const AxisGroup::Member& AxisGroup::GetMember(const size_t index) const {
+  return members_.at(index);
+}
+
+int AxisGroup::GetChannelSwitchCount() const {
+  return channel_switches_;
+}
+
+std::vector<AxisGroup::Plan> AxisGroup::__Plan(const std::vector<bool>& wanted) const {
+  std::vector<Plan> plans;
+  std::vector<std::map<int, std::vector<size_t>>> by_channel;
+  for (size_t i = 0; i < members_.size(); ++i) {
+    if (!wanted[i]) continue;
+    const Member& m = members_[i];
+    size_t p = 0;
+    while (p < plans.size() && plans[p].controller != m.controller.get()) ++p;
+    if (p == plans.size()) {
+      plans.emplace_back();
+      by_channel.emplace_back();
+      plans[p].controller = m.controller.get();
+      if (m.channel != 0 && !plans[p].controller->GetChannel(
+        &plans[p].current, AgilisPiezo::kTrackedStateMaxAgeMs)) {
+        plans[p].ok = false;
+      }
+    }
+    by_channel[p][m.channel].push_back(i);
+  }
+  // Visit the selected channel first, then the others in ascending order
+  for (size_t p = 0; p < plans.size(); ++p) {
+    auto selected = by_channel[p].find(plans[p].current);
+    if (selected != by_channel[p].end()) {
+      plans[p].channels.emplace_back(selected->first, std::move(selected->second));
+      by_channel[p].erase(selected);
+    }
+    for (auto& c : by_channel[p]) plans[p].channels.emplace_back(c.first, std::move(c.second));
+  }
+  return plans;
+}
+
+AgilisPiezo::CommandBatch AxisGroup::__Batch(Plan* plan, const int channel) {
+  AgilisPiezo::CommandBatch batch = plan->controller->Batch();
+  if (channel != 0 && channel != plan->current) {
+    batch.ChangeChannel(channel);
+    plan->current = channel;
+    ++channel_switches_;
+  }
+  return batch;
+}
+
+std::vector<bool> AxisGroup::MoveAll(const std::vector<int>& steps, const int move_timeout_ms) {
+  channel_switches_ = 0;
+  std::vector<bool> wanted(members_.size(), false);
+  // INT_MIN has no magnitude in int and is outside the Agilis range, so it fails the axis
+  for (size_t i = 0; i < members_.size() && i < steps.size(); ++i) {
+    wanted[i] = steps[i] != 0 && steps[i] != INT_MIN;
+  }
+  std::vector<Plan> plans = __Plan(wanted);
+
+  for (size_t round = 0;; ++round) {
+    // One write per controller: channel change and the moves of both axes
+    std::vector<std::future<AgilisPiezo::CommandResult>> sent(plans.size());
+    bool any = false;
+    for (size_t p = 0; p < plans.size(); ++p) {
+      Plan& plan = plans[p];
+      if (!plan.ok || round >= plan.channels.size()) continue;
+      AgilisPiezo::CommandBatch batch = __Batch(&plan, plan.channels[round].first);
+      for (const size_t i : plan.channels[round].second) {
+        batch.RelativeMove(members_[i].axis, steps[i] > 0, std::abs(steps[i]));
+      }
+      sent[p] = batch.SubmitAsync();
+      any = true;
+    }
+    if (!any) break;
+
+    // Every controller moves now, so the waits below overlap
+    const sclock::time_point deadline = sclock::now() + std::chrono::milliseconds(move_timeout_ms);
+    for (size_t p = 0; p < plans.size(); ++p) {
+      if (!sent[p].valid()) continue;
+      Plan& plan = plans[p];
+      plan.ok = BatchSucceeded(sent[p].get());
+      if (!plan.ok) continue;
+      for (const size_t i : plan.channels[round].second) {
+        if (!plan.controller->WaitForAxisReady(members_[i].axis, RemainingMs(deadline))) plan.ok = false;
+      }
+      if (plan.ok) plan.done = round + 1;
+    }
+  }
+
+  std::vector<bool> moved(members_.size(), true);
+  for (size_t i = 0; i < members_.size() && i < steps.size(); ++i) {
+    if (steps[i] == INT_MIN) moved[i] = false;
+  }
+  for (const auto& plan : plans) {
+    for (size_t round = plan.done; round < plan.channels.size(); ++round) {
+      for (const size_t i : plan.channels[round].second) moved[i] = false;
+    }
+  }
+  return moved;
+}
+
+std::vector<bool> AxisGroup::TellNumberOfStepsAll(std::vector<int>* out_steps) {
+  channel_switches_ = 0;
+  out_steps->assign(members_.size(), 0);
+  std::vector<bool> ok(members_.size(), false);
+  std::vector<Plan> plans = __Plan(std::vector<bool>(members_.size(), true));
+
+  struct Read {
+    size_t member;
+    std::shared_future<AgilisPiezo::CommandResult> selected; // Invalid without a switch
+    std::future<AgilisPiezo::CommandResult> reply;
+  };
+  std::vector<Read> reads;
+  reads.reserve(members_.size());
+  for (auto& plan : plans) {
+    if (!plan.ok) continue;
+    for (const auto& c : plan.channels) {
+      // Queued in order: the engine sends the reads of a channel after its CC
+      const bool switching = c.first != 0 && c.first != plan.current;
+      std::shared_future<AgilisPiezo::CommandResult> selected;
+      if (switching) selected = __Batch(&plan, c.first).SubmitAsync().share();
+      for (const size_t i : c.second) {
+        Read read;
+        read.member = i;
+        read.selected = selected;
+        read.reply = plan.controller->SubmitCommand(Command(members_[i].axis, opcode::TP), true);
+        reads.push_back(std::move(read));
+      }
+    }
+  }
+
+  for (auto& read : reads) {
+    const AgilisPiezo::CommandResult r = read.reply.get();
+    // A read after a failed switch is of another channel
+    if (read.selected.valid() && !BatchSucceeded(read.selected.get())) continue;
+    const Command command(members_[read.member].axis, opcode::TP);
+    ok[read.member] = r.replied && command.ParseReply(r.reply, &(*out_steps)[read.member]);
+  }
+  return ok;
+}
+
+bool AxisGroup::WaitAllReady(const int timeout_ms) {
+  const sclock::time_point deadline = sclock::now() + std::chrono::milliseconds(timeout_ms);
+  bool ready = true;
+  for (const auto& plan : __Plan(std::vector<bool>(members_.size(), true))) {
+    if (!plan.ok) {
+      ready = false;
+      continue;
+    }
+    // Only the selected channel can be moving
+    for (const auto& c : plan.channels) {
+      if (c.first != plan.current) continue;
+      for (const size_t i : c.second) {
+        if (!plan.controller->WaitForAxisReady(members_[i].axis, RemainingMs(deadline))) ready = false;
+      }
+    }
+  }
+  return ready;
+}
+
+bool AxisGroup::StopAll() {
+  std::vector<AgilisPiezo*> controllers;
+  for (const auto& m : members_) {
+    if (std::find(controllers.begin(), controllers.end(), m.controller.get()) == controllers.end())
+      controllers.push_back(m.controller.get());
+  }
+  std::vector<std::future<bool>> sent;
+  sent.reserve(controllers.size());
+  for (auto* c : controllers) sent.push_back(c->SubmitEmergencyStop());
+  bool all = true;
+  for (auto& f : sent) all = f.get() && all;
+  return all;
+}
+
+}
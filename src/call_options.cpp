@@ -0,0 +1,79 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "call_options.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+
+namespace agilispiezo {
+
+struct CancellationToken::State {
+  std::mutex m;
+  std::atomic<bool> cancelled{false};
+  uint64_t next_id = 0;
+  std::map<uint64_t, std::function<void()>> callbacks;
+};
+
+/// Ends one OnCancel() watch when the last handle is released.
+struct CancellationToken::Registration {
+  std::shared_ptr<State> state;
+  uint64_t id = 0;
+
+  ~Registration() {
+    // Waits for a Cancel() running the callback, so it never outlives us
+    std::lock_guard<std::mutex> l(state->m);
+    state->callbacks.erase(id);
+  }
+};
+
+CancellationToken CancellationToken::Create() {
+  CancellationToken token;
+  token.state_ = std::make_shared<State>();
+  return token;
+}
+
+void CancellationToken::Cancel() const {
+  if (!state_) return;
+  std::lock_guard<std::mutex> l(state_->m);
+  if (state_->cancelled.exchange(true)) return;
+  for (auto& c : state_->callbacks) c.second();
+  state_->callbacks.clear();
+}
+
+bool CancellationToken::IsCancelled() const {
+  return state_ && state_->cancelled.load();
+}
+
+std::shared_ptr<void> CancellationToken::OnCancel(std::function<void()> fn) const {
+  if (!state_) return nullptr;
+  std::unique_lock<std::mutex> l(state_->m);
+  if (state_->cancelled.load()) {
+    l.unlock();
+    fn();
+    return nullptr;
+  }
+  auto registration = std::make_shared<Registration>();
+  registration->state = state_;
+  registration->id = ++state_->next_id;
+  state_->callbacks.emplace(registration->id, std::move(fn));
+  return registration;
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "controller_pool.h"
+#include <algorithm>
+
+namespace agilispiezo {
+
+ControllerPool::ControllerPool(const size_t num_threads) {
+  work_ = std::make_unique<asio::executor_work_guard<asio::io_context::executor_type>>(io_.get_executor());
+  const size_t n = std::max<size_t>(1, num_threads);
+  for (size_t i = 0; i < n; ++i) {
+    threads_.emplace_back([this]() { io_.run(); });
+  }
+}
+
+ControllerPool::~ControllerPool() {
+  {
+    // Controllers disconnect and drain their engines while the threads still run
+    std::vector<std::shared_ptr<AgilisPiezo>> controllers;
+    {
+      std::lock_guard<std::mutex> l(m_);
+      controllers.swap(controllers_);
+    }
+  }
+  work_.reset();
+  io_.stop();
+  for (auto& t : threads_) {
+    if (t.joinable()) t.join();
+  }
+}
+
+std::shared_ptr<AgilisPiezo> ControllerPool::CreateController() {
+  auto controller = std::make_shared<AgilisPiezo>(io_);
+  std::lock_guard<std::mutex> l(m_);
+  controllers_.push_back(controller);
+  return controller;
+}
+
+std::vector<std::shared_ptr<AgilisPiezo>> ControllerPool::GetControllers() const {
+  std::lock_guard<std::mutex> l(m_);
+  return controllers_;
+}
+
+size_t ControllerPool::GetControllerCount() const {
+  std::lock_guard<std::mutex> l(m_);
+  return controllers_.size();
+}
+
+std::vector<ControllerPool::CommandResult> ControllerPool::Broadcast(
+  const Command& command, const bool expect_reply, const int timeout_ms) const {
+  const auto controllers = GetControllers();
+  return Scatter(std::vector<Command>(controllers.size(), command),
+    expect_reply, timeout_ms);
+}
+
+std::vector<ControllerPool::CommandResult> ControllerPool::Scatter(
+  const std::vector<Command>& commands, const bool expect_reply,
+  const int timeout_ms) const {
+  const auto controllers = GetControllers();
+  std::vector<std::future<CommandResult>> futures(controllers.size());
+  for (size_t i = 0; i < controllers.size() && i < commands.size(); ++i) {
+    if (commands[i].empty()) continue;
+    futures[i] = controllers[i]->SubmitCommand(commands[i], expect_reply, timeout_ms);
+  }
+  std::vector<CommandResult> results(controllers.size());
+  for (size_t i = 0; i < futures.size(); ++i) {
+    if (futures[i].valid()) results[i] = futures[i].get();
+  }
+  return results;
+}
+
+static std::vector<bool> Sent(
+  const std::vector<ControllerPool::CommandResult>& results) {
+  std::vector<bool> sent(results.size());
+  for (size_t i = 0; i < results.size(); ++i) sent[i] = results[i].sent;
+  return sent;
+}
+
+std::vector<bool> ControllerPool::RelativeMoveAll(
+  const int axis, const bool sign, const int steps) const {
+  if (axis != 1 && axis != 2) return std::vector<bool>(GetControllerCount(), false);
+  return Sent(Broadcast(Command(axis, opcode::PR).AppendSigned(sign, steps), false));
+}
+
+std::vector<bool> ControllerPool::RelativeMoveEach(
+  const int axis, const std::vector<int>& steps) const {
+  if (axis != 1 && axis != 2) return std::vector<bool>(GetControllerCount(), false);
+  std::vector<Command> commands(steps.size());
+  for (size_t i = 0; i < steps.size(); ++i) {
+    if (steps[i] == 0) continue;
+    commands[i] = Command(axis, opcode::PR).Append(steps[i]);
+  }
+  return Sent(Scatter(commands, false));
+}
+
+std::vector<bool> ControllerPool::StopMotionAll(const int axis) const {
+  if (axis != 1 && axis != 2) return std::vector<bool>(GetControllerCount(), false);
+  return Sent(Broadcast(Command(axis, opcode::ST), false));
+}
+
+std::vector<bool> ControllerPool::ZeroPositionAll(const int axis) const {
+  if (axis != 1 && axis != 2) return std::vector<bool>(GetControllerCount(), false);
+  return Sent(Broadcast(Command(axis, opcode::ZP), false));
+}
+
+std::vector<bool> ControllerPool::TellNumberOfStepsAll(
+  const int axis, std::vector<int>* out_steps) const {
+  const size_t n = GetControllerCount();
+  out_steps->assign(n, 0);
+  if (axis != 1 && axis != 2) return std::vector<bool>(n, false);
+  const Command command(axis, opcode::TP);
+  const auto results = Broadcast(command, true);
+  out_steps->resize(results.size(), 0);
+  std::vector<bool> ok(results.size(), false);
+  for (size_t i = 0; i < results.size(); ++i) {
+    ok[i] = results[i].replied && command.ParseReply(results[i].reply, &(*out_steps)[i]);
+  }
+  return ok;
+}
+
+std::vector<bool> ControllerPool::EmergencyStopAll() const {
+  const auto controllers = GetControllers();
+  std::vector<std::future<bool>> futures;
+  futures.reserve(controllers.size());
+  for (const auto& c : controllers) futures.push_back(c->SubmitEmergencyStop());
+  std::vector<bool> sent(futures.size());
+  for (size_t i = 0; i < futures.size(); ++i) sent[i] = futures[i].get();
+  return sent;
+}
+
+size_t ControllerPool::GetThreadCount() const {
+  return threads_.size();
+}
+
+asio::io_context& ControllerPool::GetIOContext() {
+  return io_;
+}
+
+}
@@ -0,0 +1,42 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "error.h"
+#include <string>
+
+namespace agilispiezo {
+
+namespace {
+
+class ReplyCategory : public asio::error_category {
+public:
+  const char* name() const noexcept override { return "agilispiezo.reply"; }
+  std::string message(int value) const override {
+    return ReplyStatusText(static_cast<ReplyStatus>(value));
+  }
+};
+
+}
+
+const asio::error_category& GetReplyCategory() {
+  static const ReplyCategory category;
+  return category;
+}
+
+}
@@ -0,0 +1,122 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "memory_transport.h"
+#include <algorithm>
+#include <cstring>
+
+namespace agilispiezo {
+
+MemoryTransport::MemoryTransport(Handler handler) : handler_(std::move(handler)) {
+}
+
+MemoryTransport::MemoryTransport(asio::io_context& io, Handler handler)
+  : Transport(io), handler_(std::move(handler)) {
+}
+
+MemoryTransport::~MemoryTransport() {
+  Disconnect();
+}
+
+bool MemoryTransport::Connect() {
+  if (IsOpen()) Disconnect();
+  {
+    std::lock_guard<std::mutex> l(m_);
+    open_ = true;
+    tx_.clear();
+    rx_.clear();
+  }
+  StartReadLoop();
+  return true;
+}
+
+bool MemoryTransport::IsOpen() const {
+  std::lock_guard<std::mutex> l(m_);
+  return open_;
+}
+
+void MemoryTransport::AsyncReadSome(const asio::mutable_buffer& buffer, ReadHandler handler) {
+  std::lock_guard<std::mutex> l(m_);
+  read_buffer_ = buffer;
+  read_handler_ = std::move(handler);
+  if (!open_) {
+    ReadHandler h = std::move(read_handler_);
+    read_handler_ = nullptr;
+    asio::post(GetIOContext(), [h]() { h(asio::error_code(asio::error::operation_aborted), 0); });
+    return;
+  }
+  if (!rx_.empty()) __CompleteRead();
+}
+
+size_t MemoryTransport::Write(const std::vector<asio::const_buffer>& writes, asio::error_code& ec) {
+  size_t written = 0;
+  std::string replies;
+  {
+    std::lock_guard<std::mutex> l(m_);
+    if (!open_) {
+      ec = asio::error::not_connected;
+      return 0;
+    }
+    for (const auto& b : writes) {
+      tx_.append(static_cast<const char*>(b.data()), b.size());
+      written += b.size();
+    }
+  }
+  // Run the handler without the lock, it may be slow or call back into us
+  size_t end;
+  std::string line;
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> l(m_);
+      end = tx_.find("\r\n");
+      if (end == std::string::npos) break;
+      line = tx_.substr(0, end);
+      tx_.erase(0, end + 2);
+    }
+    const std::string reply = handler_(line);
+    if (!reply.empty()) replies += reply + "\r\n";
+  }
+  if (!replies.empty()) {
+    std::lock_guard<std::mutex> l(m_);
+    rx_ += replies;
+    if (read_handler_) __CompleteRead();
+  }
+  return written;
+}
+
+void MemoryTransport::Close() {
+  std::lock_guard<std::mutex> l(m_);
+  open_ = false;
+  if (read_handler_) {
+    ReadHandler h = std::move(read_handler_);
+    read_handler_ = nullptr;
+    asio::post(GetIOContext(), [h]() { h(asio::error_code(asio::error::operation_aborted), 0); });
+  }
+}
+
+void MemoryTransport::__CompleteRead() {
+  const size_t n = std::min(rx_.size(), read_buffer_.size());
+  std::memcpy(read_buffer_.data(), rx_.data(), n);
+  rx_.erase(0, n);
+  ReadHandler h = std::move(read_handler_);
+  read_handler_ = nullptr;
+  // Complete like a socket would, never inside the caller's stack
+  asio::post(GetIOContext(), [h, n]() { h(asio::error_code(), n); });
+}
+
+}
@@ -0,0 +1,218 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace agilispiezo {
+
+namespace {
+
+constexpr const char* kOpcodeNames[Metrics::kOpcodes] = {
+  opcode::CC, opcode::DL, opcode::JA, opcode::MA, opcode::ML, opcode::MR,
+  opcode::MV, opcode::PA, opcode::PH, opcode::PR, opcode::RS, opcode::ST,
+  opcode::SU, opcode::TE, opcode::TP, opcode::TS, opcode::VE, opcode::ZP,
+  "??"
+};
+
+constexpr const char* kStageNames[STAGE_COUNT] = {
+  "queue", "pacing", "write", "first_byte", "reply"
+};
+
+constexpr const char* kCounterNames[COUNTER_COUNT] = {
+  "submitted", "sent", "replied", "timeout", "rejected", "coalesced"
+};
+
+// Prometheus bucket bounds in µs, folded from the fine histogram buckets
+constexpr uint64_t kExportBoundsUs[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 130000000
+};
+
+std::string EscapeLabel(const std::string& value) {
+  std::string escaped;
+  for (const char c : value) {
+    if (c == '\\' || c == '"') escaped += '\\';
+    if (c == '\n') {
+      escaped += "\\n";
+      continue;
+    }
+    escaped += c;
+  }
+  return escaped;
+}
+
+std::string Seconds(const uint64_t us) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%g", us / 1e6);
+  return buf;
+}
+
+}
+
+size_t LatencyHistogram::BucketIndex(const uint64_t us) {
+  if (us < 4) return static_cast<size_t>(us);
+  size_t e = 2;
+  while ((us >> (e + 1)) != 0) ++e;
+  const size_t i = (e - 1) * 4 + static_cast<size_t>((us >> (e - 2)) & 3);
+  return std::min(i, kBuckets - 1);
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(const size_t i) {
+  const size_t next = i + 1;
+  if (next < 4) return next;
+  return static_cast<uint64_t>(4 + next % 4) << (next / 4 - 1);
+}
+
+void LatencyHistogram::Record(const std::chrono::steady_clock::duration elapsed) {
+  const int64_t signed_us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+  const uint64_t us = signed_us < 0 ? 0 : static_cast<uint64_t>(signed_us);
+  buckets_[BucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_us_.fetch_add(us, std::memory_order_relaxed);
+  uint64_t max = max_us_.load(std::memory_order_relaxed);
+  while (us > max && !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) { }
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Load() const {
+  Snapshot s;
+  for (size_t i = 0; i < kBuckets; ++i) s.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+  s.count = count_.load(std::memory_order_relaxed);
+  s.sum_us = sum_us_.load(std::memory_order_relaxed);
+  s.max_us = max_us_.load(std::memory_order_relaxed);
+  return s;
+}
+
+void LatencyHistogram::Reset() {
+  for (auto& b : buckets_) b.store(0, std::memory_order_relaxed);
+  count_.store(0, std::memory_order_relaxed);
+  sum_us_.store(0, std::memory_order_relaxed);
+  max_us_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Snapshot::Percentile(const double q) const {
+  uint64_t total = 0;
+  for (const uint64_t b : buckets) total += b;
+  if (total == 0) return 0;
+  const uint64_t target = std::max<uint64_t>(1,
+    static_cast<uint64_t>(std::ceil(std::min(std::max(q, 0.0), 1.0) * total)));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; ++i) {
+    seen += buckets[i];
+    if (seen >= target) return std::min(BucketUpperBound(i), max_us);
+  }
+  return max_us;
+}
+
+size_t Metrics::OpcodeIndex(const Command& command) {
+  for (size_t i = 0; i + 1 < kOpcodes; ++i) {
+    if (command.HasOpcode(kOpcodeNames[i])) return i;
+  }
+  return kOpcodes - 1;
+}
+
+const char* Metrics::OpcodeName(const size_t index) {
+  return kOpcodeNames[std::min(index, kOpcodes - 1)];
+}
+
+void Metrics::Count(const Command& command, const MetricCounter counter) {
+  opcodes_[OpcodeIndex(command)].counters[counter].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::Record(const Command& command, const MetricStage stage,
+  const std::chrono::steady_clock::duration elapsed) {
+  opcodes_[OpcodeIndex(command)].stages[stage].Record(elapsed);
+}
+
+void Metrics::CountError(const int e) {
+  if (e >= -6 && e <= -1) te_errors_[-e].fetch_add(1, std::memory_order_relaxed);
+}
+
+MetricsSnapshot Metrics::Snapshot() const {
+  MetricsSnapshot snapshot;
+  for (size_t i = 0; i < kOpcodes; ++i) {
+    const PerOpcode& per = opcodes_[i];
+    if (per.counters[COUNTER_SUBMITTED].load(std::memory_order_relaxed) == 0) continue;
+    MetricsSnapshot::Opcode op;
+    op.opcode = kOpcodeNames[i];
+    for (size_t c = 0; c < COUNTER_COUNT; ++c) op.counters[c] = per.counters[c].load(std::memory_order_relaxed);
+    for (size_t s = 0; s < STAGE_COUNT; ++s) op.stages[s] = per.stages[s].Load();
+    snapshot.opcodes.push_back(std::move(op));
+  }
+  for (size_t e = 0; e < te_errors_.size(); ++e) snapshot.te_errors[e] = te_errors_[e].load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+void Metrics::Reset() {
+  for (auto& per : opcodes_) {
+    for (auto& c : per.counters) c.store(0, std::memory_order_relaxed);
+    for (auto& s : per.stages) s.Reset();
+  }
+  for (auto& e : te_errors_) e.store(0, std::memory_order_relaxed);
+}
+
+std::string MetricsSnapshot::ToPrometheus(const std::string& port) const {
+  const std::string port_label = "port=\"" + EscapeLabel(port) + "\"";
+  std::string out;
+
+  out += "# HELP agilispiezo_commands_total Commands by opcode and outcome.\n";
+  out += "# TYPE agilispiezo_commands_total counter\n";
+  for (const auto& op : opcodes) {
+    for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+      out += "agilispiezo_commands_total{" + port_label + ",opcode=\"" + op.opcode +
+        "\",outcome=\"" + kCounterNames[c] + "\"} " + std::to_string(op.counters[c]) + "\n";
+    }
+  }
+
+  out += "# HELP agilispiezo_stage_seconds Time spent in each stage of a command.\n";
+  out += "# TYPE agilispiezo_stage_seconds histogram\n";
+  for (const auto& op : opcodes) {
+    for (size_t s = 0; s < STAGE_COUNT; ++s) {
+      const LatencyHistogram::Snapshot& h = op.stages[s];
+      if (h.count == 0) continue;
+      const std::string labels = port_label + ",opcode=\"" + op.opcode +
+        "\",stage=\"" + kStageNames[s] + "\"";
+      uint64_t cumulative = 0;
+      size_t bucket = 0;
+      for (const uint64_t bound : kExportBoundsUs) {
+        while (bucket < LatencyHistogram::kBuckets
+          && LatencyHistogram::BucketUpperBound(bucket) <= bound) {
+          cumulative += h.buckets[bucket++];
+        }
+        out += "agilispiezo_stage_seconds_bucket{" + labels + ",le=\"" + Seconds(bound) +
+          "\"} " + std::to_string(cumulative) + "\n";
+      }
+      out += "agilispiezo_stage_seconds_bucket{" + labels + ",le=\"+Inf\"} " +
+        std::to_string(h.count) + "\n";
+      out += "agilispiezo_stage_seconds_sum{" + labels + "} " + Seconds(h.sum_us) + "\n";
+      out += "agilispiezo_stage_seconds_count{" + labels + "} " + std::to_string(h.count) + "\n";
+    }
+  }
+
+  out += "# HELP agilispiezo_te_errors_total Errors reported by TE.\n";
+  out += "# TYPE agilispiezo_te_errors_total counter\n";
+  for (size_t e = 1; e < te_errors.size(); ++e) {
+    out += "agilispiezo_te_errors_total{" + port_label + ",code=\"-" + std::to_string(e) +
+      "\"} " + std::to_string(te_errors[e]) + "\n";
+  }
+  return out;
+}
+
+}
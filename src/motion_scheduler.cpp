@@ -0,0 +1,118 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "motion_scheduler.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+
+namespace agilispiezo {
+
+MotionScheduler::MotionScheduler(AgilisPiezo& piezo) : piezo_(piezo) {
+}
+
+bool MotionScheduler::Add(const int channel, const int axis, const int steps) {
+  // INT_MIN has no magnitude in int, and the Agilis range is +-2147483647
+  if (channel < 1 || channel > 4 || (axis != 1 && axis != 2) || steps == INT_MIN) return false;
+  if (steps == 0) return true;
+  Move move;
+  move.channel = channel;
+  move.axis = axis;
+  move.steps = steps;
+  moves_.push_back(move);
+  return true;
+}
+
+void MotionScheduler::Clear() {
+  moves_.clear();
+}
+
+size_t MotionScheduler::GetMoveCount() const {
+  return moves_.size();
+}
+
+void MotionScheduler::SetOverlapAxes(const bool overlap) {
+  overlap_axes_ = overlap;
+}
+
+int MotionScheduler::GetChannelSwitchCount() const {
+  return channel_switches_;
+}
+
+bool MotionScheduler::Run(const int move_timeout_ms) {
+  std::vector<Move> moves;
+  moves.swap(moves_);
+  channel_switches_ = 0;
+  if (moves.empty()) return true;
+
+  int current = 0;
+  if (!piezo_.GetChannel(&current, AgilisPiezo::kTrackedStateMaxAgeMs)) return false;
+
+  // Visit the selected channel first, then the others in ascending order.
+  // stable_sort keeps the order of the moves of each axis.
+  std::stable_sort(moves.begin(), moves.end(),
+    [current](const Move& a, const Move& b) {
+      const int ka = a.channel == current ? 0 : a.channel;
+      const int kb = b.channel == current ? 0 : b.channel;
+      return ka < kb;
+    });
+
+  for (size_t begin = 0; begin < moves.size();) {
+    const int channel = moves[begin].channel;
+    size_t end = begin;
+    std::vector<int> axis_steps[2];
+    for (; end < moves.size() && moves[end].channel == channel; ++end) {
+      axis_steps[moves[end].axis - 1].push_back(moves[end].steps);
+    }
+    begin = end;
+
+    if (channel != current) {
+      if (!piezo_.ChangeChannel(channel, AgilisPiezo::kTrackedStateMaxAgeMs)) return false;
+      ++channel_switches_;
+      current = channel;
+    }
+
+    const size_t steps_count = std::max(axis_steps[0].size(), axis_steps[1].size());
+    for (size_t i = 0; i < steps_count; ++i) {
+      const int steps1 = i < axis_steps[0].size() ? axis_steps[0][i] : 0;
+      const int steps2 = i < axis_steps[1].size() ? axis_steps[1][i] : 0;
+      if (overlap_axes_) {
+        if (!__RunStep(steps1, steps2, move_timeout_ms)) return false;
+      }
+      else if (!__RunStep(steps1, 0, move_timeout_ms)
+        || !__RunStep(0, steps2, move_timeout_ms)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool MotionScheduler::__RunStep(
+  const int steps1, const int steps2, const int move_timeout_ms) {
+  if (steps1 == 0 && steps2 == 0) return true;
+  AgilisPiezo::CommandBatch batch = piezo_.Batch();
+  if (steps1 != 0) batch.RelativeMove(1, steps1 > 0, std::abs(steps1));
+  if (steps2 != 0) batch.RelativeMove(2, steps2 > 0, std::abs(steps2));
+  if (!batch.Submit()) return false;
+  // Both axes move at once, so the second wait is mostly covered by the first
+  return (steps1 == 0 || piezo_.WaitForAxisReady(1, move_timeout_ms))
+    && (steps2 == 0 || piezo_.WaitForAxisReady(2, move_timeout_ms));
+}
+
+}
@@ -0,0 +1,254 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "position_estimator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace agilispiezo {
+
+namespace {
+// TS results, see AgilisPiezo::AxisStatus
+constexpr int kStatusReady = 0;
+constexpr int kStatusStepping = 1;
+constexpr int kStatusJogging = 2;
+
+double Seconds(const PositionEstimator::Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+}
+
+double PositionEstimator::JogRate(const int jog_speed) {
+  double rate = 0;
+  switch (std::abs(jog_speed)) {
+  case 1: rate = 5; break;
+  case 2: rate = 100; break;
+  case 3: rate = kMaxStepRate; break;
+  case 4: rate = 666; break;
+  }
+  return jog_speed < 0 ? -rate : rate;
+}
+
+double PositionEstimator::StepRate(const int step_delay) {
+  return 1.0 / (1.0 / kMaxStepRate + std::max(step_delay, 0) * 10e-6);
+}
+
+void PositionEstimator::OnCommand(const Command& command, const Clock::time_point written) {
+  // Set-only commands carry their argument like a reply carries its value
+  const Reply parsed = Reply::Decode(command.data(), command.size());
+  const bool has_value = parsed.status == REPLY_OK;
+  const int value = parsed.value;
+  std::lock_guard<std::mutex> l(m_);
+  if (command == opcode::RS || command.HasOpcode(opcode::CC)) {
+    // Other actuators, or a restart: standing still with an unknown count
+    axes_[0] = Axis();
+    axes_[1] = Axis();
+    return;
+  }
+  if (command == opcode::ML) {
+    // The pushbuttons may move either axis
+    __Lose(&axes_[0]);
+    __Lose(&axes_[1]);
+    return;
+  }
+  const int axis = command.Axis();
+  if (axis != 1 && axis != 2) return;
+  Axis& a = axes_[axis - 1];
+
+  if (command.HasOpcode(opcode::DL)) {
+    if (has_value) a.step_delay = value;
+  }
+  else if (command.HasOpcode(opcode::JA)) {
+    if (!has_value) return;
+    if (a.motion == MOTION_STEP || a.motion == MOTION_UNKNOWN) {
+      __Lose(&a);
+      return;
+    }
+    __Fold(&a, written, value == 0);
+    a.motion = value == 0 ? MOTION_NONE : MOTION_JOG;
+    a.rate = JogRate(value);
+    a.start = written;
+    a.start_seen = false;
+    if (value != 0 && a.rate == 0) __Lose(&a);
+  }
+  else if (command.HasOpcode(opcode::PR)) {
+    if (!has_value || value == 0) return;
+    // The controller refuses PR while moving; without a count there is no target
+    if (a.motion != MOTION_NONE || !a.valid) {
+      __Lose(&a);
+      return;
+    }
+    a.motion = MOTION_STEP;
+    a.rate = value > 0 ? StepRate(a.step_delay) : -StepRate(a.step_delay);
+    a.end = a.base + value;
+    a.start = written;
+    a.start_seen = false;
+  }
+  else if (command.HasOpcode(opcode::ST)) {
+    if (a.motion == MOTION_JOG || a.motion == MOTION_STEP) __Fold(&a, written, true);
+    // Ready again, but a count lost to MV or PA needs TP first
+    a.motion = MOTION_NONE;
+  }
+  else if (command.HasOpcode(opcode::ZP)) {
+    if (a.motion == MOTION_UNKNOWN) return;
+    if (a.motion == MOTION_NONE) {
+      a.base_error = 0;
+      a.base_time = written;
+    }
+    else {
+      __Fold(&a, written, true);
+      a.end -= a.base;
+      a.start_seen = true;
+    }
+    a.base = 0;
+    a.valid = true;
+  }
+  else if (command.HasOpcode(opcode::MV) || command.HasOpcode(opcode::PA)
+    || command.HasOpcode(opcode::MA)) {
+    __Lose(&a);
+  }
+}
+
+void PositionEstimator::OnReply(const Command& command, const std::string& reply,
+  const Clock::time_point written, const Clock::time_point received) {
+  int value = 0;
+  if (!command.ParseReply(reply, &value)) return;
+  std::lock_guard<std::mutex> l(m_);
+  const int axis = command.Axis();
+  if (command.HasOpcode(opcode::MA)) {
+    // Measured and standing still, at a count only TP tells
+    if (axis == 1 || axis == 2) axes_[axis - 1].motion = MOTION_NONE;
+    return;
+  }
+  const double round_trip = Seconds(received - written);
+  latency_s_ = round_trip;
+  if (axis != 1 && axis != 2) return;
+  Axis& a = axes_[axis - 1];
+
+  if (command.HasOpcode(opcode::TP)) {
+    // Sampled somewhere within the round trip
+    const Clock::time_point middle = written + (received - written) / 2;
+    a.sampled = middle;
+    if (a.motion == MOTION_UNKNOWN) return;
+    a.valid = true;
+    a.base = value;
+    a.base_time = middle;
+    a.base_error = 0;
+    if (a.motion == MOTION_STEP && value == a.end) {
+      a.motion = MOTION_NONE;
+    }
+    else if (a.motion != MOTION_NONE) {
+      a.base_error = std::abs(a.rate) * round_trip / 2;
+      a.start_seen = true;
+    }
+  }
+  else if (command.HasOpcode(opcode::TS)) {
+    if (value == kStatusReady) {
+      if (a.motion == MOTION_STEP) {
+        // A PR always finishes at its target
+        a.base = a.end;
+        a.base_error = 0;
+        a.base_time = received;
+      }
+      else if (a.motion != MOTION_NONE) {
+        // A jog stopped by itself, e.g. at a limit, some time ago
+        a.valid = false;
+      }
+      a.motion = MOTION_NONE;
+    }
+    else if ((value == kStatusStepping && a.motion != MOTION_STEP)
+      || (value == kStatusJogging && a.motion != MOTION_JOG)
+      || value > kStatusJogging) {
+      __Lose(&a);
+    }
+  }
+  else if (command.HasOpcode(opcode::DL)) {
+    a.step_delay = value;
+  }
+  else if (command.HasOpcode(opcode::JA)) {
+    if (value == 0 && a.motion == MOTION_JOG) {
+      a.motion = MOTION_NONE;
+      a.valid = false;
+    }
+  }
+}
+
+void PositionEstimator::Invalidate(const int axis) {
+  std::lock_guard<std::mutex> l(m_);
+  if (axis != 2) __Lose(&axes_[0]);
+  if (axis != 1) __Lose(&axes_[1]);
+}
+
+void PositionEstimator::Reset() {
+  std::lock_guard<std::mutex> l(m_);
+  axes_[0] = Axis();
+  axes_[1] = Axis();
+}
+
+PositionEstimate PositionEstimator::Estimate(const int axis, const Clock::time_point at) const {
+  if (axis != 1 && axis != 2) return PositionEstimate();
+  std::lock_guard<std::mutex> l(m_);
+  return __Estimate(axes_[axis - 1], at);
+}
+
+PositionEstimate PositionEstimator::__Estimate(const Axis& a, const Clock::time_point at) const {
+  PositionEstimate e;
+  e.valid = a.valid;
+  e.sampled = a.sampled;
+  if (!a.valid) return e;
+  double steps = a.base;
+  double error = a.base_error;
+  if (a.motion == MOTION_JOG || a.motion == MOTION_STEP) {
+    const double elapsed = std::max(Seconds(at - std::max(a.start, a.base_time)), 0.0);
+    const double speed = std::abs(a.rate);
+    steps += a.rate * elapsed;
+    error += speed * (kRateTolerance * elapsed + (a.start_seen ? 0.0 : latency_s_));
+    e.moving = true;
+    if (a.motion == MOTION_STEP) {
+      // A PR never passes its target, so the count stays between base and end
+      if (a.rate > 0 ? steps >= a.end : steps <= a.end) {
+        steps = a.end;
+        e.moving = false;
+      }
+      const double low = std::min(a.base, a.end) - a.base_error;
+      const double high = std::max(a.base, a.end) + a.base_error;
+      error = std::min(error, std::max(steps - low, high - steps));
+    }
+  }
+  e.steps = static_cast<int>(std::lround(steps));
+  e.error = static_cast<int>(std::ceil(error + std::abs(steps - e.steps)));
+  return e;
+}
+
+void PositionEstimator::__Fold(Axis* a, const Clock::time_point at, const bool stop) const {
+  const PositionEstimate e = __Estimate(*a, at);
+  const bool moving = a->motion == MOTION_JOG || a->motion == MOTION_STEP;
+  a->base = e.steps;
+  // A stop lands somewhere within one round trip of being written
+  a->base_error = e.error + (stop && moving ? std::abs(a->rate) * latency_s_ : 0.0);
+  a->base_time = at;
+}
+
+void PositionEstimator::__Lose(Axis* a) const {
+  a->valid = false;
+  a->motion = MOTION_UNKNOWN;
+}
+
+}
@@ -0,0 +1,113 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tcp_transport.h"
+#include <future>
+#include <memory>
+
+// All transport messages are debug output, see transport.cpp.
+#ifndef AGILISPIEZO_MIN_LOG_LEVEL
+#define AGILISPIEZO_MIN_LOG_LEVEL 0
+#endif
+#define TCP_LOG(message) \
+  do { \
+    if (AGILISPIEZO_MIN_LOG_LEVEL <= 0 && IsLogEnabled()) Log(message); \
+  } while (0)
+
+namespace agilispiezo {
+
+TcpTransport::TcpTransport() : socket_(GetIOContext()) {
+}
+
+TcpTransport::TcpTransport(asio::io_context& io) : Transport(io), socket_(io) {
+}
+
+TcpTransport::~TcpTransport() {
+  Disconnect();
+}
+
+bool TcpTransport::Connect(const std::string& host, const unsigned short port,
+  const int timeout_ms,
+  const std::string& handshake_send,
+  const std::string& handshake_expect) {
+  if (IsOpen()) Disconnect();
+
+  asio::error_code ec;
+  asio::ip::tcp::resolver resolver(GetIOContext());
+  const auto endpoints = resolver.resolve(host, std::to_string(port), ec);
+  if (ec) {
+    TCP_LOG("Failed to resolve " + host + ": " + ec.message());
+    return false;
+  }
+
+  // Name lookup above is not bounded by timeout_ms, pass a numeric address to skip it.
+  // Connect asynchronously so an unreachable gateway cannot block for minutes.
+  auto done = std::make_shared<std::promise<asio::error_code>>();
+  std::future<asio::error_code> result = done->get_future();
+  asio::async_connect(socket_, endpoints,
+    [done](const asio::error_code& e, const asio::ip::tcp::endpoint&) { done->set_value(e); });
+  if (result.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready) {
+    TCP_LOG("Connecting to " + host + ":" + std::to_string(port) + " timed out");
+    // The connect is running on the I/O thread, so close the socket there
+    std::promise<void> closed;
+    asio::post(socket_.get_executor(), [this, &closed]() {
+      asio::error_code e;
+      socket_.close(e);
+      closed.set_value();
+    });
+    closed.get_future().wait();
+    result.wait();
+    return false;
+  }
+  ec = result.get();
+  if (ec) {
+    TCP_LOG("Failed to connect to " + host + ":" + std::to_string(port) + ": " + ec.message());
+    socket_.close(ec);
+    return false;
+  }
+
+  socket_.set_option(asio::ip::tcp::no_delay(true), ec);
+  socket_.set_option(asio::socket_base::keep_alive(true), ec);
+  TCP_LOG("Connected to " + host + ":" + std::to_string(port));
+  StartReadLoop();
+
+  if (Handshake(handshake_send, handshake_expect, timeout_ms)) return true;
+  Disconnect();
+  return false;
+}
+
+bool TcpTransport::IsOpen() const {
+  return socket_.is_open();
+}
+
+void TcpTransport::AsyncReadSome(const asio::mutable_buffer& buffer, ReadHandler handler) {
+  socket_.async_read_some(buffer, std::move(handler));
+}
+
+size_t TcpTransport::Write(const std::vector<asio::const_buffer>& writes, asio::error_code& ec) {
+  return asio::write(socket_, writes, ec);
+}
+
+void TcpTransport::Close() {
+  asio::error_code ec;
+  socket_.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+  socket_.close(ec);
+  TCP_LOG("Disconnected from TCP server");
+}
+
+}
@@ -0,0 +1,185 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "trace.h"
+#include <cstring>
+
+namespace agilispiezo {
+
+static_assert(sizeof(TraceEntry) == 64, "TraceEntry is stored as is in trace files");
+
+namespace {
+constexpr char kMagic[4] = { 'A', 'G', 'T', 'R' };
+constexpr size_t kHeaderSize = 16;
+// Entries written with one fwrite by the flush thread
+constexpr size_t kFlushChunk = 256;
+}
+
+TraceRecorder::TraceRecorder(const size_t capacity)
+  : start_(std::chrono::steady_clock::now()) {
+  size_t n = 1;
+  while (n < capacity) n <<= 1;
+  mask_ = n - 1;
+  slots_.reset(new Slot[n]);
+  for (size_t i = 0; i < n; ++i) slots_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+TraceRecorder::~TraceRecorder() {
+  StopFileFlush();
+}
+
+void TraceRecorder::Record(const TraceDirection direction, const char* data, const size_t size,
+  const uint8_t flags) {
+  const int64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start_).count();
+  // Bounded multi-producer queue: a slot is free for ticket pos once its
+  // sequence equals pos, and ready for the reader once it is pos + 1
+  size_t pos = enqueue_.load(std::memory_order_relaxed);
+  Slot* slot;
+  for (;;) {
+    slot = &slots_[pos & mask_];
+    const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence - pos);
+    if (diff == 0) {
+      if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    }
+    else if (diff < 0) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else {
+      pos = enqueue_.load(std::memory_order_relaxed);
+    }
+  }
+  TraceEntry& e = slot->entry;
+  e.time_ns = time_ns;
+  e.size = static_cast<uint16_t>(size < UINT16_MAX ? size : UINT16_MAX);
+  e.direction = static_cast<uint8_t>(direction);
+  e.flags = flags;
+  std::memcpy(e.data, data, e.StoredSize());
+  slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool TraceRecorder::Pop(TraceEntry* out) {
+  const size_t pos = dequeue_.load(std::memory_order_relaxed);
+  Slot& slot = slots_[pos & mask_];
+  if (slot.sequence.load(std::memory_order_acquire) != pos + 1) return false;
+  *out = slot.entry;
+  dequeue_.store(pos + 1, std::memory_order_relaxed);
+  slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+size_t TraceRecorder::GetCapacity() const {
+  return mask_ + 1;
+}
+
+uint64_t TraceRecorder::GetDroppedCount() const {
+  return dropped_.load(std::memory_order_relaxed);
+}
+
+bool TraceRecorder::StartFileFlush(const std::string& path, const int interval_ms) {
+  StopFileFlush();
+  std::FILE* file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) return false;
+  unsigned char header[kHeaderSize] = {};
+  std::memcpy(header, kMagic, 4);
+  const uint16_t version = kFileVersion;
+  const uint16_t entry_size = sizeof(TraceEntry);
+  std::memcpy(header + 4, &version, 2);
+  std::memcpy(header + 6, &entry_size, 2);
+  if (std::fwrite(header, 1, kHeaderSize, file) != kHeaderSize) {
+    std::fclose(file);
+    return false;
+  }
+  std::lock_guard<std::mutex> l(flush_m_);
+  file_ = file;
+  flush_stop_ = false;
+  flush_thread_ = std::thread([this, interval_ms]() { __FlushLoop(interval_ms); });
+  return true;
+}
+
+void TraceRecorder::StopFileFlush() {
+  {
+    std::lock_guard<std::mutex> l(flush_m_);
+    if (!flush_thread_.joinable()) return;
+    flush_stop_ = true;
+  }
+  flush_cv_.notify_all();
+  flush_thread_.join();
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+void TraceRecorder::__FlushLoop(const int interval_ms) {
+  TraceEntry chunk[kFlushChunk];
+  std::unique_lock<std::mutex> l(flush_m_);
+  for (;;) {
+    const bool stop = flush_cv_.wait_for(l, std::chrono::milliseconds(interval_ms),
+      [this]() { return flush_stop_; });
+    l.unlock();
+    size_t n = 0;
+    do {
+      for (n = 0; n < kFlushChunk && Pop(&chunk[n]); ++n) { }
+      if (n > 0) std::fwrite(chunk, sizeof(TraceEntry), n, file_);
+    } while (n == kFlushChunk);
+    std::fflush(file_);
+    if (stop) return;
+    l.lock();
+  }
+}
+
+TraceReader::~TraceReader() {
+  Close();
+}
+
+bool TraceReader::Open(const std::string& path, std::string* out_error) {
+  Close();
+  file_ = std::fopen(path.c_str(), "rb");
+  if (file_ == nullptr) {
+    if (out_error) *out_error = "Cannot open " + path;
+    return false;
+  }
+  unsigned char header[kHeaderSize] = {};
+  uint16_t version = 0;
+  uint16_t entry_size = 0;
+  if (std::fread(header, 1, kHeaderSize, file_) == kHeaderSize) {
+    std::memcpy(&version, header + 4, 2);
+    std::memcpy(&entry_size, header + 6, 2);
+  }
+  if (std::memcmp(header, kMagic, 4) != 0 || version != TraceRecorder::kFileVersion
+    || entry_size != sizeof(TraceEntry)) {
+    Close();
+    if (out_error) *out_error = path + " is not a version 1 trace file";
+    return false;
+  }
+  return true;
+}
+
+void TraceReader::Close() {
+  if (file_ == nullptr) return;
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+bool TraceReader::Next(TraceEntry* out) {
+  return file_ != nullptr && std::fread(out, sizeof(TraceEntry), 1, file_) == 1;
+}
+
+}
@@ -0,0 +1,387 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trajectory.h"
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN64) || defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace agilispiezo {
+
+namespace {
+constexpr char kMagic[4] = { 'A', 'G', 'T', 'J' };
+// Records per write; keeps one TE check short of the input buffer
+constexpr size_t kMaxBatchRecords = 16;
+
+uint16_t LoadU16(const unsigned char* p) {
+  return static_cast<uint16_t>(p[0] | p[1] << 8);
+}
+
+uint32_t LoadU32(const unsigned char* p) {
+  return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8
+    | static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+void StoreU16(unsigned char* p, const uint16_t v) {
+  p[0] = static_cast<unsigned char>(v);
+  p[1] = static_cast<unsigned char>(v >> 8);
+}
+
+void StoreU32(unsigned char* p, const uint32_t v) {
+  for (int i = 0; i < 4; ++i) p[i] = static_cast<unsigned char>(v >> (8 * i));
+}
+
+void WriteHeader(unsigned char* p, const uint32_t count) {
+  std::memcpy(p, kMagic, 4);
+  StoreU16(p + 4, TrajectoryFile::kVersion);
+  StoreU16(p + 6, static_cast<uint16_t>(TrajectoryFile::kRecordSize));
+  StoreU32(p + 8, count);
+  StoreU32(p + 12, 0);
+}
+
+bool IsOpcode(const char* op, const char* name) {
+  return op[0] == name[0] && op[1] == name[1];
+}
+
+/// Reason the record cannot be played, nullptr if it is fine.
+const char* CheckRecord(const TrajectoryRecord& r) {
+  if (r.axis != 1 && r.axis != 2) return "axis must be 1 or 2";
+  if (r.channel < 0 || r.channel > 4) return "channel must be 0 to 4";
+  if (IsOpcode(r.opcode, opcode::SU)) {
+    if (r.argument == 0 || r.argument < -50 || r.argument > 50) return "SU amplitude must be -50 to 50, not 0";
+  }
+  else if (IsOpcode(r.opcode, opcode::DL)) {
+    if (r.argument < 0 || r.argument > 200000) return "DL delay must be 0 to 200000";
+  }
+  else if (IsOpcode(r.opcode, opcode::PR) || IsOpcode(r.opcode, opcode::PA)) {
+    if (r.argument == INT_MIN) return "PR/PA steps must be -2147483647 to 2147483647";
+  }
+  else if (!IsOpcode(r.opcode, opcode::ZP) && !IsOpcode(r.opcode, opcode::ST)) {
+    return "opcode must be PR, PA, SU, DL, ZP or ST";
+  }
+  return nullptr;
+}
+
+std::string LineError(const size_t number, const char* message) {
+  return "line " + std::to_string(number) + ": " + message;
+}
+
+bool Fail(std::string* out_error, const std::string& message) {
+  if (out_error) *out_error = message;
+  return false;
+}
+}
+
+TrajectoryFile::~TrajectoryFile() {
+  Close();
+}
+
+bool TrajectoryFile::Open(const std::string& path, std::string* out_error) {
+  Close();
+#if defined(_WIN64) || defined(_WIN32)
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) return Fail(out_error, "Cannot open " + path);
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart < static_cast<LONGLONG>(kHeaderSize)) {
+    CloseHandle(file);
+    return Fail(out_error, path + " is not a trajectory file");
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) return Fail(out_error, "Cannot map " + path);
+  void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (data == nullptr) {
+    CloseHandle(mapping);
+    return Fail(out_error, "Cannot map " + path);
+  }
+  mapping_ = mapping;
+  size_ = static_cast<size_t>(size.QuadPart);
+#elif defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+  const int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return Fail(out_error, "Cannot open " + path);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(kHeaderSize)) {
+    ::close(fd);
+    return Fail(out_error, path + " is not a trajectory file");
+  }
+  void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) return Fail(out_error, "Cannot map " + path);
+  // Played front to back: let the kernel read ahead and drop pages behind
+  madvise(data, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+  size_ = static_cast<size_t>(st.st_size);
+#else
+  return Fail(out_error, "Memory mapped files are not supported on this platform");
+#endif
+  data_ = static_cast<const unsigned char*>(data);
+
+  const uint32_t count = LoadU32(data_ + 8);
+  if (std::memcmp(data_, kMagic, 4) != 0 || LoadU16(data_ + 4) != kVersion
+    || LoadU16(data_ + 6) != kRecordSize
+    || (size_ - kHeaderSize) / kRecordSize < count) {
+    Close();
+    return Fail(out_error, path + " is not a version 1 trajectory file");
+  }
+  count_ = count;
+  return true;
+}
+
+void TrajectoryFile::Close() {
+  if (data_ == nullptr) return;
+#if defined(_WIN64) || defined(_WIN32)
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_);
+  mapping_ = nullptr;
+#elif defined(__linux__) || defined(__unix__) || defined(__APPLE__)
+  munmap(const_cast<unsigned char*>(data_), size_);
+#endif
+  data_ = nullptr;
+  size_ = 0;
+  count_ = 0;
+}
+
+bool TrajectoryFile::IsOpen() const {
+  return data_ != nullptr;
+}
+
+size_t TrajectoryFile::GetRecordCount() const {
+  return count_;
+}
+
+bool TrajectoryFile::GetRecord(const size_t i, TrajectoryRecord* out) const {
+  if (i >= count_) return false;
+  const unsigned char* p = data_ + kHeaderSize + i * kRecordSize;
+  out->axis = p[0];
+  out->channel = p[1];
+  out->opcode[0] = static_cast<char>(p[2]);
+  out->opcode[1] = static_cast<char>(p[3]);
+  out->argument = static_cast<int32_t>(LoadU32(p + 4));
+  out->dwell_ms = LoadU32(p + 8);
+  return true;
+}
+
+bool TrajectoryFile::Compile(const std::string& text_path,
+  const std::string& binary_path, std::string* out_error) {
+  std::ifstream in(text_path);
+  if (!in) return Fail(out_error, "Cannot open " + text_path);
+  std::ofstream out(binary_path, std::ios::binary | std::ios::trunc);
+  if (!out) return Fail(out_error, "Cannot create " + binary_path);
+
+  unsigned char header[kHeaderSize];
+  WriteHeader(header, 0);
+  out.write(reinterpret_cast<const char*>(header), kHeaderSize);
+
+  uint32_t count = 0;
+  int channel = 0;
+  std::string line;
+  for (size_t number = 1; std::getline(in, line); ++number) {
+    const size_t comment = line.find('#');
+    if (comment != std::string::npos) line.erase(comment);
+    const char* p = line.c_str();
+    const char* last = p + line.size();
+    while (p != last && std::isspace(static_cast<unsigned char>(*p))) ++p;
+    if (p == last) continue;
+
+    TrajectoryRecord r;
+    r.channel = channel;
+    if (p != last && *p >= '0' && *p <= '9') r.axis = *p++ - '0';
+    if (last - p < 2) return Fail(out_error, LineError(number, "missing opcode"));
+    r.opcode[0] = static_cast<char>(std::toupper(static_cast<unsigned char>(p[0])));
+    r.opcode[1] = static_cast<char>(std::toupper(static_cast<unsigned char>(p[1])));
+    p += 2;
+    const bool takes_argument = !IsOpcode(r.opcode, opcode::ZP) && !IsOpcode(r.opcode, opcode::ST);
+    if (takes_argument) {
+      int argument = 0;
+      const ParseIntResult v = ParseInt(p, last, &argument);
+      if (v.status != REPLY_OK) return Fail(out_error, LineError(number, "missing or bad argument"));
+      r.argument = argument;
+      p = v.ptr;
+    }
+    if (IsOpcode(r.opcode, opcode::CC) && r.axis == 0) {
+      if (r.argument < 1 || r.argument > 4) return Fail(out_error, LineError(number, "channel must be 1 to 4"));
+      channel = r.argument;
+      continue;
+    }
+    while (p != last && std::isspace(static_cast<unsigned char>(*p))) ++p;
+    if (p != last) {
+      int dwell = 0;
+      const ParseIntResult v = ParseInt(p, last, &dwell);
+      if (v.status != REPLY_OK || dwell < 0) return Fail(out_error, LineError(number, "bad dwell"));
+      r.dwell_ms = static_cast<uint32_t>(dwell);
+      p = v.ptr;
+      while (p != last && std::isspace(static_cast<unsigned char>(*p))) ++p;
+      if (p != last) return Fail(out_error, LineError(number, "unexpected text after dwell"));
+    }
+    const char* error = CheckRecord(r);
+    if (error != nullptr) return Fail(out_error, LineError(number, error));
+
+    unsigned char record[kRecordSize];
+    record[0] = static_cast<unsigned char>(r.axis);
+    record[1] = static_cast<unsigned char>(r.channel);
+    record[2] = static_cast<unsigned char>(r.opcode[0]);
+    record[3] = static_cast<unsigned char>(r.opcode[1]);
+    StoreU32(record + 4, static_cast<uint32_t>(r.argument));
+    StoreU32(record + 8, r.dwell_ms);
+    out.write(reinterpret_cast<const char*>(record), kRecordSize);
+    if (++count == UINT32_MAX) return Fail(out_error, LineError(number, "too many records"));
+  }
+
+  // The count is only known at the end
+  WriteHeader(header, count);
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(header), kHeaderSize);
+  out.close();
+  if (!out) return Fail(out_error, "Cannot write " + binary_path);
+  return true;
+}
+
+TrajectoryPlayer::TrajectoryPlayer(AgilisPiezo& piezo)
+  : piezo_(piezo), batch_(piezo.Batch()) {
+}
+
+void TrajectoryPlayer::Stop() {
+  {
+    std::lock_guard<std::mutex> l(stop_m_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+}
+
+size_t TrajectoryPlayer::GetPlayedCount() const {
+  return played_;
+}
+
+bool TrajectoryPlayer::Play(const TrajectoryFile& trajectory, const int move_timeout_ms) {
+  stop_ = false;
+  played_ = 0;
+  batch_ = piezo_.Batch();
+  pending_ = std::future<AgilisPiezo::CommandResult>();
+  pending_count_ = 0;
+  moving_[0] = moving_[1] = false;
+
+  bool ok = trajectory.IsOpen();
+  int channel = 0; // Read from the controller on the first record with a channel
+  TrajectoryRecord r;
+  for (size_t i = 0; ok && i < trajectory.GetRecordCount(); ++i) {
+    if (stop_) {
+      ok = false;
+      break;
+    }
+    trajectory.GetRecord(i, &r);
+    if (CheckRecord(r) != nullptr) {
+      ok = false;
+      break;
+    }
+    if (r.channel != 0 && channel == 0) ok = piezo_.GetChannel(&channel, AgilisPiezo::kTrackedStateMaxAgeMs);
+    if (ok && r.channel != 0 && r.channel != channel) {
+      // Both actuators of the old channel stop before the switch
+      ok = __WaitAxis(1, move_timeout_ms) && __WaitAxis(2, move_timeout_ms)
+        && __Flush() && __WaitBatch() && piezo_.ChangeChannel(r.channel, AgilisPiezo::kTrackedStateMaxAgeMs);
+      channel = r.channel;
+    }
+    // A moving axis only accepts ST
+    if (ok && !IsOpcode(r.opcode, opcode::ST)) ok = __WaitAxis(r.axis, move_timeout_ms);
+    if (!ok) break;
+
+    const int axis = r.axis;
+    if (IsOpcode(r.opcode, opcode::PR)) {
+      batch_.RelativeMove(axis, r.argument >= 0, std::abs(r.argument));
+      moving_[axis - 1] = r.argument != 0;
+    }
+    else if (IsOpcode(r.opcode, opcode::PA)) {
+      // PA cannot be batched; the engine holds later commands back until it ends
+      ok = __Flush() && __WaitBatch() && piezo_.AbsoluteMove(axis, r.argument);
+      if (ok) ++played_;
+      moving_[axis - 1] = ok;
+    }
+    else if (IsOpcode(r.opcode, opcode::SU)) {
+      batch_.SetStepAmplitude(axis, r.argument > 0, std::abs(r.argument));
+    }
+    else if (IsOpcode(r.opcode, opcode::DL)) {
+      batch_.SetStepDelay(axis, r.argument);
+    }
+    else if (IsOpcode(r.opcode, opcode::ZP)) {
+      batch_.ZeroPosition(axis);
+    }
+    else {
+      batch_.StopMotion(axis);
+      moving_[axis - 1] = false;
+    }
+
+    if (ok && r.dwell_ms > 0) {
+      ok = __WaitAxis(axis, move_timeout_ms) && __Flush() && __WaitBatch();
+      if (ok) {
+        std::unique_lock<std::mutex> l(stop_m_);
+        ok = !stop_cv_.wait_for(l, std::chrono::milliseconds(r.dwell_ms),
+          [this]() { return stop_.load(); });
+      }
+    }
+    else if (ok && batch_.size() >= kMaxBatchRecords) {
+      ok = __Flush();
+    }
+  }
+  ok = ok && __WaitAxis(1, move_timeout_ms) && __WaitAxis(2, move_timeout_ms)
+    && __Flush() && __WaitBatch();
+  if (!ok) __WaitBatch(); // Nothing may be left queued once Play() returns
+  return ok;
+}
+
+bool TrajectoryPlayer::__Flush() {
+  if (batch_.size() == 0) return true;
+  if (!__WaitBatch()) return false;
+  pending_count_ = batch_.size();
+  pending_ = batch_.SubmitAsync();
+  batch_ = piezo_.Batch();
+  return true;
+}
+
+bool TrajectoryPlayer::__WaitBatch() {
+  if (!pending_.valid()) return true;
+  const AgilisPiezo::CommandResult result = pending_.get();
+  int e = AgilisPiezo::ERRORCODE_NOERROR;
+  const bool ok = result.replied && Command(opcode::TE).ParseReply(result.reply, &e)
+    && e == AgilisPiezo::ERRORCODE_NOERROR;
+  if (ok) played_ += pending_count_;
+  pending_count_ = 0;
+  return ok;
+}
+
+bool TrajectoryPlayer::__WaitAxis(const int axis, const int move_timeout_ms) {
+  if (!moving_[axis - 1]) return true;
+  // The move has to be on the wire before TS can tell that it ended
+  if (!__Flush() || !__WaitBatch()) return false;
+  // Wait for the other axis as well, so the next moves of both go out together
+  const bool other = moving_[2 - axis];
+  moving_[0] = moving_[1] = false;
+  return piezo_.WaitForAxisReady(axis, move_timeout_ms)
+    && (!other || piezo_.WaitForAxisReady(3 - axis, move_timeout_ms));
+}
+
+}
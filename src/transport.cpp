@@ -0,0 +1,426 @@
+/*
+ * libagilispiezo - A C++ library for controlling Newport Agilis Piezo Controllers
+ * Copyright (C) 2025 HIL Lab. Inc
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "transport.h"
+#include <string>
+#include <system_error>
+#include <thread>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
+
+// All transport messages are debug output. The message expression, including
+// hex dumps, is only evaluated when the owner enabled logging.
+#ifndef AGILISPIEZO_MIN_LOG_LEVEL
+#define AGILISPIEZO_MIN_LOG_LEVEL 0
+#endif
+#define TRANSPORT_LOG(message) \
+  do { \
+    if (AGILISPIEZO_MIN_LOG_LEVEL <= 0 && IsLogEnabled()) Log(message); \
+  } while (0)
+
+namespace agilispiezo {
+
+Transport::Transport()
+  : own_io_(std::make_unique<asio::io_context>()), io_(*own_io_) {
+  StartIOThread();
+}
+
+Transport::Transport(asio::io_context& io) : io_(io) {
+}
+
+Transport::~Transport() {
+  // Implementations disconnect in their own destructor, while the stream exists
+  if (own_io_) StopIOThread();
+}
+
+asio::io_context& Transport::GetIOContext() {
+  return io_;
+}
+
+void Transport::StartIOThread() {
+  // Create work object to keep io_service running
+  work_ = std::make_unique<asio::executor_work_guard<asio::io_context::executor_type>>(io_.get_executor());
+  
+  // Start io_service in background thread
+  io_thread_ = std::thread([this]() {
+    io_.run();
+  });
+}
+
+void Transport::StopIOThread() {
+  if (work_) {
+    work_.reset(); // Allow io_service to finish
+  }
+  
+  if (!io_.stopped()) {
+    io_.stop();
+  }
+  
+  if (io_thread_.joinable()) {
+    io_thread_.join();
+  }
+}
+
+bool Transport::Handshake(const std::string& handshake_send,
+  const std::string& handshake_expect, const int timeout_ms,
+  std::string* out_reply, const int settle_ms) {
+  if (handshake_expect.empty()) return true;
+  
+  if (settle_ms > 0) {
+    TRANSPORT_LOG("Waiting " + std::to_string(settle_ms) + "ms before handshake...");
+    std::this_thread::sleep_for(std::chrono::milliseconds(settle_ms));
+  }
+  
+  // Flush any existing data in buffer
+  FlushListen();
+  
+  TRANSPORT_LOG("Sending handshake: [" + EscapeString(handshake_send) + "] (hex: " + BytesToHex(handshake_send) + ")");
+  Send(handshake_send);
+  
+  TRANSPORT_LOG("Expecting handshake response ending with: [" + EscapeString(handshake_expect) + 
+      "] (hex: " + BytesToHex(handshake_expect) + ")");
+  
+  std::string rx;
+  if (ListenUntil(&rx, handshake_expect, timeout_ms)) {
+    TRANSPORT_LOG("Handshake successful");
+    if (out_reply) *out_reply = rx;
+    return true;
+  }
+  
+  TRANSPORT_LOG("Handshake failed");
+  if (!IsLogEnabled()) return false;
+  
+  // Give late bytes a chance to reach the read loop, only to log them
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  
+  std::string partial;
+  {
+    std::lock_guard<std::mutex> l(rx_m_);
+    for (const auto& frame : rx_frames_) partial += frame;
+    partial += RingToString(rx_head_, rx_tail_);
+  }
+  if (!partial.empty()) {
+    TRANSPORT_LOG("Read raw data (" + std::to_string(partial.size()) + " bytes): [" + 
+        EscapeString(partial) + "] (hex: " + BytesToHex(partial) + ")");
+  } else {
+    TRANSPORT_LOG("No data in buffer after timeout");
+  }
+  return false;
+}
+
+void Transport::Disconnect() {
+  if (!IsOpen()) return;
+  {
+    // Retire the read loop before the stream goes away
+    std::lock_guard<std::mutex> l(rx_m_);
+    ++rx_generation_;
+    rx_failed_ = true;
+    if (frame_callback_) frame_callback_();
+  }
+  rx_cv_.notify_all();
+  Close();
+  {
+    // The aborted read still references this object; wait for it to complete
+    std::unique_lock<std::mutex> l(rx_m_);
+    rx_cv_.wait(l, [this]() { return !rx_pending_ || io_.stopped(); });
+  }
+}
+
+bool Transport::IsConnected() {
+  return IsOpen() && IsListening();
+}
+
+size_t Transport::Send(const std::string& write) {
+  return Send(asio::buffer(write));
+}
+
+size_t Transport::Send(const asio::const_buffer& write) {
+  return Send(std::vector<asio::const_buffer>(1, write));
+}
+
+size_t Transport::Send(const std::vector<asio::const_buffer>& writes) {
+  if (!IsOpen()) {
+    TRANSPORT_LOG("Send failed: Port not open");
+    return 0;
+  }
+  
+  rx_first_byte_ = 0;
+  asio::error_code ec;
+  const size_t write_size = Write(writes, ec);
+  if (ec) {
+    TRANSPORT_LOG("Send error: " + ec.message());
+    return 0;
+  }
+  if (write_size > 0 && tracing_.load(std::memory_order_relaxed)) {
+    uint8_t flags = 0;
+    for (const auto& b : writes) {
+      Trace(TRACE_TX, static_cast<const char*>(b.data()), b.size(), flags);
+      flags = TRACE_FLAG_SAME_WRITE;
+    }
+  }
+  if (write_size > 0 && IsLogEnabled()) {
+    std::string data;
+    for (const auto& b : writes) data.append(static_cast<const char*>(b.data()), b.size());
+    TRANSPORT_LOG("Sent " + std::to_string(write_size) + " bytes: [" + EscapeString(data) + 
+        "] (hex: " + BytesToHex(data) + ")");
+  }
+  return write_size;
+}
+
+bool Transport::ListenUntil(std::string* read,
+  const std::string& delimiter,
+  const int timeout_ms) {
+  if (!IsOpen()) {
+    TRANSPORT_LOG("ListenUntil failed: Port not open");
+    return false;
+  }
+  
+  const auto start_time = std::chrono::steady_clock::now();
+  const auto deadline = start_time + std::chrono::milliseconds(timeout_ms);
+  std::string data;
+  std::string partial;
+  bool ok = false;
+  bool failed = false;
+  {
+    std::unique_lock<std::mutex> l(rx_m_);
+    for (;;) {
+      if (!rx_frames_.empty()) {
+        data += rx_frames_.front();
+        rx_frames_.pop_front();
+        if (data.size() >= delimiter.size()
+          && data.compare(data.size() - delimiter.size(), delimiter.size(), delimiter) == 0) {
+          ok = true;
+          break;
+        }
+        continue;
+      }
+      if (rx_failed_) {
+        failed = true;
+      }
+      else if (rx_cv_.wait_until(l, deadline) != std::cv_status::timeout
+        || !rx_frames_.empty()) {
+        continue;
+      }
+      // Keep consumed frames for the next listener
+      if (!data.empty()) rx_frames_.push_front(data);
+      partial = data + RingToString(rx_head_, rx_tail_);
+      break;
+    }
+  }
+  
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start_time).count();
+  
+  if (!ok) {
+    TRANSPORT_LOG(std::string(failed ? "ListenUntil failed: read loop stopped" : "ListenUntil timeout") +
+        " after " + std::to_string(elapsed) + "ms");
+    if (!partial.empty()) {
+      TRANSPORT_LOG("Received partial data (" + std::to_string(partial.size()) + 
+          " bytes): [" + EscapeString(partial) + "] (hex: " + BytesToHex(partial) + ")");
+    } else {
+      TRANSPORT_LOG("No partial data in receive buffer");
+    }
+    return false;
+  }
+  
+  *read = std::move(data);
+  TRANSPORT_LOG("Received " + std::to_string(read->size()) + " bytes in " + std::to_string(elapsed) + 
+      "ms: [" + EscapeString(*read) + "] (hex: " + BytesToHex(*read) + ")");
+  return true;
+}
+
+void Transport::StartReadLoop() {
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> l(rx_m_);
+    generation = ++rx_generation_;
+    rx_head_ = rx_tail_ = rx_scan_ = 0;
+    rx_frames_.clear();
+    rx_failed_ = false;
+  }
+  ReadSome(generation);
+}
+
+void Transport::ReadSome(const uint64_t generation) {
+  std::lock_guard<std::mutex> l(rx_m_);
+  if (generation != rx_generation_) return;
+  
+  if (rx_tail_ - rx_head_ == kRxRingSize) {
+    TRANSPORT_LOG("Receive buffer overflow without frame delimiter, dropping " + 
+        std::to_string(kRxRingSize) + " bytes");
+    rx_head_ = rx_scan_ = rx_tail_;
+  }
+  const size_t offset = rx_tail_ % kRxRingSize;
+  const size_t length = std::min(kRxRingSize - offset, kRxRingSize - (rx_tail_ - rx_head_));
+  rx_pending_ = true;
+  AsyncReadSome(asio::buffer(rx_ring_ + offset, length),
+    [this, generation](const asio::error_code& ec, size_t bytes) {
+      OnRead(generation, ec, bytes);
+    });
+}
+
+void Transport::OnRead(
+  const uint64_t generation, const asio::error_code& ec, const size_t bytes) {
+  std::string received;
+  {
+    std::lock_guard<std::mutex> l(rx_m_);
+    rx_pending_ = false;
+    if (generation != rx_generation_) {
+      rx_cv_.notify_all();
+      return;
+    }
+    if (ec) {
+      rx_failed_ = true;
+    }
+    else {
+      if (bytes > 0 && rx_first_byte_.load() == 0)
+        rx_first_byte_ = std::chrono::steady_clock::now().time_since_epoch().count();
+      if (IsLogEnabled()) received = RingToString(rx_tail_, rx_tail_ + bytes);
+      rx_tail_ += bytes;
+      // Split complete "\r\n" frames off the ring
+      for (; rx_scan_ + 1 < rx_tail_; ++rx_scan_) {
+        if (rx_ring_[rx_scan_ % kRxRingSize] == '\r'
+          && rx_ring_[(rx_scan_ + 1) % kRxRingSize] == '\n') {
+          rx_frames_.push_back(RingToString(rx_head_, rx_scan_ + 2));
+          if (tracing_.load(std::memory_order_relaxed))
+            Trace(TRACE_RX, rx_frames_.back().data(), rx_frames_.back().size());
+          rx_head_ = rx_scan_ + 2;
+          ++rx_scan_;
+        }
+      }
+    }
+    if (frame_callback_ && (ec || !rx_frames_.empty())) frame_callback_();
+  }
+  rx_cv_.notify_all();
+  
+  if (ec) {
+    TRANSPORT_LOG("Read loop stopped: " + ec.message());
+    return;
+  }
+  TRANSPORT_LOG("Read " + std::to_string(bytes) + " bytes: [" + EscapeString(received) + 
+      "] (hex: " + BytesToHex(received) + ")");
+  ReadSome(generation);
+}
+
+std::string Transport::RingToString(size_t begin, const size_t end) const {
+  std::string out;
+  out.reserve(end - begin);
+  for (; begin < end; ++begin) out += rx_ring_[begin % kRxRingSize];
+  return out;
+}
+
+bool Transport::PopFrame(std::string* frame) {
+  std::lock_guard<std::mutex> l(rx_m_);
+  if (rx_frames_.empty()) return false;
+  *frame = std::move(rx_frames_.front());
+  rx_frames_.pop_front();
+  return true;
+}
+
+bool Transport::IsListening() {
+  std::lock_guard<std::mutex> l(rx_m_);
+  return !rx_failed_;
+}
+
+std::chrono::steady_clock::time_point Transport::GetFirstByteTime() const {
+  return std::chrono::steady_clock::time_point(
+    std::chrono::steady_clock::duration(rx_first_byte_.load()));
+}
+
+void Transport::SetFrameCallback(FrameCallback callback) {
+  std::lock_guard<std::mutex> l(rx_m_);
+  frame_callback_ = std::move(callback);
+}
+
+void Transport::FlushListen() {
+  if (!IsOpen()) return;
+  
+  {
+    std::lock_guard<std::mutex> l(rx_m_);
+    rx_frames_.clear();
+    rx_head_ = rx_scan_ = rx_tail_;
+  }
+  DiscardInput();
+}
+
+void Transport::FlushSend() {
+  if (!IsOpen()) return;
+  DiscardOutput();
+}
+
+void Transport::SetTraceRecorder(std::shared_ptr<TraceRecorder> recorder) {
+  tracing_ = recorder != nullptr;
+  std::atomic_store(&trace_, std::move(recorder));
+}
+
+void Transport::Trace(const TraceDirection direction, const char* data, const size_t size,
+  const uint8_t flags) {
+  const std::shared_ptr<TraceRecorder> recorder = std::atomic_load(&trace_);
+  if (recorder) recorder->Record(direction, data, size, flags);
+}
+
+void Transport::SetLogCallback(LogCallback callback) {
+  log_callback_ = callback;
+}
+
+void Transport::SetLogEnabled(const bool enabled) {
+  log_enabled_ = enabled;
+}
+
+bool Transport::IsLogEnabled() const {
+  return log_enabled_ && log_callback_;
+}
+
+void Transport::Log(const std::string& message) {
+  if (log_callback_) {
+    log_callback_(message);
+  }
+}
+
+std::string Transport::BytesToHex(const std::string& data) {
+  std::ostringstream oss;
+  for (unsigned char c : data) {
+    oss << std::hex << std::setfill('0') << std::setw(2) << (int)c << " ";
+  }
+  return oss.str();
+}
+
+std::string Transport::EscapeString(const std::string& data) {
+  std::string result;
+  for (char c : data) {
+    switch (c) {
+      case '\r': result += "\\r"; break;
+      case '\n': result += "\\n"; break;
+      case '\t': result += "\\t"; break;
+      case '\\': result += "\\\\"; break;
+      default:
+        if (c >= 32 && c < 127) {
+          result += c;
+        } else {
+          std::ostringstream oss;
+          oss << "\\x" << std::hex << std::setfill('0') << std::setw(2) << (int)(unsigned char)c;
+          result += oss.str();
+        }
+    }
+  }
+  return result;
+}
+
+}